@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "ackbatch.h"
+
+
+// Helper; monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Helper; send a client its CUM_ACK, covering its window as it is now
+static void send_cum_ack(ack_batch* a, client_id id,
+  struct sockaddr_in const* addr, seq_window* win) {
+  uint8_t buf[64];
+  packet_info pi;
+
+
+  pi.type = CUM_ACK;
+  pi.id = id;
+  seq_window_read(win, &pi.cont.cum_ack_info.next,
+    &pi.cont.cum_ack_info.sack);
+
+  size_t len = flatten(&pi, buf, sizeof(buf));
+
+  if (sendto(a->fd, buf, len, 0, (struct sockaddr const*)addr,
+        sizeof(struct sockaddr_in)) == -1) {
+    perror("ack_batch: Unable to send ACK");
+  }
+
+  a->n_acked += win->unacked;
+  ++a->n_packets;
+  win->unacked = 0;
+}
+
+
+void ack_batch_init(ack_batch* a, int fd, unsigned delay_us) {
+  memset(a, 0, sizeof(ack_batch));
+
+  a->fd = fd;
+  a->delay_ns = (uint64_t)(delay_us < ACK_MAX_DELAY_US
+    ? delay_us : ACK_MAX_DELAY_US) * 1000;
+}
+
+
+void ack_batch_note(ack_batch* a, client_id id,
+  struct sockaddr_in const* addr, seq_window* win) {
+  // First of a batch; the delay starts with the first of all pending
+  if (win->unacked++ == 0) {
+    if (a->n_pending == ACK_PENDING) {
+      ack_batch_flush(a, true);
+    }
+
+    if (a->n_pending == 0) {
+      a->due_ns = now_ns() + a->delay_ns;
+    }
+
+    a->pending[a->n_pending].addr = *addr;
+    a->pending[a->n_pending].id = id;
+    a->pending[a->n_pending].win = win;
+    ++a->n_pending;
+  }
+
+  if (win->unacked >= ACK_BATCH) {
+    send_cum_ack(a, id, addr, win);
+  }
+}
+
+
+void ack_batch_flush(ack_batch* a, bool force) {
+  if (a->n_pending == 0 || (!force && now_ns() < a->due_ns)) {
+    return;
+  }
+
+  for (size_t i = 0; i < a->n_pending; ++i) {
+    ack_pending* p = &a->pending[i];
+
+    // Already sent, when its batch filled
+    if (p->win->unacked > 0) {
+      send_cum_ack(a, p->id, &p->addr, p->win);
+    }
+  }
+
+  a->n_pending = 0;
+}
+
+
+int ack_batch_timeout_ms(ack_batch const* a) {
+  uint64_t now;
+
+
+  if (a->n_pending == 0) {
+    return -1;
+  }
+
+  now = now_ns();
+  return a->due_ns <= now ? 0 : (a->due_ns - now + 999999) / 1000000;
+}
+
+
+void ack_batch_dump_stats(ack_batch const* a) {
+  fprintf(stderr, "ack: %lu requests acknowledged in %lu packets, delayed "
+    "up to %lu us\n", a->n_acked, a->n_packets, a->delay_ns / 1000);
+}
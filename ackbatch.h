@@ -0,0 +1,72 @@
+#ifndef ACKBATCH_H
+#define ACKBATCH_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/ip.h>
+
+#include "packet.h"
+#include "seqstate.h"
+
+
+// Delayed, cumulative acknowledgements. Instead of an ACK per request, a
+// client gets one CUM_ACK covering its whole receive window, once
+// ACK_BATCH of its requests have been accepted since the last one, or the
+// coalescing delay after the first request of the batch, whichever comes
+// first. Clients pipelining N requests thus see up to N times fewer ACKs;
+// verdicts still go out right away. The delay is kept well under a second,
+// so windows queued here can't be reclaimed as idle before they're sent
+// (see session.h). Not thread-safe.
+
+
+#define ACK_BATCH 16          // Requests per client acknowledged at most
+#define ACK_PENDING 1024      // Clients waiting before a forced flush
+#define ACK_MAX_DELAY_US 100000
+
+
+// A client owed a CUM_ACK
+typedef struct {
+  struct sockaddr_in addr;
+  client_id id;
+  seq_window* win;         // Its unacked count is reset when sent
+} ack_pending;
+
+
+typedef struct {
+  int fd;                  // Socket ACKs are sent from
+  uint64_t delay_ns;
+  ack_pending pending[ACK_PENDING];
+  size_t n_pending;        // May hold a client twice; the later is skipped
+  uint64_t due_ns;         // When the oldest pending ACK must go out
+  size_t n_acked;          // Statistics: requests acknowledged...
+  size_t n_packets;        // ...in this many packets
+} ack_batch;
+
+
+// Start delaying ACKs sent from socket 'fd' by up to 'delay_us'
+// microseconds (at most ACK_MAX_DELAY_US)
+void ack_batch_init(ack_batch* a, int fd, unsigned delay_us);
+
+
+// Note that a client's request was accepted into its window; the CUM_ACK
+// goes out now if the batch is full, else later
+void ack_batch_note(ack_batch* a, client_id id,
+  struct sockaddr_in const* addr, seq_window* win);
+
+
+// Send the pending ACKs if they're due, or regardless with 'force'
+void ack_batch_flush(ack_batch* a, bool force);
+
+
+// Return value: Milliseconds until pending ACKs are due (rounded up), or
+// -1 if none are pending; for use as a poll() timeout
+int ack_batch_timeout_ms(ack_batch const* a);
+
+
+// Print statistics
+void ack_batch_dump_stats(ack_batch const* a);
+
+
+#endif // ACKBATCH_H
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/sock_diag.h>
+
+#include "backpressure.h"
+
+
+// Helper; monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Helper; whether the socket's receive buffer is fuller than the threshold
+static bool buffer_full(backpressure const* b) {
+  uint32_t meminfo[SK_MEMINFO_VARS];
+  socklen_t len = sizeof(meminfo);
+
+
+  if (getsockopt(b->fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == -1
+      || len <= SK_MEMINFO_RCVBUF * sizeof(uint32_t)) {
+    return false;
+  }
+
+  return (uint64_t)meminfo[SK_MEMINFO_RMEM_ALLOC] * 100
+    > (uint64_t)meminfo[SK_MEMINFO_RCVBUF] * b->queue_pct;
+}
+
+
+bool backpressure_init(backpressure* b, int fd, size_t n_clients,
+  unsigned delay_ms, unsigned queue_pct, unsigned interval_us) {
+  memset(b, 0, sizeof(backpressure));
+
+  if ((b->told_ns = calloc(n_clients, sizeof(uint64_t))) == NULL) {
+    fprintf(stderr, "backpressure_init: Out of memory!\n");
+    return false;
+  }
+
+  b->fd = fd;
+  b->n_clients = n_clients;
+  b->delay_ns = (uint64_t)delay_ms * 1000000;
+  b->queue_pct = queue_pct;
+  b->interval_us = interval_us ? interval_us : DEFAULT_SLOW_INTERVAL_US;
+  b->min_queued_ns = UINT64_MAX;
+  b->all_full = true;
+  b->adjust_ns = now_ns() + BACKPRESSURE_ADJUST_MS * 1000000ULL;
+
+
+  return true;
+}
+
+
+void backpressure_destroy(backpressure* b) {
+  free(b->told_ns);
+  memset(b, 0, sizeof(backpressure));
+}
+
+
+void backpressure_sample(backpressure* b, uint64_t queued_ns) {
+  uint64_t now;
+  bool hot;
+
+
+  if (queued_ns < b->min_queued_ns) {
+    b->min_queued_ns = queued_ns;
+  }
+
+  if (b->queue_pct > 0 && b->until_sample-- == 0) {
+    b->until_sample = BACKPRESSURE_SAMPLE - 1;
+    b->all_full = b->all_full && buffer_full(b);
+    b->sampled = true;
+  }
+
+
+  // Ratchet the level up while a queue stands, and back down after
+  if ((now = now_ns()) < b->adjust_ns) {
+    return;
+  }
+
+  hot = (b->delay_ns > 0 && b->min_queued_ns > b->delay_ns)
+    || (b->sampled && b->all_full);
+
+  if (hot && b->level < BACKPRESSURE_MAX_LEVEL) {
+    ++b->level;
+  } else if (!hot && b->level > 0) {
+    --b->level;
+  }
+
+  if (b->level > b->max_level) {
+    b->max_level = b->level;
+  }
+
+  b->min_queued_ns = UINT64_MAX;
+  b->all_full = true;
+  b->sampled = false;
+  b->adjust_ns = now + BACKPRESSURE_ADJUST_MS * 1000000ULL;
+}
+
+
+void backpressure_note(backpressure* b, client_id id, size_t client,
+  struct sockaddr_in const* addr) {
+  uint8_t buf[64];
+  packet_info pi;
+  uint64_t now;
+
+
+  if (b->level == 0 || client >= b->n_clients) {
+    return;
+  }
+
+  now = now_ns();
+  if (b->told_ns[client] != 0
+      && now - b->told_ns[client] < SLOW_DOWN_HOLD_MS * 1000000ULL / 4) {
+    return;
+  }
+
+
+  pi.type = SLOW_DOWN;
+  pi.id = id;
+  pi.cont.slow_down_info.interval_us = b->interval_us << (b->level - 1);
+
+  size_t len = flatten(&pi, buf, sizeof(buf));
+
+  if (sendto(b->fd, buf, len, 0, (struct sockaddr const*)addr,
+        sizeof(struct sockaddr_in)) == -1) {
+    perror("backpressure: Unable to send SLOW_DOWN");
+    return;
+  }
+
+  b->told_ns[client] = now;
+  ++b->n_sent;
+}
+
+
+void backpressure_dump_stats(backpressure const* b) {
+  fprintf(stderr, "backpressure: level %u (highest %u), %lu SLOW_DOWNs "
+    "sent, asking for %u us between requests at level 1\n", b->level,
+    b->max_level, b->n_sent, b->interval_us);
+}
@@ -0,0 +1,82 @@
+#ifndef BACKPRESSURE_H
+#define BACKPRESSURE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/ip.h>
+
+#include "packet.h"
+
+
+// Telling clients to slow down when the server falls behind, so a fleet of
+// them settles at what it can serve instead of piling on retries. Like
+// CoDel, it looks for a standing queue rather than bursts: the server was
+// overloaded over a period of BACKPRESSURE_ADJUST_MS if every request in it
+// queued on the socket longer than a threshold (by receive timestamps), or
+// every sample of the receive buffer (one per BACKPRESSURE_SAMPLE packets)
+// found it fuller than a threshold. After each period, the overload level
+// goes up one if the server was overloaded, else down one; at level n > 0,
+// clients whose requests are served are sent a SLOW_DOWN asking for
+// 'interval_us' << (n - 1) between requests. A client is told again once
+// a quarter of SLOW_DOWN_HOLD_MS has passed, so its pace follows the level
+// and lapses once the server catches up. Clients are numbered as in the
+// reply cache (replycache.h). Not thread-safe.
+
+
+#define BACKPRESSURE_SAMPLE 64        // Packets between buffer samples
+#define BACKPRESSURE_ADJUST_MS 100
+#define BACKPRESSURE_MAX_LEVEL 10
+#define DEFAULT_SLOW_INTERVAL_US 1000 // Pace asked for at level 1
+
+
+typedef struct {
+  int fd;                   // Socket watched, and SLOW_DOWNs sent from
+  uint64_t delay_ns;        // Queueing delay that's overload; 0 = ignore
+  unsigned queue_pct;       // Receive buffer fill that is; 0 = ignore
+  uint32_t interval_us;     // Pace asked for at level 1
+  unsigned level;           // 0 while keeping up
+  uint64_t min_queued_ns;   // This period: least queueing delay seen...
+  bool all_full;            // ...whether every buffer sample was over...
+  bool sampled;             // ...and whether there were any
+  uint64_t adjust_ns;       // When the period ends
+  unsigned until_sample;    // Packets until the buffer's sampled
+  uint64_t* told_ns;        // Per client: when last sent a SLOW_DOWN
+  size_t n_clients;
+  size_t n_sent;            // Statistics: SLOW_DOWNs sent...
+  unsigned max_level;       // ...and the highest level reached
+} backpressure;
+
+
+// Watch socket 'fd' for overload, for 'n_clients' clients
+// Args:
+//   delay_ms - Queueing delay that's overload (0 = ignore delays)
+//   queue_pct - Receive buffer fill, in percent, that's overload (0 =
+//     ignore the buffer)
+//   interval_us - Pace to ask for at first (0 = DEFAULT_SLOW_INTERVAL_US)
+// Return value: True if OK, false if allocation failed
+bool backpressure_init(backpressure* b, int fd, size_t n_clients,
+  unsigned delay_ms, unsigned queue_pct, unsigned interval_us);
+
+
+// Free the client table
+void backpressure_destroy(backpressure* b);
+
+
+// Account for a received packet that queued for 'queued_ns' (0 if not
+// known), adjusting the level when it's time
+void backpressure_sample(backpressure* b, uint64_t queued_ns);
+
+
+// Send a client whose request is being served a SLOW_DOWN, if the server's
+// overloaded and it hasn't been told lately
+void backpressure_note(backpressure* b, client_id id, size_t client,
+  struct sockaddr_in const* addr);
+
+
+// Print statistics
+void backpressure_dump_stats(backpressure const* b);
+
+
+#endif // BACKPRESSURE_H
@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+
+#include "packet.h"
+#include "database.h"
+#include "hashring.h"
+#include "seqstate.h"
+
+
+// Closed-loop load generator for a server cluster: keeps one request in
+// flight per client ID, each answered request immediately followed by the
+// next, and reports the aggregate verdict rate and per-node split. Start
+// the nodes with the same ring (driver_server -K ring -p port db.txt) and
+// compare runs against rings of 1, 2, 4... nodes; with enough cores, the
+// rate should grow about linearly with the node count. With -m, requests
+// go to a node picked round-robin instead of the owner, to measure the
+// cost of forwarding. With -w, clients use wide IDs, for measuring the
+// server's session table. With -d, each client keeps that many requests in
+// flight, pipelined within the server's receive window. Clients keep to the
+// pace of any SLOW_DOWN they're sent, holding new requests back as needed.
+
+
+#define DEFAULT_SECONDS 5
+#define DEFAULT_CLIENTS 64
+#define MAX_WIDE_CLIENTS (1 << 20)
+#define RETRY_NS 200000000ULL // Resend after this long without a verdict
+
+
+// A request in flight
+typedef struct {
+  sequence_num seq;    // Its sequence number at...
+  size_t node;         // ...the node it went to
+  uint64_t sent_ns;    // When it went out...
+  uint64_t first_ns;   // ...and when it was first tried (for latency)
+  client_info req;
+  bool held;           // Started, but not sent until its client's pace
+                       // allows
+} request;
+
+
+// A client ID's requests in flight
+typedef struct {
+  sequence_num seq[RING_MAX_NODES]; // Next sequence number at each node
+  request* reqs;       // 'depth' of them
+  uint64_t pace_ns;    // Least time between new requests, as asked by a
+  uint64_t paced_until_ns; // SLOW_DOWN, until then
+  uint64_t next_send_ns; // When the pace allows the next one
+  size_t n_held;       // Requests held back; they go in the order started,
+                       // so the server's window isn't overrun
+} session;
+
+
+// Helper; monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Helper; read every row of a text database, bucketed by owning node
+static bool load_keys(char const* filename, hash_ring const* ring,
+  client_info** keys, size_t* n_keys) {
+  FILE* fp = fopen(filename, "r");
+  char* line = NULL;
+  size_t line_cap = 0;
+  ssize_t line_len;
+  size_t cap[RING_MAX_NODES] = { 0 };
+
+
+  if (!fp) {
+    perror("load_keys: Couldn't open database");
+    return false;
+  }
+
+  while ((line_len = getline(&line, &line_cap, fp)) != -1) {
+    client_info entry;
+    size_t node;
+
+    if (parse_database_line(line, line_len, &entry) != (size_t)line_len) {
+      continue;
+    }
+
+    node = hash_ring_owner(ring, entry.number);
+    if (n_keys[node] == cap[node]) {
+      cap[node] = cap[node] ? cap[node] * 2 : 1024;
+      if ((keys[node] = realloc(keys[node], cap[node] * sizeof(client_info)))
+          == NULL) {
+        fprintf(stderr, "load_keys: Out of memory!\n");
+        free(line);
+        fclose(fp);
+        return false;
+      }
+    }
+
+    keys[node][n_keys[node]++] = entry;
+  }
+
+  free(line);
+  fclose(fp);
+
+
+  return true;
+}
+
+
+// Helper; send a request
+static void send_request(int fd, hash_ring const* ring, client_id id,
+  request* r) {
+  uint8_t payload[sizeof(tech_type) + sizeof(subscriber_num)];
+  uint8_t buf[64];
+  subscriber_num num = htonl(r->req.number);
+  packet_info pi;
+
+
+  payload[0] = r->req.ttype;
+  memcpy(payload + sizeof(tech_type), &num, sizeof(num));
+
+  pi.type = ACC_PER;
+  pi.id = id;
+  pi.cont.data_info.seq_num = r->seq;
+  pi.cont.data_info.len = sizeof(payload);
+  pi.cont.data_info.payload = payload;
+
+  size_t len = flatten(&pi, buf, sizeof(buf));
+
+  sendto(fd, buf, len, 0, (struct sockaddr const*)&ring->nodes[r->node].addr,
+    sizeof(struct sockaddr_in));
+  r->sent_ns = now_ns();
+}
+
+
+// Helper; whether a client's pace allows a request now
+static bool pace_allows(session const* s, uint64_t now) {
+  return now >= s->paced_until_ns || now >= s->next_send_ns;
+}
+
+
+// Helper; send a new request, or hold it back behind the client's pace and
+// any requests it's already holding
+static void pace_request(int fd, hash_ring const* ring, client_id id,
+  session* s, request* r, uint64_t now) {
+  if (s->n_held > 0 || !pace_allows(s, now)) {
+    r->held = true;
+    ++s->n_held;
+    return;
+  }
+
+  send_request(fd, ring, id, r);
+  s->next_send_ns = now + s->pace_ns;
+}
+
+
+// Helper; send a client's held requests, oldest first, as far as its pace
+// allows
+static void release_held(int fd, hash_ring const* ring, client_id id,
+  session* s, size_t depth, uint64_t now) {
+  while (s->n_held > 0 && pace_allows(s, now)) {
+    request* oldest = NULL;
+
+    for (size_t i = 0; i < depth; ++i) {
+      if (s->reqs[i].held
+          && (!oldest || s->reqs[i].first_ns < oldest->first_ns)) {
+        oldest = &s->reqs[i];
+      }
+    }
+
+    oldest->held = false;
+    --s->n_held;
+    send_request(fd, ring, id, oldest);
+    s->next_send_ns = now + s->pace_ns;
+  }
+}
+
+
+// Helper; start a new request for a row of node 'owner'
+static void start_request(session* s, request* r, client_info const* row,
+  size_t owner, size_t n_nodes, bool misroute) {
+  r->req = *row;
+  r->node = misroute ? (owner + 1) % n_nodes : owner;
+  r->seq = s->seq[r->node]++;
+  r->first_ns = now_ns();
+}
+
+
+// Helper; find the request a reply answers: the one with its sequence
+// number and, if the reply echoes one, its subscriber number
+static request* find_request(session* s, size_t depth,
+  packet_info const* pi) {
+  bool echoed = pi->type != REJECT
+    && pi->cont.data_info.len >= sizeof(tech_type) + sizeof(subscriber_num);
+  sequence_num seq = pi->type == REJECT ? pi->cont.reject_info.recvd_seq_num
+    : pi->cont.data_info.seq_num;
+  subscriber_num num = 0;
+
+
+  if (echoed) {
+    memcpy(&num, (uint8_t const*)pi->cont.data_info.payload
+      + sizeof(tech_type), sizeof(num));
+    num = ntohl(num);
+  }
+
+  for (size_t i = 0; i < depth; ++i) {
+    if (s->reqs[i].seq == seq && (!echoed || s->reqs[i].req.number == num)) {
+      return &s->reqs[i];
+    }
+  }
+
+
+  return NULL;
+}
+
+
+int main(int argc, char** argv) {
+  hash_ring ring;
+  client_info* keys[RING_MAX_NODES] = { NULL };
+  size_t n_keys[RING_MAX_NODES] = { 0 };
+  session* sessions;
+  request* reqs;
+  size_t n_clients = DEFAULT_CLIENTS;
+  size_t depth = 1;        // Requests in flight per client
+  unsigned seconds = DEFAULT_SECONDS;
+  bool misroute = false;
+  client_id first_id = 0; // Client IDs are first_id and up
+  size_t n_verdicts = 0, n_resent = 0, n_rejects = 0, n_acks = 0;
+  size_t n_slow_downs = 0;
+  size_t n_held = 0;       // Requests held back for pacing, as of the last
+                           // scan
+  size_t per_node[RING_MAX_NODES] = { 0 };
+  uint64_t latency_sum_ns = 0;
+  int opt;
+
+
+  while ((opt = getopt(argc, argv, "mwc:d:t:")) != -1) {
+    switch (opt) {
+      case 'm':
+        misroute = true;
+        break;
+      case 'w':
+        first_id = NARROW_CLIENT_IDS;
+        break;
+      case 'c':
+        n_clients = strtoul(optarg, NULL, 10);
+        break;
+      case 'd':
+        depth = strtoul(optarg, NULL, 10);
+        break;
+      case 't':
+        seconds = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        goto usage;
+    }
+  }
+
+  if (argc - optind != 2 || n_clients == 0
+      || n_clients > (first_id ? MAX_WIDE_CLIENTS : NARROW_CLIENT_IDS)
+      || depth == 0 || depth > SEQ_WINDOW) {
+    goto usage;
+  }
+
+  if ((sessions = calloc(n_clients, sizeof(session))) == NULL
+      || (reqs = calloc(n_clients * depth, sizeof(request))) == NULL) {
+    fprintf(stderr, "%s: Out of memory!\n", argv[0]);
+    return 1;
+  }
+
+  if (!hash_ring_load(&ring, argv[optind])
+      || !load_keys(argv[optind + 1], &ring, keys, n_keys)) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < ring.n_nodes; ++i) {
+    if (n_keys[i] == 0) {
+      fprintf(stderr, "%s: Node %lu owns no rows of %s\n", argv[0], i + 1,
+        argv[optind + 1]);
+      return 1;
+    }
+  }
+
+
+  // One socket for every client ID; replies come from whichever node owns
+  // the subscriber, so sessions are found by ID alone
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  int rcvbuf = 4 << 20;
+
+  if (fd == -1) {
+    perror("socket");
+    return 1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+
+  srand(time(NULL));
+
+  uint64_t start_ns = now_ns();
+  uint64_t end_ns = start_ns + (uint64_t)seconds * 1000000000ULL;
+
+  for (size_t i = 0; i < n_clients; ++i) {
+    sessions[i].reqs = &reqs[i * depth];
+
+    for (size_t j = 0; j < depth; ++j) {
+      size_t owner = (i + j) % ring.n_nodes;
+
+      start_request(&sessions[i], &sessions[i].reqs[j],
+        &keys[owner][rand() % n_keys[owner]], owner, ring.n_nodes, misroute);
+      send_request(fd, &ring, first_id + i, &sessions[i].reqs[j]);
+    }
+  }
+
+
+  // Closed loop: answer each verdict with the client's next request
+  size_t next_node = 0;
+  uint64_t now;
+
+  while ((now = now_ns()) < end_ns) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint8_t buf[BUFSIZ];
+    ssize_t len;
+    packet_info pi;
+
+    // Held requests are let go within a millisecond of their time
+    if (poll(&pfd, 1, n_held > 0 ? 1 : RETRY_NS / 1000000) > 0) {
+      while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        if (interpret_packet(buf, &pi, len) != 0 || pi.id < first_id
+            || pi.id - first_id >= n_clients) {
+          continue;
+        }
+
+        session* s = &sessions[pi.id - first_id];
+        request* r;
+        size_t owner;
+
+        // Cumulative ACKs are for no request in particular
+        if (pi.type == ACK || pi.type == CUM_ACK) {
+          ++n_acks;
+          continue;
+        }
+
+        // Nor is a request to slow down
+        if (pi.type == SLOW_DOWN) {
+          ++n_slow_downs;
+          s->pace_ns = pi.cont.slow_down_info.interval_us * 1000ULL;
+          s->paced_until_ns = now_ns() + SLOW_DOWN_HOLD_MS * 1000000ULL;
+          continue;
+        }
+
+        if ((r = find_request(s, depth, &pi)) == NULL) {
+          continue;
+        }
+
+        switch (pi.type) {
+          case REJECT:
+            // A duplicate: the node had it, and the verdict was lost; move
+            // on. Ahead of the window: the timeout resends it.
+            ++n_rejects;
+            if (pi.cont.reject_info.code == DUP_PACK) {
+              owner = next_node++ % ring.n_nodes;
+              start_request(s, r, &keys[owner][rand() % n_keys[owner]],
+                owner, ring.n_nodes, misroute);
+              pace_request(fd, &ring, pi.id, s, r, now_ns());
+            }
+            break;
+          case ACC_OK:
+          case NOT_PAID:
+          case NOT_EXIST:
+          case TRY_LATER:
+            ++n_verdicts;
+            ++per_node[hash_ring_owner(&ring, r->req.number)];
+            latency_sum_ns += now_ns() - r->first_ns;
+
+            // Next request, to another node's subscriber, so each node
+            // sees every client
+            owner = next_node++ % ring.n_nodes;
+            start_request(s, r, &keys[owner][rand() % n_keys[owner]], owner,
+              ring.n_nodes, misroute);
+            pace_request(fd, &ring, pi.id, s, r, now_ns());
+            break;
+          default:
+            break;
+        }
+      }
+    }
+
+    // Lost packets; if it was the reply, the node rejects the resend as a
+    // duplicate, and the next try gets through. Held requests go once their
+    // client's pace allows.
+    now = now_ns();
+    for (size_t i = 0; i < n_clients * depth; ++i) {
+      if (!reqs[i].held && now - reqs[i].sent_ns > RETRY_NS) {
+        ++n_resent;
+        send_request(fd, &ring, first_id + i / depth, &reqs[i]);
+      }
+    }
+
+    n_held = 0;
+    for (size_t i = 0; i < n_clients; ++i) {
+      release_held(fd, &ring, first_id + i, &sessions[i], depth, now);
+      n_held += sessions[i].n_held;
+    }
+  }
+
+
+  double secs = (now_ns() - start_ns) / 1e9;
+
+  printf("%lu nodes, %lu %sclients x %lu in flight%s: %lu verdicts in %.2f s "
+    "= %.0f/s, mean latency %.1f us\n", ring.n_nodes, n_clients,
+    first_id ? "wide " : "", depth, misroute ? " (misrouted)" : "", n_verdicts, secs, n_verdicts / secs,
+    n_verdicts ? latency_sum_ns / 1e3 / n_verdicts : 0.0);
+  for (size_t i = 0; i < ring.n_nodes; ++i) {
+    printf("  node %lu: %lu rows, %.0f verdicts/s\n", i + 1, n_keys[i],
+      per_node[i] / secs);
+  }
+  printf("  %lu resent after timeouts, %lu rejects, %lu ACK packets, %lu "
+    "SLOW_DOWNs\n", n_resent, n_rejects, n_acks, n_slow_downs);
+
+  close(fd);
+  free(sessions);
+  free(reqs);
+  for (size_t i = 0; i < ring.n_nodes; ++i) {
+    free(keys[i]);
+  }
+  hash_ring_destroy(&ring);
+
+
+  return EXIT_SUCCESS;
+
+
+usage:
+  fprintf(stderr, "Usage: %s [-m] [-w] [-c clients] [-d depth] [-t seconds]\n"
+    "          [ring_file] [database.txt]\n"
+    "  -m  Send each request to the wrong node, to be forwarded\n"
+    "  -w  Use wide client IDs (%d and up)\n"
+    "  -c  Client IDs with a request in flight (default %d, max %d, or %d\n"
+    "      with -w)\n"
+    "  -d  Requests each client keeps in flight (default 1, max %d)\n"
+    "  -t  Run for this many seconds (default %d)\n",
+    argv[0], NARROW_CLIENT_IDS, DEFAULT_CLIENTS, NARROW_CLIENT_IDS,
+    MAX_WIDE_CLIENTS, SEQ_WINDOW, DEFAULT_SECONDS);
+  return 1;
+}
@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "database.h"
+#include "subtable.h"
+
+
+// Benchmark harness for lookup(): times random lookups against the database
+// under different placements (plain pages, huge pages, one replica per NUMA
+// node), reading dTLB and remote-node miss counters when perf allows it.
+// Also compares lock-free overlay (subtable) reads with and without a writer
+// applying updates.
+
+
+#define DEFAULT_N_LOOKUPS 10000000UL
+#define OVERLAY_SECONDS 1
+#define OVERLAY_TRIALS 5       // Best of, as the sandbox's timing is noisy
+#define UPDATES_PER_SEC 10000
+#define OVERLAY_CAPACITY 65536 // The server's default
+#define SPARSE_STRIDE 64       // Rows per changed row in the sparse run
+
+
+// Shared by the overlay reader and writer threads
+typedef struct {
+  subtable* table;
+  database const* db;
+  bool index;     // Reader falls back to the database, as the server does
+  size_t stride;  // Writer changes every stride-th row
+  bool write;     // Writer upserts; if not, it only wakes up on schedule
+  bool stop;
+  size_t n_ops;
+  double cpu_s;   // Reader's own CPU time
+} overlay_ctx;
+
+
+// A hardware counter; fd is -1 if perf wouldn't give it to us
+typedef struct {
+  char const* name;
+  uint64_t config;
+  int fd;
+} counter;
+
+
+static counter counters[] = {
+  { "dTLB-load-misses",
+    PERF_COUNT_HW_CACHE_DTLB
+      | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+      | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -1 },
+  { "node-load-misses",
+    PERF_COUNT_HW_CACHE_NODE
+      | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+      | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -1 },
+};
+
+#define N_COUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+
+// Helper; open a counter for this thread
+static int open_counter(uint64_t config) {
+  struct perf_event_attr attr;
+
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+// Helper; count the online NUMA nodes
+static int count_nodes(void) {
+  DIR* dir = opendir("/sys/devices/system/node");
+  struct dirent* ent;
+  int n = 0;
+
+
+  if (!dir) {
+    return 1;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    if (strncmp(ent->d_name, "node", 4) == 0
+        && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+      ++n;
+    }
+  }
+
+  closedir(dir);
+
+
+  return n > 0 ? n : 1;
+}
+
+
+// Time 'n' pseudo-random lookups (about half hits) and print the results
+static void run(char const* label, database const* db, size_t n) {
+  struct timespec start, end;
+  uint64_t values[N_COUNTERS];
+  uint32_t x = 2463534242U; // xorshift state
+  size_t found = 0;
+
+
+  for (size_t i = 0; i < N_COUNTERS; ++i) {
+    if (counters[i].fd != -1) {
+      ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (size_t i = 0; i < n; ++i) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    // Odd draws hit an existing key, even draws are (probably) misses
+    subscriber_num num = (x & 1) && db->n_filled > 0
+      ? db->entries[x % db->n_filled].number : x;
+
+    found += lookup(db, num) != NULL;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (size_t i = 0; i < N_COUNTERS; ++i) {
+    values[i] = 0;
+    if (counters[i].fd != -1) {
+      ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(counters[i].fd, &values[i], sizeof(values[i])) == -1) {
+        values[i] = 0;
+      }
+    }
+  }
+
+
+  double secs = (end.tv_sec - start.tv_sec)
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("%-16s %10.1f ns/lookup %8zu hits", label, secs * 1e9 / n, found);
+  for (size_t i = 0; i < N_COUNTERS; ++i) {
+    if (counters[i].fd == -1) {
+      printf("  %s n/a", counters[i].name);
+    } else {
+      printf("  %s %.4f/lookup", counters[i].name, (double)values[i] / n);
+    }
+  }
+  printf("\n");
+}
+
+
+// Overlay reader thread; looks up existing keys until told to stop
+static void* overlay_reader(void* arg) {
+  overlay_ctx* ctx = (overlay_ctx*)arg;
+  uint32_t x = 88172645U; // xorshift state
+  struct timespec start, end;
+  client_info entry;
+  size_t n = 0;
+
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+  while (!__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED)) {
+    subscriber_num num;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    num = ctx->db->entries[x % ctx->db->n_filled].number;
+    if (subtable_lookup(ctx->table, num, &entry) == SUBTABLE_ABSENT
+        && ctx->index) {
+      lookup(ctx->db, num);
+    }
+    ++n;
+  }
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+  ctx->n_ops = n;
+  ctx->cpu_s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+
+  return NULL;
+}
+
+
+// Overlay writer thread; flips paid bits at UPDATES_PER_SEC, on a fixed
+// schedule so slow wakeups don't lower the rate. Without 'write' it keeps
+// the schedule but leaves the table alone, which gives the cost of sharing
+// the core apart from the cost of the writes.
+static void* overlay_writer(void* arg) {
+  overlay_ctx* ctx = (overlay_ctx*)arg;
+  size_t n_rows = (ctx->db->n_filled + ctx->stride - 1) / ctx->stride;
+  struct timespec next;
+  size_t i = 0, n = 0;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while (!__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED)) {
+    client_info entry = ctx->db->entries[(i++ % n_rows) * ctx->stride];
+
+    entry.paid = !entry.paid;
+    if (ctx->write) {
+      subtable_upsert(ctx->table, &entry);
+    }
+    ++n;
+
+    if ((next.tv_nsec += 1000000000L / UPDATES_PER_SEC) >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      ++next.tv_sec;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+
+  ctx->n_ops = n;
+
+
+  return NULL;
+}
+
+
+// Reader throughput of one overlay run, as lookups per second of the
+// reader's own CPU time; 'mode' is 0 for no writer, 1 for a writer that
+// only wakes up, 2 for one that writes
+static double time_overlay(subtable* table, database const* db, bool sparse,
+  int mode, size_t* n_updates) {
+  size_t stride = sparse ? SPARSE_STRIDE : 1;
+  overlay_ctx reader = { table, db, sparse, stride, false, false, 0, 0 };
+  overlay_ctx writer = { table, db, sparse, stride, mode == 2, false, 0, 0 };
+  pthread_t reader_thread, writer_thread;
+  struct timespec duration = { OVERLAY_SECONDS, 0 };
+
+
+  pthread_create(&reader_thread, NULL, &overlay_reader, &reader);
+  if (mode > 0) {
+    pthread_create(&writer_thread, NULL, &overlay_writer, &writer);
+  }
+
+  nanosleep(&duration, NULL);
+
+  __atomic_store_n(&reader.stop, true, __ATOMIC_RELAXED);
+  __atomic_store_n(&writer.stop, true, __ATOMIC_RELAXED);
+  pthread_join(reader_thread, NULL);
+  if (mode > 0) {
+    pthread_join(writer_thread, NULL);
+  }
+
+  *n_updates = writer.n_ops / OVERLAY_SECONDS;
+
+
+  return reader.n_ops / reader.cpu_s;
+}
+
+
+// Read throughput of the overlay, read-only, with a writer that only wakes
+// up, and with one applying updates. Rates are per second of the reader's
+// own CPU time, best of OVERLAY_TRIALS: on a shared core the writer's time
+// comes out of the reader's wall-clock share, and its wakeups cost the
+// reader cache and TLB state whether or not it writes; neither is a cost of
+// the read path, so the writes are compared against the wakeups-only run.
+//
+// 'sparse' is the server's case: an empty overlay of the default size in
+// front of the database, with a writer changing one row in SPARSE_STRIDE.
+// Otherwise every row is in the overlay and the writer changes all of them.
+static void run_overlay(database const* db, bool sparse) {
+  static char const* const names[2][3] = {
+    { "overlay", "overlay+wakeups", "overlay+writes" },
+    { "index+overlay", "index+ovl+wakeups", "index+ovl+writes" },
+  };
+  subtable table;
+  double rates[3] = { 0, 0, 0 };
+  size_t n_updates[3] = { 0, 0, 0 };
+
+
+  if (db->n_filled == 0
+      || !subtable_init(&table, sparse ? OVERLAY_CAPACITY : db->n_filled)) {
+    return;
+  }
+
+  for (size_t i = 0; !sparse && i < db->n_filled; ++i) {
+    subtable_upsert(&table, &db->entries[i]);
+  }
+
+
+  // Interleave the modes, so drift in the host's load hits them alike
+  for (int trial = 0; trial < OVERLAY_TRIALS; ++trial) {
+    for (int mode = 0; mode < 3; ++mode) {
+      size_t updates;
+      double rate = time_overlay(&table, db, sparse, mode, &updates);
+
+      if (rate > rates[mode]) {
+        rates[mode] = rate;
+        n_updates[mode] = updates;
+      }
+    }
+  }
+
+  for (int mode = 0; mode < 3; ++mode) {
+    printf("%-18s %9.1f Mlookups/s %8zu updates/s\n", names[sparse][mode],
+      rates[mode] / 1e6, n_updates[mode]);
+  }
+
+  printf("%s read throughput with writes: %.1f%% of read-only, "
+    "%.1f%% of wakeups only\n", names[sparse][0], 100.0 * rates[2] / rates[0],
+    100.0 * rates[2] / rates[1]);
+
+
+  subtable_destroy(&table);
+}
+
+
+int main(int argc, char** argv) {
+  size_t n = DEFAULT_N_LOOKUPS; // Lookups per run
+  char label[32]; // For per-node runs
+
+
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s [db_file.txt] [n_lookups]\n", argv[0]);
+    return 1;
+  }
+
+  if (argc == 3) {
+    n = strtoul(argv[2], NULL, 10);
+  }
+
+
+  for (size_t i = 0; i < N_COUNTERS; ++i) {
+    counters[i].fd = open_counter(counters[i].config);
+  }
+
+
+  // Plain pages, parsed wherever we happen to be running
+  database* db = database_new(0);
+  if (!db || !parse_database_file(argv[1], db)) {
+    fprintf(stderr, "%s: Couldn't load database!\n", argv[0]);
+    return 1;
+  }
+
+  run("plain", db, n);
+
+
+  // Huge pages
+  database* huge = database_replicate(db, -1, DB_HUGEPAGES);
+  if (huge) {
+    run("hugepages", huge, n);
+    database_delete(huge);
+  }
+
+
+  // One replica per node; the one matching our node is the local case
+  int n_nodes = count_nodes();
+  for (int node = 0; node < n_nodes; ++node) {
+    database* replica = database_replicate(db, node, DB_HUGEPAGES);
+
+    if (!replica) {
+      continue;
+    }
+
+    snprintf(label, sizeof(label), "node%d%s", node,
+      node == database_current_node() ? " (local)" : "");
+    run(label, replica, n);
+    database_delete(replica);
+  }
+
+
+  run_overlay(db, false);
+  run_overlay(db, true);
+
+
+  database_delete(db);
+
+
+  return 0;
+}
@@ -0,0 +1,759 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "btree.h"
+#include "database.h"
+
+
+#define BTREE_VERSION 1
+#define PAGE_HDR_SIZE (2 * sizeof(uint32_t))
+
+
+// Leaf record; client_info with a fixed layout
+typedef struct {
+  uint32_t number;
+  uint8_t ttype;
+  uint8_t paid;
+  uint16_t reserved;
+} leaf_record;
+
+
+#define LEAF_CAPACITY \
+  ((BTREE_PAGE_SIZE - PAGE_HDR_SIZE) / sizeof(leaf_record))
+#define INNER_CAPACITY \
+  ((BTREE_PAGE_SIZE - PAGE_HDR_SIZE) / (2 * sizeof(uint32_t)))
+
+
+typedef struct {
+  uint32_t n;
+  uint32_t reserved;
+  leaf_record records[LEAF_CAPACITY];
+} leaf_page;
+
+
+// keys[i] is the smallest key under children[i]
+typedef struct {
+  uint32_t n;
+  uint32_t reserved;
+  uint32_t keys[INNER_CAPACITY];
+  uint32_t children[INNER_CAPACITY];
+} inner_page;
+
+
+// Records parsed, sorted and deduplicated in memory at a time; each such
+// run goes to a temporary file, and the runs are merged
+#define RUN_ENTRIES (1 << 20)
+
+
+// A parsed record and its position in the input, so that sorting keeps the
+// last of a subscriber's records
+typedef struct {
+  client_info entry;
+  uint64_t pos;
+} run_record;
+
+
+// Sorted runs of the input, in temporary files, and a merge over them
+typedef struct {
+  FILE** files;
+  size_t n_runs;
+  size_t* heap;        // Runs by their next record, smallest on top...
+  client_info* next;   // ...which is this, per run
+  size_t heap_len;
+  size_t n_dropped;    // Statistics: duplicates dropped
+} run_set;
+
+
+// Helper; for use with qsort()
+static int compare_run_records(void const* a, void const* b) {
+  run_record const* x = (run_record const*)a;
+  run_record const* y = (run_record const*)b;
+
+  if (x->entry.number != y->entry.number) {
+    return (x->entry.number > y->entry.number)
+      - (x->entry.number < y->entry.number);
+  }
+
+
+  return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+
+// Helper; sort a run, keep the last record per subscriber, and write it to a
+// new temporary file
+static bool flush_run(run_set* runs, run_record* buf, size_t n) {
+  FILE** grown;
+  FILE* fp;
+
+
+  qsort(buf, n, sizeof(run_record), &compare_run_records);
+
+  if ((grown = realloc(runs->files, (runs->n_runs + 1) * sizeof(FILE*)))
+      == NULL) {
+    fprintf(stderr, "btree_build: Out of memory!\n");
+    return false;
+  }
+  runs->files = grown;
+
+  if ((fp = tmpfile()) == NULL) {
+    perror("btree_build: Couldn't create a temporary file");
+    return false;
+  }
+  runs->files[runs->n_runs++] = fp;
+
+  for (size_t i = 0; i < n; ++i) {
+    if (i + 1 < n && buf[i + 1].entry.number == buf[i].entry.number) {
+      ++runs->n_dropped;
+      continue;
+    }
+
+    if (fwrite(&buf[i].entry, sizeof(client_info), 1, fp) != 1) {
+      perror("btree_build: Couldn't write a temporary file");
+      return false;
+    }
+  }
+
+
+  return fflush(fp) == 0 && fseek(fp, 0, SEEK_SET) == 0;
+}
+
+
+// Helper; read a text database into sorted runs
+static bool write_runs(char const* filename, run_set* runs) {
+  FILE* fp = fopen(filename, "r");
+  char* line = NULL; // Buffer for getline()
+  size_t line_cap = 0;
+  ssize_t line_len;
+  uint64_t line_no = 0;
+  run_record* buf = malloc(RUN_ENTRIES * sizeof(run_record));
+  size_t n = 0;
+  bool ok = false;
+
+
+  if (!fp) {
+    perror("btree_build: Couldn't open database");
+    free(buf);
+    return false;
+  }
+
+  if (!buf) {
+    fprintf(stderr, "btree_build: Out of memory!\n");
+    goto done;
+  }
+
+  while ((line_len = getline(&line, &line_cap, fp)) != -1) {
+    ++line_no;
+
+    if (parse_database_line(line, line_len, &buf[n].entry)
+        != (size_t)line_len) {
+      fprintf(stderr, "btree_build: %s:%lu: Malformed record\n", filename,
+        (unsigned long)line_no);
+      goto done;
+    }
+
+    buf[n++].pos = line_no;
+
+    if (n == RUN_ENTRIES) {
+      if (!flush_run(runs, buf, n)) {
+        goto done;
+      }
+      n = 0;
+    }
+  }
+
+  ok = (n == 0 && runs->n_runs > 0) || flush_run(runs, buf, n);
+
+
+done:
+  free(line);
+  free(buf);
+  fclose(fp);
+  return ok;
+}
+
+
+// Helper; whether run a's next record comes before run b's; of equal
+// numbers, the earlier run's does
+static bool run_before(run_set const* runs, size_t a, size_t b) {
+  subscriber_num x = runs->next[a].number;
+  subscriber_num y = runs->next[b].number;
+
+
+  return x < y || (x == y && a < b);
+}
+
+
+// Helper; restore the heap order from slot 'i' down
+static void sift_down(run_set* runs, size_t i) {
+  size_t* heap = runs->heap;
+
+
+  while (1) {
+    size_t least = i, l = 2 * i + 1, r = 2 * i + 2;
+
+    if (l < runs->heap_len && run_before(runs, heap[l], heap[least])) {
+      least = l;
+    }
+    if (r < runs->heap_len && run_before(runs, heap[r], heap[least])) {
+      least = r;
+    }
+    if (least == i) {
+      return;
+    }
+
+    size_t tmp = heap[i];
+    heap[i] = heap[least];
+    heap[least] = tmp;
+    i = least;
+  }
+}
+
+
+// Helper; move the top run on to its next record, dropping it from the heap
+// once it's exhausted
+static bool advance_top(run_set* runs) {
+  size_t run = runs->heap[0];
+
+
+  if (fread(&runs->next[run], sizeof(client_info), 1, runs->files[run])
+      != 1) {
+    if (ferror(runs->files[run])) {
+      perror("btree_build: Couldn't read a temporary file");
+      return false;
+    }
+    runs->heap[0] = runs->heap[--runs->heap_len];
+  }
+
+  sift_down(runs, 0);
+
+
+  return true;
+}
+
+
+// Helper; start merging the runs
+static bool merge_init(run_set* runs) {
+  if ((runs->heap = malloc(runs->n_runs * sizeof(size_t))) == NULL
+      || (runs->next = malloc(runs->n_runs * sizeof(client_info))) == NULL) {
+    fprintf(stderr, "btree_build: Out of memory!\n");
+    return false;
+  }
+
+  // Only an empty input makes an empty run
+  for (size_t i = 0; i < runs->n_runs; ++i) {
+    if (fread(&runs->next[i], sizeof(client_info), 1, runs->files[i]) == 1) {
+      runs->heap[runs->heap_len++] = i;
+    }
+  }
+
+  for (size_t i = runs->heap_len / 2; i-- > 0;) {
+    sift_down(runs, i);
+  }
+
+
+  return true;
+}
+
+
+// Helper; get the next subscriber's record, the one read last among its
+// duplicates (which the latest run has)
+// Return value: 1 if 'out' is filled, 0 once the runs are exhausted, -1 on
+// error
+static int merge_next(run_set* runs, client_info* out) {
+  if (runs->heap_len == 0) {
+    return 0;
+  }
+
+  *out = runs->next[runs->heap[0]];
+  if (!advance_top(runs)) {
+    return -1;
+  }
+
+  while (runs->heap_len > 0
+      && runs->next[runs->heap[0]].number == out->number) {
+    *out = runs->next[runs->heap[0]];
+    ++runs->n_dropped;
+    if (!advance_top(runs)) {
+      return -1;
+    }
+  }
+
+
+  return 1;
+}
+
+
+// Helper; close the runs' files and free the merge
+static void runs_destroy(run_set* runs) {
+  for (size_t i = 0; i < runs->n_runs; ++i) {
+    fclose(runs->files[i]);
+  }
+
+  free(runs->files);
+  free(runs->heap);
+  free(runs->next);
+}
+
+
+// Helper; remember the first key and page number of a page on the level
+// being written
+static bool level_append(uint32_t** keys, uint32_t** children, size_t* len,
+  size_t* cap, uint32_t key, uint32_t child) {
+  if (*len == *cap) {
+    size_t new_cap = *cap ? *cap * 2 : 1024;
+    uint32_t* new_keys = realloc(*keys, new_cap * sizeof(uint32_t));
+
+    if (new_keys) {
+      *keys = new_keys;
+    }
+
+    uint32_t* new_children = realloc(*children, new_cap * sizeof(uint32_t));
+
+    if (new_children) {
+      *children = new_children;
+    }
+
+    if (!new_keys || !new_children) {
+      fprintf(stderr, "btree_build: Out of memory!\n");
+      return false;
+    }
+
+    *cap = new_cap;
+  }
+
+  (*keys)[*len] = key;
+  (*children)[*len] = child;
+  ++*len;
+
+
+  return true;
+}
+
+
+bool btree_build(char const* text_filename, char const* btree_filename) {
+  run_set runs;
+  client_info entry;
+  btree_header hdr;
+  uint8_t page[BTREE_PAGE_SIZE]; // Page being written
+  leaf_page* leaf = (leaf_page*)page;
+  uint32_t* keys = NULL;     // First key of each page on the current level
+  uint32_t* children = NULL; // Page numbers on the current level
+  size_t level_len = 0, level_cap = 0;
+  uint32_t page_no = 1; // Next page number to be written
+  int got;
+  bool ok = false;
+
+
+  memset(&runs, 0, sizeof(runs));
+  if (!write_runs(text_filename, &runs) || !merge_init(&runs)) {
+    runs_destroy(&runs);
+    return false;
+  }
+
+  FILE* fp = fopen(btree_filename, "w");
+  if (!fp) {
+    perror("btree_build: Couldn't create output");
+    runs_destroy(&runs);
+    return false;
+  }
+
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, BTREE_MAGIC, sizeof(hdr.magic));
+  hdr.version = BTREE_VERSION;
+  hdr.page_size = BTREE_PAGE_SIZE;
+
+
+  // Reserve the header page; it's written last
+  memset(page, 0, sizeof(page));
+  if (fwrite(page, sizeof(page), 1, fp) != 1) {
+    goto io_error;
+  }
+
+
+  // Leaves, filled as the merge produces records
+  memset(page, 0, sizeof(page));
+  for (bool more = true; more;) {
+    if ((got = merge_next(&runs, &entry)) == -1) {
+      goto done;
+    }
+    more = got == 1;
+
+    // A full leaf goes out, and so does the last (an empty tree has one)
+    if (leaf->n == LEAF_CAPACITY || !more) {
+      if (!level_append(&keys, &children, &level_len, &level_cap,
+            leaf->n > 0 ? leaf->records[0].number : 0, page_no++)) {
+        goto done;
+      }
+      if (fwrite(page, sizeof(page), 1, fp) != 1) {
+        goto io_error;
+      }
+      ++hdr.n_leaves;
+      memset(page, 0, sizeof(page));
+    }
+
+    if (more) {
+      leaf->records[leaf->n].number = entry.number;
+      leaf->records[leaf->n].ttype = entry.ttype;
+      leaf->records[leaf->n].paid = entry.paid;
+      ++leaf->n;
+      ++hdr.n_entries;
+    }
+  }
+
+
+  // Inner levels, bottom-up, until a level fits in one page
+  while (level_len > 1) {
+    size_t next_len = 0;
+
+    for (size_t start = 0; start < level_len; start += INNER_CAPACITY) {
+      inner_page* inner = (inner_page*)page;
+
+      memset(page, 0, sizeof(page));
+      for (size_t j = start; j < level_len && j < start + INNER_CAPACITY;
+           ++j) {
+        inner->keys[inner->n] = keys[j];
+        inner->children[inner->n] = children[j];
+        ++inner->n;
+      }
+
+      if (fwrite(page, sizeof(page), 1, fp) != 1) {
+        goto io_error;
+      }
+
+      // Safe in place: next_len never catches up with start
+      keys[next_len] = inner->keys[0];
+      children[next_len] = page_no++;
+      ++next_len;
+      ++hdr.n_inner;
+    }
+
+    level_len = next_len;
+    ++hdr.height;
+  }
+
+  hdr.root = children[0];
+
+
+  // Header
+  memset(page, 0, sizeof(page));
+  memcpy(page, &hdr, sizeof(hdr));
+  if (fseek(fp, 0, SEEK_SET) == -1 || fwrite(page, sizeof(page), 1, fp) != 1) {
+    goto io_error;
+  }
+
+  ok = true;
+  if (runs.n_dropped > 0) {
+    fprintf(stderr, "btree_build: Dropped %lu duplicate subscriber(s), "
+      "keeping the last of each\n", runs.n_dropped);
+  }
+  fprintf(stderr, "btree_build: %lu entries, %u leaves, %u inner pages, "
+    "height %u (merged from %lu sorted runs)\n",
+    (unsigned long)hdr.n_entries, hdr.n_leaves, hdr.n_inner, hdr.height,
+    runs.n_runs);
+  goto done;
+
+
+io_error:
+  perror("btree_build: Couldn't write output");
+
+done:
+  if (fclose(fp) != 0) {
+    ok = false;
+  }
+  free(keys);
+  free(children);
+  runs_destroy(&runs);
+  return ok;
+}
+
+
+bool btree_is_file(char const* filename) {
+  char magic[sizeof(BTREE_MAGIC) - 1];
+  int fd = open(filename, O_RDONLY);
+  bool is_btree;
+
+
+  if (fd == -1) {
+    return false;
+  }
+
+  is_btree = read(fd, magic, sizeof(magic)) == sizeof(magic)
+    && memcmp(magic, BTREE_MAGIC, sizeof(magic)) == 0;
+  close(fd);
+
+
+  return is_btree;
+}
+
+
+// Helper; records in a leaf; a corrupt count mustn't read past the page
+static uint32_t leaf_len(leaf_page const* leaf) {
+  return leaf->n < LEAF_CAPACITY ? leaf->n : LEAF_CAPACITY;
+}
+
+
+// Helper; check that the inner levels are laid out the way btree_build()
+// writes them, so lookups never leave the file: each level's pages follow
+// the level below's, point only into it (the leaves, for the lowest), and
+// the root is the top level's only page
+static bool btree_check_inner(btree const* bt) {
+  uint32_t first_inner = 1 + bt->hdr.n_leaves;
+  size_t below = 1, below_len = bt->hdr.n_leaves; // Level below's pages
+  size_t n_checked = 0;
+
+
+  if (bt->hdr.n_leaves == 0) {
+    return false;
+  }
+
+  for (uint32_t level = 0; level < bt->hdr.height; ++level) {
+    size_t first = first_inner + n_checked;
+    size_t len = (below_len + INNER_CAPACITY - 1) / INNER_CAPACITY;
+
+    if (n_checked + len > bt->hdr.n_inner) {
+      return false;
+    }
+
+    for (size_t page_no = first; page_no < first + len; ++page_no) {
+      inner_page const* inner = (inner_page const*)
+        (bt->inner + (page_no - first_inner) * BTREE_PAGE_SIZE);
+
+      if (inner->n == 0 || inner->n > INNER_CAPACITY) {
+        return false;
+      }
+
+      for (uint32_t i = 0; i < inner->n; ++i) {
+        if (inner->children[i] < below
+            || inner->children[i] >= below + below_len) {
+          return false;
+        }
+      }
+    }
+
+    n_checked += len;
+    below = first;
+    below_len = len;
+  }
+
+
+  return n_checked == bt->hdr.n_inner && below_len == 1
+    && bt->hdr.root == below;
+}
+
+
+bool btree_open(btree* bt, char const* filename) {
+  struct stat st;
+
+
+  memset(bt, 0, sizeof(btree));
+  bt->fd = -1;
+
+  if ((bt->fd = open(filename, O_RDONLY)) == -1 || fstat(bt->fd, &st) == -1) {
+    perror("btree_open: Couldn't open file");
+    goto fail;
+  }
+
+  if ((size_t)st.st_size < BTREE_PAGE_SIZE) {
+    fprintf(stderr, "btree_open: File too short!\n");
+    goto fail;
+  }
+
+
+  bt->map_len = st.st_size;
+  bt->map = mmap(NULL, bt->map_len, PROT_READ, MAP_SHARED, bt->fd, 0);
+  if (bt->map == MAP_FAILED) {
+    bt->map = NULL;
+    perror("btree_open: Couldn't map file");
+    goto fail;
+  }
+
+
+  // Validate the header against the file
+  memcpy(&bt->hdr, bt->map, sizeof(btree_header));
+  if (memcmp(bt->hdr.magic, BTREE_MAGIC, sizeof(bt->hdr.magic)) != 0
+      || bt->hdr.version != BTREE_VERSION
+      || bt->hdr.page_size != BTREE_PAGE_SIZE
+      || (1 + (size_t)bt->hdr.n_leaves + bt->hdr.n_inner) * BTREE_PAGE_SIZE
+        > bt->map_len) {
+    fprintf(stderr, "btree_open: Bad header!\n");
+    goto fail;
+  }
+
+
+  // Lookups jump around; readahead would only evict useful pages
+  madvise((void*)bt->map, bt->map_len, MADV_RANDOM);
+
+
+  // Pin the inner levels; mlock() is best-effort (RLIMIT_MEMLOCK)
+  size_t inner_len = (size_t)bt->hdr.n_inner * BTREE_PAGE_SIZE;
+  if (inner_len > 0) {
+    if ((bt->inner = malloc(inner_len)) == NULL) {
+      fprintf(stderr, "btree_open: Out of memory!\n");
+      goto fail;
+    }
+
+    memcpy(bt->inner,
+      bt->map + (1 + (size_t)bt->hdr.n_leaves) * BTREE_PAGE_SIZE, inner_len);
+
+    if (mlock(bt->inner, inner_len) == -1) {
+      perror("btree_open: Couldn't lock inner pages");
+    }
+  }
+
+  if (!btree_check_inner(bt)) {
+    fprintf(stderr, "btree_open: Bad inner pages!\n");
+    goto fail;
+  }
+
+
+  fprintf(stderr, "btree_open: %lu entries, height %u\n",
+    (unsigned long)bt->hdr.n_entries, bt->hdr.height);
+
+
+  return true;
+
+
+fail:
+  btree_close(bt);
+  return false;
+}
+
+
+void btree_close(btree* bt) {
+  if (bt->inner) {
+    free(bt->inner);
+  }
+
+  if (bt->map) {
+    munmap((void*)bt->map, bt->map_len);
+  }
+
+  if (bt->fd != -1) {
+    close(bt->fd);
+  }
+
+  memset(bt, 0, sizeof(btree));
+  bt->fd = -1;
+}
+
+
+uint32_t btree_leaf_page(btree const* bt, subscriber_num num) {
+  uint32_t page_no = bt->hdr.root;
+  uint32_t first_inner = 1 + bt->hdr.n_leaves;
+
+
+  for (uint32_t level = 0; level < bt->hdr.height; ++level) {
+    inner_page const* inner = (inner_page const*)
+      (bt->inner + (size_t)(page_no - first_inner) * BTREE_PAGE_SIZE);
+
+    // Last child whose smallest key is <= num (or the first child)
+    size_t lo = 0, hi = inner->n;
+    while (hi - lo > 1) {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (inner->keys[mid] <= num) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+
+    page_no = inner->children[lo];
+  }
+
+
+  return page_no;
+}
+
+
+bool btree_search_leaf(void const* page, subscriber_num num, client_info* out) {
+  leaf_page const* leaf = (leaf_page const*)page;
+  size_t lo = 0, hi = leaf_len(leaf);
+
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (leaf->records[mid].number < num) {
+      lo = mid + 1;
+    } else if (leaf->records[mid].number > num) {
+      hi = mid;
+    } else {
+      out->number = leaf->records[mid].number;
+      out->ttype = leaf->records[mid].ttype;
+      out->paid = leaf->records[mid].paid;
+      return true;
+    }
+  }
+
+
+  return false;
+}
+
+
+bool btree_for_each(btree const* bt,
+  bool (*fn)(client_info const* entry, void* ctx), void* ctx) {
+  for (uint32_t page_no = 1; page_no <= bt->hdr.n_leaves; ++page_no) {
+    leaf_page const* leaf =
+      (leaf_page const*)(bt->map + (size_t)page_no * BTREE_PAGE_SIZE);
+
+    for (uint32_t i = 0; i < leaf_len(leaf); ++i) {
+      client_info entry;
+
+      entry.number = leaf->records[i].number;
+      entry.ttype = leaf->records[i].ttype;
+      entry.paid = leaf->records[i].paid;
+
+      if (!fn(&entry, ctx)) {
+        return false;
+      }
+    }
+  }
+
+
+  return true;
+}
+
+
+void btree_cursor_init(btree_cursor* cur, btree const* bt) {
+  cur->bt = bt;
+  cur->page_no = 1;
+  cur->i = 0;
+}
+
+
+bool btree_cursor_next(btree_cursor* cur, client_info* out) {
+  while (cur->page_no <= cur->bt->hdr.n_leaves) {
+    leaf_page const* leaf = (leaf_page const*)(cur->bt->map
+      + (size_t)cur->page_no * BTREE_PAGE_SIZE);
+
+    if (cur->i < leaf_len(leaf)) {
+      out->number = leaf->records[cur->i].number;
+      out->ttype = leaf->records[cur->i].ttype;
+      out->paid = leaf->records[cur->i].paid;
+      ++cur->i;
+      return true;
+    }
+
+    ++cur->page_no;
+    cur->i = 0;
+  }
+
+
+  return false;
+}
+
+
+bool btree_lookup(btree const* bt, subscriber_num num, client_info* out) {
+  uint32_t page_no = btree_leaf_page(bt, num);
+
+
+  return btree_search_leaf(bt->map + (size_t)page_no * BTREE_PAGE_SIZE, num,
+    out);
+}
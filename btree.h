@@ -0,0 +1,114 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "database.h"
+
+
+// Disk-resident B+tree of client_info records, for databases larger than
+// RAM. The file is a sequence of BTREE_PAGE_SIZE pages:
+//
+//   page 0                  header
+//   pages 1..n_leaves       leaves, sorted by subscriber number
+//   remaining pages         inner levels, bottom-up; the root is last
+//
+// The file is mmap'd, and the inner levels are copied out and pinned at open
+// time, so a lookup touches at most one (leaf) page that may not be resident.
+// Integers are stored in host byte order; files aren't portable across
+// architectures.
+
+
+#define BTREE_PAGE_SIZE 4096
+#define BTREE_MAGIC "SUBBTREE"
+
+
+// On-disk header (page 0)
+typedef struct {
+  char magic[8];       // BTREE_MAGIC, not null-terminated
+  uint32_t version;
+  uint32_t page_size;
+  uint64_t n_entries;  // Total number of records
+  uint32_t n_leaves;   // Leaf pages start at page 1
+  uint32_t n_inner;    // Inner pages follow the leaves
+  uint32_t height;     // Number of inner levels (0 if the root is a leaf)
+  uint32_t root;       // Page number of the root
+} btree_header;
+
+
+// An open B+tree file
+typedef struct {
+  int fd;
+  uint8_t const* map;  // The whole file
+  size_t map_len;
+  uint8_t* inner;      // Pinned copy of the inner pages
+  btree_header hdr;
+} btree;
+
+
+// Build a B+tree file from a text database (the format parse_database_file()
+// reads). Records are streamed in with parse_database_line() and sorted in
+// bounded runs, kept in temporary files (tmpfile()) and merged, so neither
+// MAX_ENTRIES nor memory limits the input; of a subscriber's records, the
+// last one read is kept.
+// Return value: True if OK, false on malformed input or I/O errors
+bool btree_build(char const* text_filename, char const* btree_filename);
+
+
+// Check whether a file starts with a B+tree header
+bool btree_is_file(char const* filename);
+
+
+// Open a B+tree file and pin its inner levels, checking that they only lead
+// to pages within the file
+// Return value: True if OK, false otherwise
+bool btree_open(btree* bt, char const* filename);
+
+
+// Close a B+tree file
+void btree_close(btree* bt);
+
+
+// Get the page number of the leaf that would hold 'num'. Only the pinned
+// inner levels are read.
+uint32_t btree_leaf_page(btree const* bt, subscriber_num num);
+
+
+// Search a single leaf page (in the mapping, or a copy of one)
+// Return value: True and 'out' filled if found, false otherwise
+bool btree_search_leaf(void const* page, subscriber_num num, client_info* out);
+
+
+// Visit every record in order; the callback returns false to stop
+// Return value: False if the callback stopped the walk
+bool btree_for_each(btree const* bt,
+  bool (*fn)(client_info const* entry, void* ctx), void* ctx);
+
+
+// Position in an in-order walk of the records, for callers that pull
+// records one at a time (e.g. merging two files) instead of btree_for_each()
+typedef struct {
+  btree const* bt;
+  uint32_t page_no;    // Current leaf
+  uint32_t i;          // Next record in it
+} btree_cursor;
+
+
+// Start a walk at the smallest record
+void btree_cursor_init(btree_cursor* cur, btree const* bt);
+
+
+// Get the next record in order
+// Return value: True and 'out' filled, or false once past the last record
+bool btree_cursor_next(btree_cursor* cur, client_info* out);
+
+
+// Lookup an entry by subscriber number
+// Return value: True and 'out' filled if found, false otherwise
+bool btree_lookup(btree const* bt, subscriber_num num, client_info* out);
+
+
+#endif // BTREE_H
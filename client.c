@@ -53,9 +53,65 @@ bool client_init(client* cl, struct sockaddr_in const* addr, client_id id) {
 }
 
 
+// Helper; monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Helper; wait until the pace a server asked for allows another request
+static void client_pace(client* cl) {
+  uint64_t now = now_ns();
+  uint64_t due = cl->last_send_ns + cl->pace_ns;
+  struct timespec wait;
+
+
+  if (now < cl->paced_until_ns && now < due) {
+    wait.tv_sec = (due - now) / 1000000000ULL;
+    wait.tv_nsec = (due - now) % 1000000000ULL;
+    nanosleep(&wait, NULL);
+  }
+
+  cl->last_send_ns = now_ns();
+}
+
+
+// Helper; send the packet in send_buf, keeping to the pace an overloaded
+// server asked for
+// Return value: True if sent
+static bool client_send_raw(client* cl, size_t raw_len,
+  struct sockaddr_in const* dest) {
+  client_pace(cl);
+
+  if (sendto(cl->sock_fd, cl->send_buf, raw_len, 0,
+           (struct sockaddr*)dest, sizeof(struct sockaddr_in)) == -1) {
+    perror("client_send_packet: Failed to send!");
+    return false;
+  }
+
+
+  return true;
+}
+
+
+// Helper; wait before the n-th resend of a request the server was busy for
+static void client_backoff(size_t n) {
+  uint64_t wait_ns = (uint64_t)BUSY_BACKOFF_MS * 1000000ULL << n;
+  struct timespec wait = { wait_ns / 1000000000ULL, wait_ns % 1000000000ULL };
+
+
+  nanosleep(&wait, NULL);
+}
+
+
 void client_send_packet(client* cl, packet_info const* pi, struct sockaddr_in const* dest) {
   size_t raw_len; // Length of data to send
   packet_info reply_pi; // Packet data of any replies (ACKs)
+  size_t n_busy = 0; // BUSY replies so far
 
 
   // Serialize packet data
@@ -63,15 +119,14 @@ void client_send_packet(client* cl, packet_info const* pi, struct sockaddr_in co
 
   
   // Send
-  if (sendto(cl->sock_fd, cl->send_buf, raw_len, 0,
-           (struct sockaddr*)dest, sizeof(struct sockaddr_in)) == -1) {
-    perror("client_send_packet: Failed to send!");
+  if (!client_send_raw(cl, raw_len, dest)) {
     return;
   }
 
   
   // Start timer and wait for ACK if data was sent
   sequence_num seq_num = pi->cont.data_info.seq_num; // Alias for readability
+  cl->acked[seq_num] = false; // Whatever was acknowledged was its last lap
 
   while (cl->tries[seq_num] < MAX_TRIES) {
     memset(&reply_pi, 0, sizeof(reply_pi)); // For debugging... 
@@ -83,6 +138,13 @@ void client_send_packet(client* cl, packet_info const* pi, struct sockaddr_in co
       fprintf(stderr, "client_send_packet: Timed out waiting for ACK or reply!\n");
       ++cl->tries[seq_num];
 
+      // Lost on the way, as far as we know; if it was acknowledged, the
+      // server has it and the reply's still to come
+      if (cl->tries[seq_num] < MAX_TRIES && !cl->acked[seq_num]
+          && !client_send_raw(cl, raw_len, dest)) {
+        return;
+      }
+
 
     } else if (
         interpret_packet(cl->recv_buf, &reply_pi, sizeof(cl->recv_buf)) != 0
@@ -97,9 +159,23 @@ void client_send_packet(client* cl, packet_info const* pi, struct sockaddr_in co
       fprintf(stderr, "client_send_packet: Received reply of %lu bytes\n",
         cl->last_recvd_len);
 
-      if (!client_handle_reply(cl, &reply_pi)) {
+      if (!client_handle_reply(cl, &reply_pi) && !cl->busy) {
         return;
       }
+
+      // Not taken, and its sequence number's still free; the reply didn't
+      // touch send_buf, so the same packet goes again
+      if (cl->busy) {
+        cl->busy = false;
+        if (n_busy == BUSY_MAX_TRIES) {
+          break;
+        }
+
+        client_backoff(n_busy++);
+        if (!client_send_raw(cl, raw_len, dest)) {
+          return;
+        }
+      }
     }
   }
   
@@ -112,11 +188,97 @@ void client_send_packet(client* cl, packet_info const* pi, struct sockaddr_in co
 }
 
 
-bool client_handle_reply(client* cl, packet_info const* reply_pi) {
-  (void)cl; // XXX: turns out client's not needed, but it may well be,
-            // so kept the param for consistency
+// Helper; slot of the grant cache for a number
+static cached_grant* cache_slot(client* cl, subscriber_num num) {
+  return &cl->cache[(num * 2654435761U) & (CACHE_SLOTS - 1)];
+}
+
+
+// Helper; read the i-th subscriber number of a SUBSCRIBE/INVALIDATE payload
+static subscriber_num payload_number(packet_info const* pi, size_t i) {
+  subscriber_num num;
+
+
+  memcpy(&num, (uint8_t const*)pi->cont.data_info.payload + i * sizeof(num),
+    sizeof(num));
+  return ntohl(num);
+}
+
+
+// Helper; update the grant cache from a packet
+static void cache_note(client* cl, packet_info const* pi) {
+  size_t n_nums = pi->cont.data_info.len / sizeof(subscriber_num);
+  uint8_t const* payload = pi->cont.data_info.payload;
+  cached_grant* slot;
+  subscriber_num num;
+
+
+  switch (pi->type) {
+    case SUBSCRIBE:
+      // Subscriptions taken; a new number evicts whatever held its slot
+      for (size_t i = 0; i < n_nums; ++i) {
+        num = payload_number(pi, i);
+        slot = cache_slot(cl, num);
 
+        if (slot->number != num) {
+          slot->number = num;
+          slot->granted = false;
+        }
+        slot->watched_until = time(NULL) + SUBSCRIBE_LEASE_SEC - LEASE_MARGIN;
+      }
+      break;
+
+    case INVALIDATE:
+      for (size_t i = 0; i < n_nums; ++i) {
+        num = payload_number(pi, i);
+        slot = cache_slot(cl, num);
+
+        if (slot->number == num) {
+          slot->granted = false;
+        }
+        ++cl->n_invalidated;
+      }
+      break;
+
+    default:
+      // A verdict, echoing the request's tech and number
+      if (pi->cont.data_info.len < sizeof(tech_type) + sizeof(num)) {
+        break;
+      }
+
+      memcpy(&num, payload + sizeof(tech_type), sizeof(num));
+      num = ntohl(num);
+      slot = cache_slot(cl, num);
+
+      if (slot->number == num) {
+        slot->granted = pi->type == ACC_OK;
+        slot->ttype = payload[0];
+      }
+  }
+}
 
+
+// Helper; mark what a CUM_ACK acknowledges: every number before 'next' (the
+// half of the sequence space behind it, as the server's window counts it),
+// and those after it set in 'sack'
+static void client_note_cum_ack(client* cl, packet_info const* pi) {
+  sequence_num next = pi->cont.cum_ack_info.next;
+  uint64_t sack = pi->cont.cum_ack_info.sack;
+
+
+  for (size_t i = 1; i <= urange(sequence_num) / 2; ++i) {
+    cl->acked[(sequence_num)(next - i)] = true;
+  }
+
+  for (size_t i = 1; i < 64; ++i) {
+    if (sack & (1ULL << i)) {
+      cl->acked[(sequence_num)(next + i)] = true;
+    }
+  }
+}
+
+
+bool client_handle_reply(client* cl, packet_info const* reply_pi) {
   switch(reply_pi->type) {
     case REJECT:  
       fprintf(stderr, "client_send_packet: Received REJECT message!");
@@ -128,16 +290,54 @@ bool client_handle_reply(client* cl, packet_info const* reply_pi) {
       // Got an ACK after all
       fprintf(stderr,
         "client_send_packet: Got an ACK for sequence number: %u\n",
-        reply_pi->cont.data_info.seq_num);
+        reply_pi->cont.ack_info.recvd_seq_num);
+      cl->acked[reply_pi->cont.ack_info.recvd_seq_num] = true;
       
 
+      return true;
+
+    case CUM_ACK:
+      // From a server that delays ACKs; the verdict's still to come
+      fprintf(stderr,
+        "client_send_packet: Got a cumulative ACK for sequence numbers "
+        "before %u, and %d after\n", reply_pi->cont.cum_ack_info.next,
+        __builtin_popcountll(reply_pi->cont.cum_ack_info.sack));
+      client_note_cum_ack(cl, reply_pi);
+
       return true;
 
     case NOT_EXIST:
     case NOT_PAID:
     case ACC_OK:
+    case TRY_LATER:
+      cache_note(cl, reply_pi);
+      alert_reply(reply_pi);
+      return false;
+
+    case BUSY:
+      // Not an answer; client_send_packet() sends the request again
       alert_reply(reply_pi);
+      cl->busy = true;
       return false;
+
+    case SUBSCRIBE:
+      cache_note(cl, reply_pi);
+      fprintf(stderr, "client_send_packet: Server took %lu subscriptions\n",
+        reply_pi->cont.data_info.len / sizeof(subscriber_num));
+      return false;
+
+    case INVALIDATE:
+      // Pushed while we were waiting on something else
+      cache_note(cl, reply_pi);
+      return true;
+
+    case SLOW_DOWN:
+      // The server's falling behind; the verdict's still to come
+      fprintf(stderr, "client_send_packet: Asked to leave %u us between "
+        "requests\n", reply_pi->cont.slow_down_info.interval_us);
+      cl->pace_ns = reply_pi->cont.slow_down_info.interval_us * 1000ULL;
+      cl->paced_until_ns = now_ns() + SLOW_DOWN_HOLD_MS * 1000000ULL;
+      return true;
       
 
     default:
@@ -160,3 +360,30 @@ bool client_recv_packet(client* cl) {
 
   return busy_wait_until(cl->timeout, &try_recv, &sargs, &cl->last_recvd_len);
 }
+
+
+bool client_cache_lookup(client* cl, subscriber_num num, tech_type ttype) {
+  packet_info pi;
+  ssize_t len;
+  cached_grant const* slot = cache_slot(cl, num);
+
+
+  // Invalidations that came in since we last listened
+  while ((len = recv(cl->sock_fd, cl->recv_buf, sizeof(cl->recv_buf),
+          MSG_DONTWAIT)) > 0) {
+    if (interpret_packet(cl->recv_buf, &pi, len) == 0
+        && pi.type == INVALIDATE) {
+      cache_note(cl, &pi);
+    }
+  }
+
+
+  if (slot->number == num && slot->granted && slot->ttype == ttype
+      && time(NULL) < slot->watched_until) {
+    ++cl->n_cache_hits;
+    return true;
+  }
+
+
+  return false;
+}
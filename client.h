@@ -7,17 +7,37 @@
 #include <netinet/ip.h>
 
 #include "packet.h"
+#include "database.h"
 
 
 #define MAX_SEQ_NUM  0xFF // Maximum sequence number
 #define MAX_TRIES    3    // Maximum times to try sending
 #define TIMEOUT      3    // Amount of time, in seconds, to wait for ACK
+#define CACHE_SLOTS  1024 // Grant cache size; power of 2
+#define LEASE_MARGIN 5    // Stop trusting a subscription this many seconds
+                          // before the server drops it
+#define BUSY_BACKOFF_MS 10 // Wait before sending a request the server was
+                           // busy for again; doubles with each BUSY...
+#define BUSY_MAX_TRIES  8  // ...up to this many times
+
+
+// A cached ACC_OK. It's only kept for subscribed numbers, and trusted only
+// while the subscription lasts, since the server pushes an INVALIDATE when
+// the row changes only for as long as that.
+typedef struct {
+  subscriber_num number;
+  tech_type ttype;          // Tech granted...
+  bool granted;             // ...if an ACC_OK is cached
+  time_t watched_until;     // Subscription's end, less LEASE_MARGIN
+} cached_grant;
 
 
 // Struct for state of client
 typedef struct {
   size_t tries[MAX_SEQ_NUM]; // Mapping from packet seq. nums to
                              // number of attempts so far
+  bool acked[MAX_SEQ_NUM + 1]; // Sequence numbers the server has
+                               // acknowledged, by ACK or CUM_ACK
   int sock_fd; // The socket to use for sending
   struct sockaddr_in addr; // The client's internet address
   struct timeval timeout; // How long wait for an ACK each try
@@ -25,6 +45,13 @@ typedef struct {
   uint8_t recv_buf[BUFSIZ]; // Buffer for received packets
   client_id id;             // The client's ID
   size_t last_recvd_len;    // Length of last received reply
+  cached_grant cache[CACHE_SLOTS]; // Direct-mapped by subscriber number
+  size_t n_cache_hits;      // Statistics: requests answered from cache...
+  size_t n_invalidated;     // ...and numbers invalidated by the server
+  uint64_t pace_ns;         // Least time between requests, as asked by a
+  uint64_t paced_until_ns;  // SLOW_DOWN, until then (monotonic clock)
+  uint64_t last_send_ns;    // When the last request went out
+  bool busy;                // The last reply was a BUSY
 } client;
 
 
@@ -39,15 +66,24 @@ bool client_init(client* cl, struct sockaddr_in const* addr, client_id id);
 
 
 // Send a packet using the specified socket, timing out and retrying as
-// necessary
+// necessary; once the server has acknowledged the packet, only waits for
+// the reply. While a server's SLOW_DOWN holds, waits out its pace first; a
+// BUSY reply has it back off and send the packet again.
 void client_send_packet(client* cl, packet_info const* pi, struct sockaddr_in const* dest);
 
 
-// Handle a server response, ACK, REJECT, or otherwise
+// Handle a server response, ACK, REJECT, or otherwise. ACKs and CUM_ACKs
+// mark sequence numbers acknowledged; verdicts, SUBSCRIBE replies and
+// INVALIDATE pushes update the grant cache.
 // Return value: True if more recv()s should be done, false if done processing
 bool client_handle_reply(client* cl, packet_info const* reply_pi);
 
 
+// Check the grant cache, after handling any invalidations that came in
+// Return value: True if access to the tech is known to be granted
+bool client_cache_lookup(client* cl, subscriber_num num, tech_type ttype);
+
+
 // Receive with packets with timeout
 bool client_recv_packet(client* cl);
 
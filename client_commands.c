@@ -15,15 +15,26 @@
 #include "client.h"
 #include "database.h"
 #include "raw_iterator.h"
+#include "hashring.h"
 
 
 // Command map
 const command_pair commands[] = {
   { "dump_config", &dump_config },
+  { "load_ring", &load_ring },
+  { "send_cached", &send_cached },
   { "send_req", &send_req },
+  { "send_routed", &send_routed },
+  { "subscribe", &subscribe },
+  { "subscribe_ring", &subscribe_ring },
 };
 
 
+// Cluster ring for send_routed, and the next sequence number for each node
+static hash_ring ring;
+static sequence_num ring_seq[RING_MAX_NODES];
+
+
 // Helper for parsing IP/port/sequence number
 static bool parse_ip_args(char** argv, struct sockaddr_in* dest_addr, sequence_num* seq_num) {
   char* end = NULL; // For parsing port number
@@ -94,30 +105,15 @@ static bool parse_client_info(client_info* info, char const* num_str, char* cons
 }
 
 
-// TODO
-void send_req(size_t argc, char** argv) {
-  struct sockaddr_in dest_addr; // To hold the destination address
+// Helper; build and send an access request
+static void send_access_request(struct sockaddr_in const* dest_addr,
+  sequence_num seq_num, client_info info) {
   packet_info pi; // For building the packet to send
-  sequence_num seq_num; // User-supplied sequence number; usually not needed
-                        // but in this allows explicit out-of-sequence sends
   char ip_str[INET_ADDRSTRLEN]; // For message printing
-  client_info info; // For storing user input
   uint8_t payload[sizeof(subscriber_num) + sizeof(tech_type)]; // Payload to send
   raw_iterator rit; // For setting up payload
 
 
-  // Check for and validate arguments
-  if (argc != 6) {
-    SHELL_ERROR("Usage: send_req [dest_ip] [port] [seq_num] [sub_num] [tech_type]");
-    return;
-  }
-
-  if (!parse_ip_args(argv, &dest_addr, &seq_num)
-        || !parse_client_info(&info, argv[4], argv[5])) {
-    return;
-  }
-  
-   
   // Construct the packet
   info.number = htonl(info.number);
 
@@ -134,10 +130,207 @@ void send_req(size_t argc, char** argv) {
   
   // Send
   fprintf(stderr, "Sending to IP %s, port %u\n",
-    inet_ntop(AF_INET, &dest_addr.sin_addr, ip_str, INET_ADDRSTRLEN),
-    ntohs(dest_addr.sin_port));
+    inet_ntop(AF_INET, &dest_addr->sin_addr, ip_str, INET_ADDRSTRLEN),
+    ntohs(dest_addr->sin_port));
+
+  client_send_packet(&the_client, &pi, dest_addr);
+}
+
+
+// TODO
+void send_req(size_t argc, char** argv) {
+  struct sockaddr_in dest_addr; // To hold the destination address
+  sequence_num seq_num; // User-supplied sequence number; usually not needed
+                        // but in this allows explicit out-of-sequence sends
+  client_info info; // For storing user input
+
+
+  // Check for and validate arguments
+  if (argc != 6) {
+    SHELL_ERROR("Usage: send_req [dest_ip] [port] [seq_num] [sub_num] [tech_type]");
+    return;
+  }
+
+  if (!parse_ip_args(argv, &dest_addr, &seq_num)
+        || !parse_client_info(&info, argv[4], argv[5])) {
+    return;
+  }
+
+
+  send_access_request(&dest_addr, seq_num, info);
+}
+
+
+// Helper for parsing the subscriber numbers of a subscription, into network
+// order
+static bool parse_sub_nums(char** argv, size_t n_nums, subscriber_num* nums) {
+  char* end; // For use with strtoul()
+
+
+  for (size_t i = 0; i < n_nums; ++i) {
+    if (strlen(argv[i]) != SUBNUM_STRLEN) {
+      SHELL_ERROR("subscribe: Bad subscriber number length!");
+      return false;
+    }
+
+    nums[i] = htonl(strtoul(argv[i], &end, 10));
+    if (*end != '\0') {
+      SHELL_ERROR("subscribe: Invalid subscriber number!");
+      return false;
+    }
+  }
+
+
+  return true;
+}
+
+
+// Helper for sending a subscription
+static void send_subscribe(struct sockaddr_in const* dest_addr,
+  sequence_num seq_num, subscriber_num const* nums, size_t n_nums) {
+  packet_info pi; // For building the packet to send
+
+
+  pi.type = SUBSCRIBE;
+  pi.id = the_client.id;
+  pi.cont.data_info.seq_num = seq_num;
+  pi.cont.data_info.len = n_nums * sizeof(subscriber_num);
+  pi.cont.data_info.payload = nums;
+
+  client_send_packet(&the_client, &pi, dest_addr);
+}
+
+
+void subscribe(size_t argc, char** argv) {
+  struct sockaddr_in dest_addr; // To hold the destination address
+  sequence_num seq_num; // User-supplied sequence number
+  subscriber_num nums[SUBSCRIBE_MAX_NUMS]; // Payload, in network order
+
+
+  // Check for and validate arguments
+  if (argc < 5 || argc - 4 > SUBSCRIBE_MAX_NUMS) {
+    SHELL_ERROR("Usage: subscribe [dest_ip] [port] [seq_num] [sub_num]...");
+    return;
+  }
+
+  if (!parse_ip_args(argv, &dest_addr, &seq_num)
+        || !parse_sub_nums(argv + 4, argc - 4, nums)) {
+    return;
+  }
+
+
+  send_subscribe(&dest_addr, seq_num, nums, argc - 4);
+}
+
+
+void send_cached(size_t argc, char** argv) {
+  struct sockaddr_in dest_addr; // To hold the destination address
+  sequence_num seq_num; // User-supplied sequence number
+  client_info info; // For storing user input
+
+
+  if (argc != 6) {
+    SHELL_ERROR("Usage: send_cached [dest_ip] [port] [seq_num] [sub_num] [tech_type]");
+    return;
+  }
+
+  if (!parse_ip_args(argv, &dest_addr, &seq_num)
+        || !parse_client_info(&info, argv[4], argv[5])) {
+    return;
+  }
+
+  if (client_cache_lookup(&the_client, info.number, info.ttype)) {
+    fprintf(stderr, "send_cached: Access granted (cached)\n");
+    return;
+  }
+
+
+  send_access_request(&dest_addr, seq_num, info);
+}
+
+
+void load_ring(size_t argc, char** argv) {
+  if (argc != 2) {
+    SHELL_ERROR("Usage: load_ring [ring_file]");
+    return;
+  }
+
+  hash_ring_destroy(&ring);
+  if (!hash_ring_load(&ring, argv[1])) {
+    return;
+  }
+
+  memset(ring_seq, 0, sizeof(ring_seq));
+  fprintf(stderr, "load_ring: %lu nodes, %lu points\n", ring.n_nodes,
+    ring.n_points);
+}
+
+
+void send_routed(size_t argc, char** argv) {
+  client_info info; // For storing user input
+  size_t owner; // Node to send to
+
+
+  // Check for and validate arguments
+  if (argc != 3) {
+    SHELL_ERROR("Usage: send_routed [sub_num] [tech_type]");
+    return;
+  }
+
+  if (ring.n_nodes == 0) {
+    SHELL_ERROR("send_routed: No ring loaded; see load_ring");
+    return;
+  }
+
+  if (!parse_client_info(&info, argv[1], argv[2])) {
+    return;
+  }
+
+
+  owner = hash_ring_owner(&ring, info.number);
+  fprintf(stderr, "send_routed: %u is node %lu's\n", info.number, owner + 1);
+  send_access_request(&ring.nodes[owner].addr, ring_seq[owner]++, info);
+}
 
-  client_send_packet(&the_client, &pi, &dest_addr);
+
+void subscribe_ring(size_t argc, char** argv) {
+  subscriber_num nums[SUBSCRIBE_MAX_NUMS]; // All numbers, in network order
+  subscriber_num owned[SUBSCRIBE_MAX_NUMS]; // Those of one node
+  size_t n_owned;
+
+
+  // Check for and validate arguments
+  if (argc < 2 || argc - 1 > SUBSCRIBE_MAX_NUMS) {
+    SHELL_ERROR("Usage: subscribe_ring [sub_num]...");
+    return;
+  }
+
+  if (ring.n_nodes == 0) {
+    SHELL_ERROR("subscribe_ring: No ring loaded; see load_ring");
+    return;
+  }
+
+  if (!parse_sub_nums(argv + 1, argc - 1, nums)) {
+    return;
+  }
+
+
+  // One subscription per node that owns any of the numbers
+  for (size_t node = 0; node < ring.n_nodes; ++node) {
+    n_owned = 0;
+    for (size_t i = 0; i < argc - 1; ++i) {
+      if (hash_ring_owner(&ring, ntohl(nums[i])) == node) {
+        owned[n_owned++] = nums[i];
+      }
+    }
+
+    if (n_owned > 0) {
+      fprintf(stderr, "subscribe_ring: %lu for node %lu\n", n_owned,
+        node + 1);
+      send_subscribe(&ring.nodes[node].addr, ring_seq[node]++, owned,
+        n_owned);
+    }
+  }
 }
 
 
@@ -156,4 +349,6 @@ void dump_config(size_t argc, char** argv) {
       ntohs(the_client.addr.sin_port),
       the_client.id,
       the_client.sock_fd);
+  fprintf(stderr, "Cached grants used: %lu; invalidations received: %lu\n",
+    the_client.n_cache_hits, the_client.n_invalidated);
 }
@@ -6,7 +6,7 @@
 #include "client.h"
 
 
-#define N_COMMANDS 2
+#define N_COMMANDS 7
 
 
 // The single client instance
@@ -26,6 +26,35 @@ extern const command_pair commands[];
 void send_req(size_t argc, char** argv);
 
 
+// Subscribe to invalidations of some subscribers' rows, so their grants
+// can be cached
+// Usage: subscribe [dest_ip] [port] [seq_num] [sub_num]...
+void subscribe(size_t argc, char** argv);
+
+
+// Like send_req, but answered from the grant cache if possible, in which
+// case nothing is sent and the sequence number isn't used
+void send_cached(size_t argc, char** argv);
+
+
+// Load the ring of a server cluster (see hashring.h), for send_routed
+// Usage: load_ring [ring_file]
+void load_ring(size_t argc, char** argv);
+
+
+// Send an access request to the cluster node that owns the subscriber;
+// sequence numbers are kept per node
+// Usage: send_routed [sub_num] [tech_type]
+void send_routed(size_t argc, char** argv);
+
+
+// Subscribe through the ring: each node is sent the numbers it owns, as
+// only the owner takes subscriptions to a number; sequence numbers are kept
+// per node, shared with send_routed
+// Usage: subscribe_ring [sub_num]...
+void subscribe_ring(size_t argc, char** argv);
+
+
 // Dump the current client configuration
 // Usage: dump_config
 void dump_config(size_t, char**);
@@ -1,7 +1,16 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for memfd_create()
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #include "mpc.h"
 #include "database.h"
@@ -28,9 +37,40 @@ static void str_to_entry(client_info* entry, char const* raw_str) {
 }
 
 
+#define HUGEPAGE_SIZE    (2UL << 20)
+#define HUGEPAGE_SIZE_1G (1UL << 30)
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+
+// Helper for mapping; rounds 'len' up to a multiple of 'align' (a power of 2)
+static size_t round_up(size_t len, size_t align) {
+  return (len + align - 1) & ~(align - 1);
+}
+
+
+// Helper; try an anonymous mapping with extra flags
+static void* try_map(size_t len, int extra_flags) {
+  void* addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+
+  return addr == MAP_FAILED ? NULL : addr;
+}
+
+
 // Helper; for use with bsearch() and qsort()
 static int compare_sub_num(void const* info1, void const* info2) {
-  return ((client_info*)info1)->number - ((client_info*)info2)->number;
+  subscriber_num a = ((client_info*)info1)->number;
+  subscriber_num b = ((client_info*)info2)->number;
+
+  // Not a - b: numbers past INT_MAX would wrap and misorder
+  return (a > b) - (a < b);
 }
   
 
@@ -157,6 +197,80 @@ bool parse_database_file(char const* filename, database* db) {
 } 
 
 
+size_t parse_database_line(char const* line, size_t len, client_info* entry) {
+  uint64_t number = 0; // Accumulated as we go; str_to_entry()'s strtol()s
+  unsigned ttype = 0;  // dominate the cost of bulk parses otherwise
+  bool paid = false;
+  size_t pos = 0; // Current position in line
+
+
+  // Subscriber number: ddd-ddd-dddd
+  if (len < SUBNUM_STRLEN + 2) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < SUBNUM_STRLEN + 2; ++i, ++pos) {
+    if (i == 3 || i == 7) {
+      if (line[pos] != '-') {
+        return 0;
+      }
+    } else if (line[pos] >= '0' && line[pos] <= '9') {
+      number = number * 10 + (line[pos] - '0');
+    } else {
+      return 0;
+    }
+  }
+
+
+  // Spaces, tech type, spaces, paid
+  for (int field = 0; field < 2; ++field) {
+    size_t n_digits = field == 0 ? TECH_STRLEN : PAID_STRLEN;
+    size_t spaces_start = pos;
+
+    while (pos < len && line[pos] == ' ') {
+      ++pos;
+    }
+
+    if (pos == spaces_start || pos + n_digits > len) {
+      return 0;
+    }
+
+    for (size_t i = 0; i < n_digits; ++i, ++pos) {
+      char c = line[pos];
+
+      if (field == 0 ? (c < '0' || c > '9') : (c != '0' && c != '1')) {
+        return 0;
+      }
+
+      if (field == 0) {
+        ttype = ttype * 10 + (c - '0');
+      } else {
+        paid = c == '1';
+      }
+    }
+  }
+
+
+  if (pos >= len || line[pos] != '\n') {
+    return 0;
+  }
+
+
+  // Same truncation as str_to_entry()
+  entry->number = (subscriber_num)number;
+  entry->ttype = (tech_type)ttype;
+  entry->paid = paid;
+
+
+  return pos + 1;
+}
+
+
+void database_sort(database* db) {
+  qsort(db->entries, db->n_filled, sizeof(client_info), &compare_sub_num);
+}
+
+
 client_info* lookup(database const* db, subscriber_num num) {
   client_info info; // Dummy key for search
   info.number = num;
@@ -175,3 +289,156 @@ void dump_database(database const* db) {
       db->entries[i].ttype, db->entries[i].paid);
   }
 }
+
+
+database* database_new(unsigned flags) {
+  void* addr = NULL; // Start of the mapping
+  size_t len = 0; // Length of the mapping
+
+
+  // Explicit huge pages only work if the admin reserved some
+  // (/proc/sys/vm/nr_hugepages), so fall through on failure
+  if (flags & DB_HUGEPAGES_1G) {
+    len = round_up(sizeof(database), HUGEPAGE_SIZE_1G);
+    addr = try_map(len, MAP_HUGETLB | MAP_HUGE_1GB);
+  }
+
+  if (!addr && (flags & (DB_HUGEPAGES | DB_HUGEPAGES_1G))) {
+    len = round_up(sizeof(database), HUGEPAGE_SIZE);
+    addr = try_map(len, MAP_HUGETLB | MAP_HUGE_2MB);
+  }
+
+  if (!addr) {
+    len = round_up(sizeof(database), (size_t)sysconf(_SC_PAGESIZE));
+    if (flags & (DB_HUGEPAGES | DB_HUGEPAGES_1G)) {
+      // Align to a huge page so THP can actually back the entries
+      len = round_up(len, HUGEPAGE_SIZE);
+    }
+
+    if ((addr = try_map(len, 0)) == NULL) {
+      perror("database_new: Couldn't map database");
+      return NULL;
+    }
+
+    if ((flags & (DB_HUGEPAGES | DB_HUGEPAGES_1G))
+        && madvise(addr, len, MADV_HUGEPAGE) == -1) {
+      perror("database_new: madvise(MADV_HUGEPAGE) failed");
+    }
+  }
+
+
+  database* db = (database*)addr;
+  db->n_filled = 0;
+  db->map_len = len;
+
+
+  return db;
+}
+
+
+void database_delete(database* db) {
+  if (db) {
+    munmap(db, db->map_len);
+  }
+}
+
+
+database* database_replicate(database const* src, int node, unsigned flags) {
+  database* replica = database_new(flags);
+  unsigned long nodemask; // Single-node policy mask
+
+
+  if (!replica) {
+    return NULL;
+  }
+
+  if (node < 0) {
+    node = database_current_node();
+  }
+
+
+  // Bind before the copy below first-touches the pages; if the kernel has no
+  // NUMA support, first touch from this thread is the best we can do anyway
+  nodemask = 1UL << node;
+  if (syscall(SYS_mbind, replica, replica->map_len, MPOL_BIND, &nodemask,
+        sizeof(nodemask) * 8, MPOL_MF_MOVE) == -1) {
+    perror("database_replicate: mbind() failed");
+  }
+
+
+  size_t map_len = replica->map_len; // Don't clobber with src's
+  memcpy(replica, src, sizeof(database));
+  replica->map_len = map_len;
+
+
+  return replica;
+}
+
+
+int database_export(database const* db) {
+  size_t len = round_up(sizeof(database), (size_t)sysconf(_SC_PAGESIZE));
+  int fd = memfd_create("subscriber-database", MFD_CLOEXEC);
+  size_t written = 0;
+  ssize_t n;
+
+
+  if (fd == -1 || ftruncate(fd, len) == -1) {
+    perror("database_export: Couldn't create memory file");
+    goto fail;
+  }
+
+  while (written < sizeof(database)) {
+    if ((n = pwrite(fd, (char const*)db + written, sizeof(database) - written,
+          written)) <= 0) {
+      perror("database_export: Couldn't write memory file");
+      goto fail;
+    }
+    written += n;
+  }
+
+
+  return fd;
+
+
+fail:
+  if (fd != -1) {
+    close(fd);
+  }
+  return -1;
+}
+
+
+database* database_import(int fd) {
+  struct stat st;
+  database* db;
+
+
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(database)) {
+    fprintf(stderr, "database_import: Not an exported database\n");
+    return NULL;
+  }
+
+  if ((db = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+        0)) == MAP_FAILED) {
+    perror("database_import: Couldn't map database");
+    return NULL;
+  }
+
+  db->map_len = st.st_size;
+
+
+  return db;
+}
+
+
+int database_current_node(void) {
+  unsigned cpu, node; // Filled by getcpu()
+
+
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) == -1) {
+    return 0;
+  }
+
+
+  return (int)node;
+}
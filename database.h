@@ -31,15 +31,70 @@ typedef struct {
 typedef struct {
   client_info entries[MAX_ENTRIES];
   size_t n_filled;
+  size_t map_len; // Length of the backing mapping (see database_new())
 } database;
 
 
+// Flags for database_new()
+#define DB_HUGEPAGES    0x1 // Back the database with 2MB pages if possible
+#define DB_HUGEPAGES_1G 0x2 // Try 1GB pages first (implies DB_HUGEPAGES)
+
+
+// Allocate an empty database in its own anonymous mapping.
+// With DB_HUGEPAGES, explicit huge pages (MAP_HUGETLB) are tried first; if
+// none are reserved, a normal mapping is used and transparent huge pages are
+// requested with madvise() instead.
+// Return value: The new database, or NULL if the mapping failed
+database* database_new(unsigned flags);
+
+
+// Unmap a database from database_new() or database_replicate()
+void database_delete(database* db);
+
+
+// Copy a database into a fresh mapping whose pages are bound to NUMA node
+// 'node'. A negative node means the node of the calling CPU.
+// Return value: The replica, or NULL on failure
+database* database_replicate(database const* src, int node, unsigned flags);
+
+
+// Copy a database into a memory file (memfd), e.g. to hand it to another
+// process
+// Return value: The file's descriptor, or -1 on failure
+int database_export(database const* db);
+
+
+// Map a database from database_export(), possibly made by another process.
+// The mapping is private: pages are shared with the file until written.
+// Return value: The database, or NULL on failure
+database* database_import(int fd);
+
+
+// Get the NUMA node of the CPU the caller is running on (0 if unknown)
+int database_current_node(void);
+
+
 // Parse database info from a file and initialize an array of the info.
 // Params: TODO
 // POSTCONDITION: Param 'database' is sorted and contains the parsed info
 bool parse_database_file(char const* filename, database* db);  
 
 
+// Parse a single record in the format read by parse_database_file(), i.e.
+// one line including its terminating newline, without going through mpc.
+// Args:
+//   line - Start of the record; need not be null-terminated
+//   len - Number of characters available at 'line'
+//   entry - Filled with the record on success
+// Return value: The number of characters consumed, or 0 if the record is
+// malformed or incomplete
+size_t parse_database_line(char const* line, size_t len, client_info* entry);
+
+
+// Sort a database's entries by subscriber number, as lookup() requires
+void database_sort(database* db);
+
+
 // Lookup an entry by subscriber number
 client_info* lookup(database const* db, subscriber_num num);
 
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "delta.h"
+
+
+// Computes the delta between two versions of the subscriber database
+// (text or B+tree), or prints a delta file in the database's text format.
+
+
+// Helper; print a delta record, prefixed with its op
+static bool print_record(delta_op op, client_info const* entry, void* ctx) {
+  static char const ops[] = { '?', '+', '~', '-' };
+  uint32_t num = entry->number;
+
+
+  (void)ctx;
+  printf("%c %03u-%03u-%04u %02u %u\n", ops[op], num / 10000000,
+    num / 10000 % 1000, num % 10000, entry->ttype, entry->paid);
+
+
+  return true;
+}
+
+
+// Helper; size of a file, for throughput figures
+static double file_mb(char const* filename) {
+  struct stat st;
+
+
+  return stat(filename, &st) == 0 ? st.st_size / 1e6 : 0.0;
+}
+
+
+int main(int argc, char** argv) {
+  delta_stats stats;
+  struct timespec start, end;
+
+
+  if (argc == 3 && strcmp(argv[1], "-p") == 0) {
+    return delta_apply(argv[2], &print_record, NULL) ? EXIT_SUCCESS : 1;
+  }
+
+  if (argc != 4) {
+    fprintf(stderr,
+      "Usage: %s [old_database] [new_database] [out.delta]\n"
+      "       %s -p [in.delta]\n",
+      argv[0], argv[0]);
+    return 1;
+  }
+
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (!delta_diff(argv[1], argv[2], argv[3], &stats)) {
+    fprintf(stderr, "%s: Couldn't diff %s and %s\n", argv[0], argv[1],
+      argv[2]);
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+
+  double secs = (end.tv_sec - start.tv_sec)
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  double mb = file_mb(argv[1]) + file_mb(argv[2]);
+
+  fprintf(stderr, "%lu -> %lu rows: %lu inserts, %lu updates, %lu deletes\n",
+    stats.n_old, stats.n_new, stats.n_inserts, stats.n_updates,
+    stats.n_deletes);
+  fprintf(stderr, "%.3f s, %.1f Mrows/s, %.0f MB/s of input\n", secs,
+    (stats.n_old + stats.n_new) / secs / 1e6, mb / secs);
+
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "database.h"
+#include "btree.h"
+#include "tech_index.h"
+
+
+// Bulk queries over a subscriber database (text or B+tree), answered from
+// per-tech bitmaps rather than by scanning entries.
+
+
+// Helper; print a subscriber number in the database's format
+static bool print_num(uint32_t num, void* ctx) {
+  (void)ctx;
+  printf("%03u-%03u-%04u\n", num / 10000000, num / 10000 % 1000, num % 10000);
+  return true;
+}
+
+
+// Helper; parse a tech type argument
+static bool parse_tech(char const* str, tech_type* ttype) {
+  char* end;
+  unsigned long val = strtoul(str, &end, 10);
+
+
+  if (end == str || *end != '\0' || val >= N_TECH_TYPES) {
+    fprintf(stderr, "dbquery: Bad technology type: %s\n", str);
+    return false;
+  }
+
+  *ttype = val;
+
+
+  return true;
+}
+
+
+int main(int argc, char** argv) {
+  static tech_index idx; // Big; keep it off the stack
+  static database db;
+  btree bt;
+  tech_type t1, t2;
+  struct timespec start, end;
+
+
+  if (argc < 4
+      || (strcmp(argv[2], "common") == 0 ? argc != 5 : argc != 4)) {
+    fprintf(stderr,
+      "Usage: %s [database] count [tech]\n"
+      "       %s [database] unpaid [tech]\n"
+      "       %s [database] common [tech1] [tech2]\n",
+      argv[0], argv[0], argv[0]);
+    return 1;
+  }
+
+  if (!parse_tech(argv[3], &t1) || (argc == 5 && !parse_tech(argv[4], &t2))) {
+    return 1;
+  }
+
+
+  // Load and build the bitmaps
+  tech_index_init(&idx);
+
+  if (btree_is_file(argv[1])) {
+    if (!btree_open(&bt, argv[1]) || !tech_index_build_btree(&idx, &bt)) {
+      return 1;
+    }
+    btree_close(&bt);
+  } else if (!parse_database_file(argv[1], &db)
+      || !tech_index_build(&idx, &db)) {
+    return 1;
+  }
+
+
+  // Query
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (strcmp(argv[2], "count") == 0) {
+    printf("tech %02u: %lu entitled, %lu paid\n", t1,
+      tech_index_count_entitled(&idx, t1), tech_index_count_paid(&idx, t1));
+  } else if (strcmp(argv[2], "unpaid") == 0) {
+    tech_index_for_each_unpaid(&idx, t1, &print_num, NULL);
+  } else if (strcmp(argv[2], "common") == 0) {
+    printf("techs %02u and %02u: %lu in common\n", t1, t2,
+      tech_index_count_common(&idx, t1, t2));
+  } else {
+    fprintf(stderr, "%s: Unknown query: %s\n", argv[0], argv[2]);
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  fprintf(stderr, "Query took %.3f ms\n", (end.tv_sec - start.tv_sec) * 1e3
+    + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+
+  tech_index_destroy(&idx);
+
+
+  return EXIT_SUCCESS;
+}
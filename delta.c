@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "delta.h"
+#include "btree.h"
+
+
+#define OUT_BUF_SIZE (1 << 20) // stdio buffer for the delta being written
+
+
+// One side of a diff: a sorted stream of rows from a text or B+tree file
+typedef struct {
+  char const* filename;
+  bool is_btree;
+  btree bt;                 // If is_btree
+  btree_cursor cur;
+  int fd;                   // Otherwise, the mapped text
+  char const* text;
+  size_t text_len;
+  size_t pos;               // Next byte to parse
+  size_t n;                 // Rows read so far
+  subscriber_num last;      // Previous row's number, to check the order
+} image;
+
+
+// Helper; map a database image for a sequential read
+static bool image_open(image* img, char const* filename) {
+  struct stat st;
+
+
+  memset(img, 0, sizeof(image));
+  img->filename = filename;
+  img->fd = -1;
+
+  if ((img->is_btree = btree_is_file(filename))) {
+    if (!btree_open(&img->bt, filename)) {
+      return false;
+    }
+
+    madvise((void*)img->bt.map, img->bt.map_len, MADV_SEQUENTIAL);
+    btree_cursor_init(&img->cur, &img->bt);
+    return true;
+  }
+
+
+  if ((img->fd = open(filename, O_RDONLY)) == -1
+      || fstat(img->fd, &st) == -1) {
+    perror("delta_diff: Couldn't open database");
+    return false;
+  }
+
+  img->text_len = st.st_size;
+  if (img->text_len > 0) {
+    if ((img->text = mmap(NULL, img->text_len, PROT_READ, MAP_PRIVATE,
+          img->fd, 0)) == MAP_FAILED) {
+      perror("delta_diff: Couldn't map database");
+      img->text = NULL;
+      return false;
+    }
+
+    madvise((void*)img->text, img->text_len, MADV_SEQUENTIAL);
+  }
+
+
+  return true;
+}
+
+
+// Helper; unmap an image
+static void image_close(image* img) {
+  if (img->is_btree) {
+    btree_close(&img->bt);
+    return;
+  }
+
+  if (img->text) {
+    munmap((void*)img->text, img->text_len);
+  }
+  if (img->fd != -1) {
+    close(img->fd);
+  }
+}
+
+
+// Helper; get the next row of an image
+// Args:
+//   ok - Set to false on malformed or out-of-order input
+// Return value: True and 'out' filled if there was a row
+static bool image_next(image* img, client_info* out, bool* ok) {
+  if (img->is_btree) {
+    if (!btree_cursor_next(&img->cur, out)) {
+      return false;
+    }
+  } else {
+    size_t len;
+
+    if (img->pos == img->text_len) {
+      return false;
+    }
+
+    if ((len = parse_database_line(img->text + img->pos,
+          img->text_len - img->pos, out)) == 0) {
+      fprintf(stderr, "delta_diff: %s: Malformed record at byte %lu\n",
+        img->filename, img->pos);
+      *ok = false;
+      return false;
+    }
+
+    img->pos += len;
+  }
+
+
+  // A merge-join needs strictly increasing keys
+  if (img->n > 0 && out->number <= img->last) {
+    fprintf(stderr, "delta_diff: %s: Not sorted, or duplicate subscriber "
+      "%u\n", img->filename, out->number);
+    *ok = false;
+    return false;
+  }
+
+  img->last = out->number;
+  ++img->n;
+
+
+  return true;
+}
+
+
+void delta_encode(delta_record* rec, delta_op op, client_info const* entry) {
+  rec->number = htonl(entry->number);
+  rec->op = op;
+  rec->ttype = op == DELTA_DELETE ? 0 : entry->ttype;
+  rec->paid = op == DELTA_DELETE ? 0 : entry->paid;
+  rec->reserved = 0;
+}
+
+
+bool delta_decode(delta_record const* rec, delta_op* op, client_info* entry) {
+  if (rec->op < DELTA_INSERT || rec->op > DELTA_DELETE) {
+    return false;
+  }
+
+  *op = (delta_op)rec->op;
+  entry->number = ntohl(rec->number);
+  entry->ttype = rec->ttype;
+  entry->paid = rec->paid;
+
+
+  return true;
+}
+
+
+bool delta_diff(char const* old_filename, char const* new_filename,
+  char const* delta_filename, delta_stats* stats) {
+  image old_img, new_img;
+  FILE* out = NULL;
+  char* out_buf = NULL;
+  delta_header hdr;
+  delta_record rec;
+  delta_stats counts;
+  client_info a, b; // Current rows of the old and new images
+  bool ok = true;
+
+
+  memset(&counts, 0, sizeof(counts));
+
+  if (!image_open(&old_img, old_filename)) {
+    return false;
+  }
+  if (!image_open(&new_img, new_filename)) {
+    image_close(&old_img);
+    return false;
+  }
+
+  if ((out = fopen(delta_filename, "wb")) == NULL) {
+    perror("delta_diff: Couldn't create delta file");
+    ok = false;
+    goto done;
+  }
+
+  if ((out_buf = malloc(OUT_BUF_SIZE)) != NULL) {
+    setvbuf(out, out_buf, _IOFBF, OUT_BUF_SIZE);
+  }
+
+
+  // Header; the count is filled in at the end
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic));
+  hdr.version = htonl(DELTA_VERSION);
+  fwrite(&hdr, sizeof(hdr), 1, out);
+
+
+  // Merge-join
+  bool have_a = image_next(&old_img, &a, &ok);
+  bool have_b = image_next(&new_img, &b, &ok);
+
+  while (ok && (have_a || have_b)) {
+    if (have_a && (!have_b || a.number < b.number)) {
+      delta_encode(&rec, DELTA_DELETE, &a);
+      fwrite(&rec, sizeof(rec), 1, out);
+      ++counts.n_deletes;
+      have_a = image_next(&old_img, &a, &ok);
+
+    } else if (have_b && (!have_a || b.number < a.number)) {
+      delta_encode(&rec, DELTA_INSERT, &b);
+      fwrite(&rec, sizeof(rec), 1, out);
+      ++counts.n_inserts;
+      have_b = image_next(&new_img, &b, &ok);
+
+    } else {
+      if (a.ttype != b.ttype || a.paid != b.paid) {
+        delta_encode(&rec, DELTA_UPDATE, &b);
+        fwrite(&rec, sizeof(rec), 1, out);
+        ++counts.n_updates;
+      }
+
+      have_a = image_next(&old_img, &a, &ok);
+      have_b = image_next(&new_img, &b, &ok);
+    }
+  }
+
+  counts.n_old = old_img.n;
+  counts.n_new = new_img.n;
+
+
+  // Fill in the count
+  hdr.n_records = htobe64(counts.n_inserts + counts.n_updates
+    + counts.n_deletes);
+
+  if (ok && (fseek(out, 0, SEEK_SET) != 0
+        || fwrite(&hdr, sizeof(hdr), 1, out) != 1 || fflush(out) != 0
+        || ferror(out))) {
+    perror("delta_diff: Couldn't write delta file");
+    ok = false;
+  }
+
+
+done:
+  if (out) {
+    fclose(out);
+    if (!ok) {
+      unlink(delta_filename);
+    }
+  }
+  free(out_buf);
+  image_close(&old_img);
+  image_close(&new_img);
+
+  if (stats) {
+    *stats = counts;
+  }
+
+
+  return ok;
+}
+
+
+bool delta_apply(char const* delta_filename, delta_fn fn, void* ctx) {
+  int fd = open(delta_filename, O_RDONLY);
+  struct stat st;
+  uint8_t const* map = NULL;
+  delta_header hdr;
+  uint64_t n_records;
+  bool ok = false;
+
+
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror("delta_apply: Couldn't open delta file");
+    goto done;
+  }
+
+  if ((size_t)st.st_size < sizeof(hdr)) {
+    fprintf(stderr, "delta_apply: %s is not a delta file\n", delta_filename);
+    goto done;
+  }
+
+  if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+      == MAP_FAILED) {
+    perror("delta_apply: Couldn't map delta file");
+    map = NULL;
+    goto done;
+  }
+
+  madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+
+
+  // Check the header
+  memcpy(&hdr, map, sizeof(hdr));
+  n_records = be64toh(hdr.n_records);
+
+  if (memcmp(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic)) != 0
+      || ntohl(hdr.version) != DELTA_VERSION
+      || n_records != (st.st_size - sizeof(hdr)) / sizeof(delta_record)
+      || (st.st_size - sizeof(hdr)) % sizeof(delta_record) != 0) {
+    fprintf(stderr, "delta_apply: %s is not a delta file, or is truncated\n",
+      delta_filename);
+    goto done;
+  }
+
+
+  delta_record const* recs = (delta_record const*)(map + sizeof(hdr));
+
+  for (uint64_t i = 0; i < n_records; ++i) {
+    delta_op op;
+    client_info entry;
+
+    if (!delta_decode(&recs[i], &op, &entry)) {
+      fprintf(stderr, "delta_apply: Bad record %lu\n", (unsigned long)i);
+      goto done;
+    }
+
+    if (!fn(op, &entry, ctx)) {
+      goto done;
+    }
+  }
+
+  ok = true;
+
+
+done:
+  if (map) {
+    munmap((void*)map, st.st_size);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+
+
+  return ok;
+}
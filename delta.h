@@ -0,0 +1,91 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "database.h"
+
+
+// Deltas between two versions of the subscriber database, so that nodes can
+// apply the rows that changed instead of reloading everything. A delta file
+// is a header followed by fixed-size records, sorted by subscriber number:
+//
+//   header   "SUBDELTA", version, reserved, n_records (8 bytes)
+//   record   number, op, ttype, paid, reserved
+//
+// Unlike B+tree files, integers are in network byte order, since deltas are
+// meant to be shipped between machines.
+
+
+#define DELTA_MAGIC "SUBDELTA"
+#define DELTA_VERSION 1
+
+
+typedef enum {
+  DELTA_INSERT = 1, // New subscriber
+  DELTA_UPDATE = 2, // Tech type and/or paid status changed
+  DELTA_DELETE = 3, // Subscriber removed; ttype and paid are 0
+} delta_op;
+
+
+// On-disk/on-wire record
+typedef struct {
+  uint32_t number;
+  uint8_t op;
+  uint8_t ttype;
+  uint8_t paid;
+  uint8_t reserved;
+} delta_record;
+
+
+typedef struct {
+  char magic[8];        // DELTA_MAGIC, not null-terminated
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t n_records;
+} delta_header;
+
+
+// What a diff found
+typedef struct {
+  size_t n_old;         // Rows in the old image
+  size_t n_new;         // Rows in the new image
+  size_t n_inserts;
+  size_t n_updates;
+  size_t n_deletes;
+} delta_stats;
+
+
+// Callback for each record of a delta; returns false to stop
+typedef bool (*delta_fn)(delta_op op, client_info const* entry, void* ctx);
+
+
+// Encode a change into a record
+void delta_encode(delta_record* rec, delta_op op, client_info const* entry);
+
+
+// Decode a record
+// Return value: True if OK, false if the op is unknown
+bool delta_decode(delta_record const* rec, delta_op* op, client_info* entry);
+
+
+// Merge-join two database images and write the delta that turns the old one
+// into the new one. Each image is either a text database sorted by
+// subscriber number, or a B+tree file made by mkbtree; both are streamed
+// through a read-only mapping, so their size isn't limited by RAM.
+// Args:
+//   stats - Filled with counts if non-NULL
+// Return value: True if OK, false on I/O errors, malformed or unsorted input
+bool delta_diff(char const* old_filename, char const* new_filename,
+  char const* delta_filename, delta_stats* stats);
+
+
+// Read a delta file and hand each record to 'fn', in order
+// Return value: True if every record was read and accepted, false otherwise
+bool delta_apply(char const* delta_filename, delta_fn fn, void* ctx);
+
+
+#endif // DELTA_H
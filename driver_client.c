@@ -18,7 +18,7 @@ int main(int argc, char** argv) {
     fprintf(stderr, "Usage: %s [client_id]\n", argv[0]);
     exit(1);
   }
-  id = strtol(argv[1], NULL, 10);
+  id = strtoul(argv[1], NULL, 10);
 
 
   // Setup the client (configuration)
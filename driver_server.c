@@ -1,22 +1,163 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
 
 
 #include "shell.h"
 #include "server.h"
 
 
+// Helper; parse "a.b.c.d:port"
+static bool parse_host_port(char const* str, struct sockaddr_in* addr) {
+  char host[INET_ADDRSTRLEN];
+  char const* colon = strrchr(str, ':');
+
+
+  if (!colon || (size_t)(colon - str) >= sizeof(host)) {
+    return false;
+  }
+
+  memcpy(host, str, colon - str);
+  host[colon - str] = '\0';
+
+  memset(addr, 0, sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(strtoul(colon + 1, NULL, 10));
+
+
+  return inet_pton(AF_INET, host, &addr->sin_addr) == 1;
+}
+
+
 int main(int argc, char** argv) {
   server serv; // The unique server instance
+  server_config config; // Options from the command line
+  int opt; // Current option from getopt()
+  uint16_t port = DEFAULT_PORT; // Port to serve requests on
 
 
-  // Get the database filename
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s [database.txt]\n", argv[0]);
-    exit(1);
+  // Parse options
+  memset(&config, 0, sizeof(config));
+  while ((opt = getopt(argc, argv, "HGNSA:BC:TFO:D:p:P:R:K:k:W:Q:U:u:L:I:Y:X:r:s:b:yE:e:q:i:fM:")) != -1) {
+    switch (opt) {
+      case 'H':
+        config.db_flags |= DB_HUGEPAGES;
+        break;
+      case 'G':
+        config.db_flags |= DB_HUGEPAGES_1G;
+        break;
+      case 'N':
+        config.numa_local = true;
+        break;
+      case 'S':
+        config.shard_workers = true;
+        break;
+      case 'A':
+        config.max_parked = strtoul(optarg, NULL, 10);
+        break;
+      case 'B':
+        config.background_load = true;
+        break;
+      case 'C':
+        config.cache_entries = strtoul(optarg, NULL, 10);
+        break;
+      case 'T':
+        config.tech_index = true;
+        break;
+      case 'F':
+        config.follow = true;
+        break;
+      case 'O':
+        config.overlay_capacity = strtoul(optarg, NULL, 10);
+        break;
+      case 'D':
+        config.delta_file = optarg;
+        break;
+      case 'p':
+        port = strtoul(optarg, NULL, 10);
+        break;
+      case 'P':
+        config.repl_port = strtoul(optarg, NULL, 10);
+        break;
+      case 'R':
+        if (!parse_host_port(optarg, &config.primary_addr)) {
+          goto usage;
+        }
+        config.replica = true;
+        break;
+      case 'K':
+        config.ring_file = optarg;
+        break;
+      case 'k':
+        config.ring_self = strtoul(optarg, NULL, 10);
+        break;
+      case 'W':
+        config.watch_capacity = strtoul(optarg, NULL, 10);
+        break;
+      case 'Q':
+        config.seq_file = optarg;
+        break;
+      case 'U':
+        config.handoff_path = optarg;
+        break;
+      case 'u':
+        config.takeover_path = optarg;
+        break;
+      case 'L':
+        config.session_capacity = strtoul(optarg, NULL, 10);
+        break;
+      case 'I':
+        config.session_idle_sec = strtoul(optarg, NULL, 10);
+        break;
+      case 'Y':
+        config.ack_delay_us = strtoul(optarg, NULL, 10);
+        break;
+      case 'X':
+        config.reply_depth = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        config.client_rate = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        config.subnet_rate = strtoul(optarg, NULL, 10);
+        break;
+      case 'b':
+        config.rate_burst = strtoul(optarg, NULL, 10);
+        break;
+      case 'y':
+        config.rate_reply = true;
+        break;
+      case 'E':
+        config.deadline_ms = strtoul(optarg, NULL, 10);
+        break;
+      case 'e':
+        config.slow_delay_ms = strtoul(optarg, NULL, 10);
+        break;
+      case 'q':
+        config.slow_queue_pct = strtoul(optarg, NULL, 10);
+        break;
+      case 'i':
+        config.slow_interval_us = strtoul(optarg, NULL, 10);
+        break;
+      case 'f':
+        config.prefilter = true;
+        break;
+      case 'M':
+        config.n_workers = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        goto usage;
+    }
+  }
+
+
+  // Get the database filename; replicas get theirs from the primary
+  if (argc - optind != (config.replica ? 0 : 1)) {
+    goto usage;
   }
 
 
@@ -24,10 +165,11 @@ int main(int argc, char** argv) {
   struct sockaddr_in serv_addr;
   memset(&serv_addr, 0, sizeof(struct sockaddr_in));
   serv_addr.sin_family = AF_INET;
-  serv_addr.sin_port = htons(DEFAULT_PORT);
+  serv_addr.sin_port = htons(port);
   serv_addr.sin_addr.s_addr = INADDR_ANY;
   
-  if (!server_init(&serv, &serv_addr, argv[1])) {
+  if (!server_init(&serv, &serv_addr, config.replica ? NULL : argv[optind],
+        &config)) {
     fprintf(stderr, "Failed to initialize server! Exiting...\n");
     exit(1);
   }
@@ -37,5 +179,64 @@ int main(int argc, char** argv) {
   server_run(&serv);
 
 
-  return EXIT_SUCCESS;
+  return serv.load_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+
+usage:
+  fprintf(stderr, "Usage: %s [-H] [-G] [-N] [-S] [-A max_parked]\n"
+    "          [-B] [-C cache_entries] [-T] [-F] [-O overlay_rows]\n"
+    "          [-D delta_file] [-p port] [-P repl_port]\n"
+    "          [-K ring_file [-k node]] [-W subscriptions]\n"
+    "          [-Q seq_file] [-U handoff_sock] [-u takeover_sock]\n"
+    "          [-L sessions] [-I idle_sec] [-Y ack_delay_us]\n"
+    "          [-X replies] [-r client_rate] [-s subnet_rate] [-b burst]\n"
+    "          [-y] [-E deadline_ms] [-e slow_delay_ms] [-q slow_queue_pct]\n"
+    "          [-i slow_interval_us] [-f] [-M workers]\n"
+    "          [-R primary_ip:repl_port | database.txt]\n"
+    "  -H  Back the database with 2MB huge pages\n"
+    "  -G  Try 1GB huge pages first\n"
+    "  -N  Replicate the database onto the local NUMA node\n"
+    "  -S  Give each worker (-M) a key-range shard of the database, and\n"
+    "      send each request to the worker whose shard has its subscriber\n"
+    "  -A  Max B+tree lookups waiting on disk before lookups block\n"
+    "  -B  Serve right away while the database loads in the background\n"
+    "  -C  Keep a front cache of this many verdicts\n"
+    "  -T  Answer requests from per-tech bitmaps\n"
+    "  -F  Apply rows appended to the database file as they're written\n"
+    "  -O  Max rows changed after load (appended and delta rows count)\n"
+    "  -D  Apply this delta (see dbdiff) on SIGHUP\n"
+    "  -p  Serve requests on this UDP port\n"
+    "  -P  Stream the database and its changes to replicas on this TCP port\n"
+    "  -R  Be a replica of this primary instead of loading a file\n"
+    "  -K  Be a node of this cluster ring: serve our partition, forward the\n"
+    "      rest\n"
+    "  -k  Our node in the ring, counting from 1 (default: the one on our\n"
+    "      port)\n"
+    "  -W  Push invalidations to up to this many client subscriptions\n"
+    "  -Q  Keep client sequence numbers in this file across restarts\n"
+    "  -U  Hand off to a new server that connects to this Unix socket\n"
+    "  -u  Take over from the server handing off on this Unix socket\n"
+    "  -L  Track up to this many clients with wide (32-bit) IDs (default %d)\n"
+    "  -I  Forget a wide client after this many idle seconds (default %d)\n"
+    "  -Y  Acknowledge requests cumulatively, after up to this many\n"
+    "      microseconds (max %d) or %d requests\n"
+    "  -X  Keep this many verdicts per client, to answer retransmits with\n"
+    "  -r  Max requests a second from each client\n"
+    "  -s  Max requests a second from each /%d subnet\n"
+    "  -b  Requests over those rates let through at once (default %d)\n"
+    "  -y  Tell clients sending over the rate to back off and resend (BUSY)\n"
+    "      instead of dropping their requests\n"
+    "  -E  Drop requests that waited on the socket longer than this many\n"
+    "      milliseconds\n"
+    "  -e  Tell clients to slow down while requests wait on the socket\n"
+    "      longer than this many milliseconds...\n"
+    "  -q  ...or while its receive buffer is fuller than this, in percent\n"
+    "  -i  Microseconds between requests to ask for at first (default %d),\n"
+    "      doubling while overload lasts\n"
+    "  -f  Drop malformed packets in the kernel, with a socket filter\n"
+    "  -M  Split clients by ID over this many worker processes (max %d)\n",
+    argv[0], DEFAULT_SESSION_CAPACITY, DEFAULT_SESSION_IDLE_SEC,
+    ACK_MAX_DELAY_US, ACK_BATCH, RATE_SUBNET_PREFIX, DEFAULT_RATE_BURST,
+    DEFAULT_SLOW_INTERVAL_US, REUSEPORT_MAX_WORKERS);
+  exit(1);
 }
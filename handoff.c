@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+
+// Helper; fill in a Unix socket address
+static bool unix_addr(char const* path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "handoff: Socket path too long: %s\n", path);
+    return false;
+  }
+
+  strcpy(addr->sun_path, path);
+
+
+  return true;
+}
+
+
+int handoff_listen(char const* path) {
+  struct sockaddr_un addr;
+  int fd;
+
+
+  if (!unix_addr(path, &addr)) {
+    return -1;
+  }
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+    perror("handoff_listen: Couldn't create socket");
+    return -1;
+  }
+
+  unlink(path); // Left behind by an earlier server, if anything
+
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+      || listen(fd, 1) == -1) {
+    perror("handoff_listen: Couldn't listen");
+    close(fd);
+    return -1;
+  }
+
+
+  return fd;
+}
+
+
+bool handoff_send(int conn, handoff_header const* hdr, int const* fds,
+  size_t n_fds, void const* body) {
+  union {                  // Aligned room for the descriptors
+    char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = (void*)hdr, .iov_len = sizeof(*hdr) };
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  size_t sent = 0;
+  ssize_t n;
+
+
+  // Header and descriptors in one message, so they arrive together
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+
+  if (sendmsg(conn, &msg, MSG_NOSIGNAL) != sizeof(*hdr)) {
+    perror("handoff_send: Couldn't send descriptors");
+    return false;
+  }
+
+
+  // The body; the connection may be nonblocking, so wait it out
+  fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) & ~O_NONBLOCK);
+
+  while (sent < hdr->body_len) {
+    if ((n = send(conn, (char const*)body + sent, hdr->body_len - sent,
+          MSG_NOSIGNAL)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("handoff_send: Couldn't send state");
+      return false;
+    }
+    sent += n;
+  }
+
+
+  return true;
+}
+
+
+bool handoff_receive(char const* path, handoff_header* hdr, int* fds,
+  size_t* n_fds, void** body) {
+  union {
+    char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(*hdr) };
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  size_t got = 0;
+  ssize_t n;
+  int fd;
+
+
+  *body = NULL;
+  *n_fds = 0;
+
+  if (!unix_addr(path, &addr)) {
+    return false;
+  }
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+      || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    perror("handoff_receive: Couldn't reach the running server");
+    goto fail;
+  }
+
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != sizeof(*hdr)
+      || hdr->magic != HANDOFF_MAGIC || hdr->version != HANDOFF_VERSION) {
+    fprintf(stderr, "handoff_receive: Bad handoff header\n");
+    goto fail;
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      *n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(cmsg), *n_fds * sizeof(int));
+    }
+  }
+
+  if (*n_fds == 0 || (msg.msg_flags & MSG_CTRUNC)) {
+    fprintf(stderr, "handoff_receive: Descriptors missing\n");
+    goto fail;
+  }
+
+
+  if ((*body = malloc(hdr->body_len > 0 ? hdr->body_len : 1)) == NULL) {
+    fprintf(stderr, "handoff_receive: Out of memory!\n");
+    goto fail;
+  }
+
+  while (got < hdr->body_len) {
+    if ((n = recv(fd, (char*)*body + got, hdr->body_len - got, 0)) <= 0) {
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "handoff_receive: State cut short\n");
+      goto fail;
+    }
+    got += n;
+  }
+
+  close(fd);
+
+
+  return true;
+
+
+fail:
+  for (size_t i = 0; i < *n_fds; ++i) {
+    close(fds[i]);
+  }
+  *n_fds = 0;
+  free(*body);
+  *body = NULL;
+  if (fd != -1) {
+    close(fd);
+  }
+  return false;
+}
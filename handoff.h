@@ -0,0 +1,63 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// Handing a running server's state to its replacement, for upgrades that
+// drop no packets. The old server listens on a Unix socket; the new one
+// connects and receives, in one message, a header and the old server's
+// file descriptors (SCM_RIGHTS): the bound UDP socket, a memory file holding
+// the database, and the replication listener. A body follows on the stream:
+// the per-client receive windows, then the rows changed since load, as delta
+// records. Packets arriving in between just queue on the shared UDP socket.
+
+
+#define HANDOFF_MAGIC 0x48414E44 // "HAND"
+#define HANDOFF_VERSION 3
+#define HANDOFF_MAX_FDS 3
+
+
+// Which descriptors were sent; the UDP socket always is, first
+#define HANDOFF_HAS_DB   0x1 // Memory file with the database (database_export())
+#define HANDOFF_HAS_REPL 0x2 // Listening socket for replicas
+
+
+typedef struct {
+  uint32_t magic;          // HANDOFF_MAGIC
+  uint32_t version;        // HANDOFF_VERSION
+  uint32_t flags;          // HANDOFF_HAS_*
+  uint32_t n_clients;      // Receive windows (seq_slot) in the body...
+  uint32_t n_overlay;      // ...followed by this many delta records
+  uint32_t reserved;
+  uint64_t body_len;       // Bytes of body
+  uint64_t tail_offset;    // Where a followed database's next row starts;
+                           // 0 if not following
+} handoff_header;
+
+
+// Listen for a replacement on a Unix socket, replacing a stale one
+// Return value: The listening socket (nonblocking), or -1 on failure
+int handoff_listen(char const* path);
+
+
+// Send the header and descriptors, then the body (hdr->body_len bytes), on
+// an accepted connection
+// Return value: True if everything was sent, false otherwise
+bool handoff_send(int conn, handoff_header const* hdr, int const* fds,
+  size_t n_fds, void const* body);
+
+
+// Connect to a running server and receive its state
+// Args:
+//   fds - Filled with the descriptors, HANDOFF_MAX_FDS of room
+//   body - Set to a malloc()ed buffer with the body; the caller frees it
+// Return value: True if OK, false otherwise
+bool handoff_receive(char const* path, handoff_header* hdr, int* fds,
+  size_t* n_fds, void** body);
+
+
+#endif // HANDOFF_H
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "hashring.h"
+
+
+// Helper; splitmix64 finalizer, so nearby keys land far apart
+static uint64_t mix(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+
+
+  return x ^ (x >> 31);
+}
+
+
+// Helper; for use with qsort()
+static int compare_points(void const* a, void const* b) {
+  uint64_t x = ((ring_point const*)a)->hash;
+  uint64_t y = ((ring_point const*)b)->hash;
+
+  return (x > y) - (x < y);
+}
+
+
+bool hash_ring_load(hash_ring* ring, char const* filename) {
+  FILE* fp = fopen(filename, "r");
+  char line[128];
+  size_t line_no = 0;
+  size_t total_weight = 0;
+
+
+  memset(ring, 0, sizeof(hash_ring));
+
+  if (!fp) {
+    perror("hash_ring_load: Couldn't open ring file");
+    return false;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    char ip_str[INET_ADDRSTRLEN];
+    unsigned port, weight = 1;
+    int n_fields;
+    ring_node* node;
+
+    ++line_no;
+
+    if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') {
+      continue;
+    }
+
+    if (ring->n_nodes == RING_MAX_NODES) {
+      fprintf(stderr, "hash_ring_load: More than %d nodes!\n",
+        RING_MAX_NODES);
+      goto fail;
+    }
+
+    node = &ring->nodes[ring->n_nodes];
+    n_fields = sscanf(line, "%15[0-9.]:%u %u", ip_str, &port, &weight);
+
+    if (n_fields < 2 || port == 0 || port > 0xFFFF || weight == 0
+        || inet_pton(AF_INET, ip_str, &node->addr.sin_addr) != 1) {
+      fprintf(stderr, "hash_ring_load: %s:%lu: Bad node\n", filename,
+        line_no);
+      goto fail;
+    }
+
+    node->addr.sin_family = AF_INET;
+    node->addr.sin_port = htons(port);
+    node->weight = weight;
+    total_weight += weight;
+    ++ring->n_nodes;
+  }
+
+  fclose(fp);
+  fp = NULL;
+
+  if (ring->n_nodes == 0) {
+    fprintf(stderr, "hash_ring_load: %s lists no nodes\n", filename);
+    goto fail;
+  }
+
+
+  // Points; a node's are derived from its address, so every process
+  // computes the same ring
+  if ((ring->points = malloc(total_weight * RING_VNODES * sizeof(ring_point)))
+      == NULL) {
+    fprintf(stderr, "hash_ring_load: Out of memory!\n");
+    goto fail;
+  }
+
+  for (size_t i = 0; i < ring->n_nodes; ++i) {
+    uint64_t id = ((uint64_t)ntohl(ring->nodes[i].addr.sin_addr.s_addr) << 16)
+      | ntohs(ring->nodes[i].addr.sin_port);
+
+    for (size_t v = 0; v < ring->nodes[i].weight * RING_VNODES; ++v) {
+      ring->points[ring->n_points].hash = mix(mix(id) + v);
+      ring->points[ring->n_points].node = i;
+      ++ring->n_points;
+    }
+  }
+
+  qsort(ring->points, ring->n_points, sizeof(ring_point), &compare_points);
+
+
+  return true;
+
+
+fail:
+  if (fp) {
+    fclose(fp);
+  }
+  hash_ring_destroy(ring);
+  return false;
+}
+
+
+void hash_ring_destroy(hash_ring* ring) {
+  free(ring->points);
+  ring->points = NULL;
+  ring->n_points = ring->n_nodes = 0;
+}
+
+
+size_t hash_ring_owner(hash_ring const* ring, subscriber_num num) {
+  uint64_t h = mix(num);
+  size_t lo = 0, hi = ring->n_points;
+
+
+  // First point at or after the key's hash, wrapping around
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (ring->points[mid].hash < h) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+
+  return ring->points[lo == ring->n_points ? 0 : lo].node;
+}
+
+
+int hash_ring_find_port(hash_ring const* ring, uint16_t port) {
+  for (size_t i = 0; i < ring->n_nodes; ++i) {
+    if (ntohs(ring->nodes[i].addr.sin_port) == port) {
+      return (int)i;
+    }
+  }
+
+
+  return -1;
+}
+
+
+int hash_ring_find(hash_ring const* ring, struct sockaddr_in const* addr) {
+  for (size_t i = 0; i < ring->n_nodes; ++i) {
+    if (ring->nodes[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr
+        && ring->nodes[i].addr.sin_port == addr->sin_port) {
+      return (int)i;
+    }
+  }
+
+
+  return -1;
+}
@@ -0,0 +1,71 @@
+#ifndef HASHRING_H
+#define HASHRING_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/ip.h>
+
+#include "database.h"
+
+
+// Consistent-hash ring over the validation servers of a cluster. Each node
+// owns the arcs of the ring that end at its points, and a subscriber number
+// belongs to the first point at or after its hash, so adding or removing a
+// node only moves the keys next to that node's points. Servers and clients
+// load the same ring file and so agree on owners without talking.
+//
+// Ring files list one node per line, "a.b.c.d:port [weight]"; blank lines
+// and lines starting with '#' are ignored. A node gets RING_VNODES points
+// per unit of weight (default 1).
+
+
+#define RING_MAX_NODES 64
+#define RING_VNODES 160
+
+
+typedef struct {
+  struct sockaddr_in addr; // Where the node serves requests
+  unsigned weight;
+} ring_node;
+
+
+typedef struct {
+  uint64_t hash;
+  uint32_t node;           // Index into nodes
+} ring_point;
+
+
+typedef struct {
+  ring_node nodes[RING_MAX_NODES];
+  size_t n_nodes;
+  ring_point* points;      // Sorted by hash
+  size_t n_points;
+} hash_ring;
+
+
+// Load a ring file
+// Return value: True if OK, false on I/O errors or a malformed file
+bool hash_ring_load(hash_ring* ring, char const* filename);
+
+
+// Free a ring
+void hash_ring_destroy(hash_ring* ring);
+
+
+// Get the index of the node that owns a subscriber number
+size_t hash_ring_owner(hash_ring const* ring, subscriber_num num);
+
+
+// Find a node by port, for servers that don't know their own index
+// Return value: The first node with that port, or -1 if there's none
+int hash_ring_find_port(hash_ring const* ring, uint16_t port);
+
+
+// Find a node by address, e.g. to tell whether a packet came from one
+// Return value: The node's index, or -1 if there's none at that address
+int hash_ring_find(hash_ring const* ring, struct sockaddr_in const* addr);
+
+
+#endif // HASHRING_H
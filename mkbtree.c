@@ -0,0 +1,21 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "btree.h"
+
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s [db_file.txt] [db_file.btree]\n", argv[0]);
+    return 1;
+  }
+
+
+  if (!btree_build(argv[1], argv[2])) {
+    fprintf(stderr, "%s: Couldn't build %s\n", argv[0], argv[2]);
+    return 1;
+  }
+
+
+  return EXIT_SUCCESS;
+}
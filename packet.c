@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <endian.h>
 #include <arpa/inet.h>
 
 #include "packet.h"
@@ -17,6 +18,7 @@
 
 const unsigned MAX_IOVEC_LEN = 8;
 const uint16_t PACKET_START = 0xFFFF;
+const uint16_t PACKET_START_WIDE = 0xFFFE;
 const uint16_t PACKET_END = 0xFFFF;
 
 
@@ -25,23 +27,34 @@ size_t flatten(packet_info const* pi, void* buf, size_t size) {
   rit_init(&rit, (uint8_t*)buf, size);
   size_t flattened_size = 0; // Size of the flattened packet in the buffer
   uint16_t network_short; // For converting shorts to network order
+  uint32_t network_long;  // Ditto, longs
+  uint8_t narrow_id;      // Client ID as sent in the original format
+  uint64_t network_sack;  // CUM_ACK bitmap, in network order
+  bool wide = pi->id >= NARROW_CLIENT_IDS;
   
 
   // Add common field sizes to the total packet size
   flattened_size +=
     sizeof(PACKET_START) +
-    sizeof(client_id) +
+    (wide ? sizeof(uint32_t) : sizeof(uint8_t)) + // Client ID on the wire
     sizeof(uint16_t) +  // Size of packet_type on the wire
     sizeof(PACKET_END);
 
 
 
-  // Header
-  rit_write(&rit, sizeof(PACKET_START), &PACKET_START);
-  
-  
-  // Client ID
-  rit_write(&rit, sizeof(client_id), &pi->id);
+  // Header, and client ID
+  if (wide) {
+    network_short = htons(PACKET_START_WIDE);
+    rit_write(&rit, sizeof(uint16_t), &network_short);
+
+    network_long = htonl(pi->id);
+    rit_write(&rit, sizeof(uint32_t), &network_long);
+  } else {
+    rit_write(&rit, sizeof(PACKET_START), &PACKET_START);
+
+    narrow_id = pi->id;
+    rit_write(&rit, sizeof(uint8_t), &narrow_id);
+  }
 
 
   // Packet type
@@ -57,6 +70,11 @@ size_t flatten(packet_info const* pi, void* buf, size_t size) {
     case NOT_PAID:
     case NOT_EXIST:
     case ACC_OK:
+    case TRY_LATER:
+    case BUSY:
+    case FWD:
+    case SUBSCRIBE:
+    case INVALIDATE:
       // Sequence number
       rit_write(&rit, sizeof(sequence_num), &pi->cont.data_info.seq_num);
 
@@ -78,6 +96,24 @@ size_t flatten(packet_info const* pi, void* buf, size_t size) {
 
       flattened_size += sizeof(sequence_num);
 
+      break;
+    case CUM_ACK:
+      // Cumulative point, then the selective bitmap
+      rit_write(&rit, sizeof(sequence_num), &pi->cont.cum_ack_info.next);
+
+      network_sack = htobe64(pi->cont.cum_ack_info.sack);
+      rit_write(&rit, sizeof(uint64_t), &network_sack);
+
+      flattened_size += sizeof(sequence_num) + sizeof(uint64_t);
+
+      break;
+    case SLOW_DOWN:
+      // Suggested pace
+      network_long = htonl(pi->cont.slow_down_info.interval_us);
+      rit_write(&rit, sizeof(uint32_t), &network_long);
+
+      flattened_size += sizeof(uint32_t);
+
       break;
     case REJECT:
       // Reject code
@@ -111,6 +147,9 @@ int interpret_packet(void const* buf, packet_info* pi, size_t size) {
   raw_iterator rit; // Raw iterator for reading buffer
   rit_init(&rit, (uint8_t*)buf, size); // XXX: no constness is OK; read only
   uint16_t network_short; // For reading shorts
+  uint32_t network_long;  // Ditto, longs
+  uint8_t narrow_id;      // Client ID in the original format
+  uint64_t network_sack;  // CUM_ACK bitmap, in network order
 
 
   // FIXME: remove
@@ -125,10 +164,16 @@ int interpret_packet(void const* buf, packet_info* pi, size_t size) {
 
 
 
-  // Check header
-  // XXX: no network to host conversion needed in this case
+  // Check header, and read client ID; its width depends on the header
+  // XXX: no network to host conversion needed for PACKET_START
   rit_read(&rit, sizeof(uint16_t), &network_short);
-  if (network_short != PACKET_START) {
+  if (network_short == PACKET_START) {
+    rit_read(&rit, sizeof(uint8_t), &narrow_id);
+    pi->id = narrow_id;
+  } else if (ntohs(network_short) == PACKET_START_WIDE) {
+    rit_read(&rit, sizeof(uint32_t), &network_long);
+    pi->id = ntohl(network_long);
+  } else {
     fprintf(stderr, "interpret_packet: Bad PACKET_START!\n");
     
     // XXX: I overloaded NO_END; see packet.h
@@ -136,10 +181,6 @@ int interpret_packet(void const* buf, packet_info* pi, size_t size) {
   }
 
 
-  // Read client ID
-  rit_read(&rit, sizeof(client_id), &pi->id);
-
-
   // Read packet type
   rit_read(&rit, sizeof(uint16_t), &network_short);
   pi->type = (packet_type)ntohs(network_short);
@@ -152,6 +193,11 @@ int interpret_packet(void const* buf, packet_info* pi, size_t size) {
     case NOT_PAID:
     case NOT_EXIST:
     case ACC_OK:
+    case TRY_LATER:
+    case BUSY:
+    case FWD:
+    case SUBSCRIBE:
+    case INVALIDATE:
       // Sequence number
       rit_read(&rit, sizeof(sequence_num), &pi->cont.data_info.seq_num);
 
@@ -170,6 +216,22 @@ int interpret_packet(void const* buf, packet_info* pi, size_t size) {
       
       break;
 
+    case CUM_ACK:
+      // Cumulative point, then the selective bitmap
+      rit_read(&rit, sizeof(sequence_num), &pi->cont.cum_ack_info.next);
+
+      rit_read(&rit, sizeof(uint64_t), &network_sack);
+      pi->cont.cum_ack_info.sack = be64toh(network_sack);
+
+      break;
+
+    case SLOW_DOWN:
+      // Suggested pace
+      rit_read(&rit, sizeof(uint32_t), &network_long);
+      pi->cont.slow_down_info.interval_us = ntohl(network_long);
+
+      break;
+
     case REJECT:
       // Reject code
       rit_read(&rit, sizeof(uint16_t), &network_short);
@@ -221,7 +283,7 @@ bool try_recv(void* args, void* retval) {
 
 void alert_reject(packet_info const* pi, reject_code code) {
     // Print out errors server-side
-    fprintf(stderr, " From client %d: ", pi->id);
+    fprintf(stderr, " From client %u: ", pi->id);
     switch (code) {
       case NO_END:
         fprintf(stderr, "No packet terminator\n");
@@ -254,6 +316,12 @@ void alert_reply(packet_info const* pi) {
     case ACC_OK:
       fprintf(stderr, "alert_reply: Access granted!\n");
       break;
+    case TRY_LATER:
+      fprintf(stderr, "alert_reply: Server is still loading; try later!\n");
+      break;
+    case BUSY:
+      fprintf(stderr, "alert_reply: Server is busy; backing off!\n");
+      break;
     default:
       fprintf(stderr, "alert_reply: Bad reply type!\n");
   }
@@ -31,22 +31,55 @@ DECL_STRUCT_ARGS(recv,
 
 
 extern const uint16_t PACKET_START; // Start of packet identifier
+extern const uint16_t PACKET_START_WIDE; // Same, for a wide client ID
 extern const uint16_t PACKET_END;   // End of packet identifier
 
 
-typedef uint8_t client_id;    // [0,255]
+typedef uint32_t client_id;   // [0,2^32-1]; see NARROW_CLIENT_IDS
 typedef uint8_t payload_len;  // [0,255]
 typedef uint8_t sequence_num; // [0,255]
 
 
+// Client IDs below this go on the wire in one byte, as they always have.
+// Larger ones make flatten() send the wide variant of every packet type,
+// which starts with PACKET_START_WIDE and carries the ID in four bytes
+// (network order); interpret_packet() reads either.
+#define NARROW_CLIENT_IDS 256
+
+
+// A SLOW_DOWN asks a client to leave at least 'interval_us' between
+// requests; it keeps to that pace until this long after the last one.
+#define SLOW_DOWN_HOLD_MS 1000
+
+
+// SUBSCRIBE and INVALIDATE payloads are lists of subscriber numbers, in
+// network order. A subscription lasts this long unless renewed.
+#define SUBSCRIBE_MAX_NUMS 63
+#define SUBSCRIBE_LEASE_SEC 60
+
+
 typedef enum {     // This packet communicates...
   DATA      = 0xFFF1, // data
   ACK       = 0xFFF2, // acknowledgement
   REJECT    = 0xFFF3, // rejection
+  SLOW_DOWN = 0xFFF7, // Pushed by an overloaded server: a pace to send
+                      // requests at. Not sequenced or ACKed
+  CUM_ACK   = 0xFFF6, // Acknowledgement of every sequence number before
+                      // 'next', and of those after it in the 'sack' bitmap;
+                      // sent instead of ACKs by servers that delay them
+  SUBSCRIBE = 0xFFF4, // Interest in the listed subscriber numbers' rows;
+                      // echoed back with the ones the server took
+  INVALIDATE = 0xFFF5, // Pushed by the server: the listed subscribers'
+                      // verdicts may have changed. Not sequenced or ACKed
   ACC_PER   = 0xFFF8, // Request access
   NOT_PAID  = 0xFFF9, // Subscriber has not paid for req'd service
   NOT_EXIST = 0xFFFA, // Subscriber not found in database
   ACC_OK    = 0xFFFB, // Subscriber is cleared for access
+  TRY_LATER = 0xFFFC, // Server is still loading its database; retry later
+  BUSY      = 0xFFF0, // Server can't take the request now; its sequence
+                      // number is left free, so back off and send it again
+  FWD       = 0xFFFD, // Access request forwarded to the node that owns the
+                      // subscriber; see server_forward()
 } packet_type;
 
 
@@ -81,6 +114,15 @@ typedef union {
     reject_code code;
     sequence_num recvd_seq_num;
   } reject_info; 
+
+  struct {
+    sequence_num next; // Oldest sequence number not yet received
+    uint64_t sack;     // Bit i set: next + i was received
+  } cum_ack_info;
+
+  struct {
+    uint32_t interval_us; // Least time to leave between requests
+  } slow_down_info;
 } content;
 
 
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#include <netinet/udp.h>
+
+#include "prefilter.h"
+#include "packet.h"
+
+
+// Offsets into the datagram; a UDP socket's filter sees the UDP header first
+#define UDP (sizeof(struct udphdr))
+#define NARROW_TYPE (UDP + 3)       // After PACKET_START and a 1-byte ID
+#define WIDE_TYPE (UDP + 6)         // After PACKET_START_WIDE and a 4-byte ID
+#define LEN_AFTER_TYPE 3            // Type, then sequence number, then length
+#define HEADER_AFTER_TYPE 4         // Type, sequence number and length
+#define END_LEN 2                   // PACKET_END
+
+
+bool prefilter_attach(int fd) {
+  // Jumps are relative to the next instruction; the comments give targets
+  struct sock_filter code[] = {
+    /*  0 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, UDP),
+    /*  1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_START, 0, 7), // 2, 9
+
+    // Narrow header
+    /*  2 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, NARROW_TYPE),
+    /*  3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ACC_PER, 2, 0),   // 6, 4
+    /*  4 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, FWD, 1, 0),       // 6, 5
+    /*  5 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SUBSCRIBE, 0, 18), // 6, 24
+    /*  6 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, NARROW_TYPE + LEN_AFTER_TYPE),
+    /*  7 */ BPF_STMT(BPF_ALU | BPF_ADD | BPF_K,
+               NARROW_TYPE + HEADER_AFTER_TYPE + END_LEN),
+    /*  8 */ BPF_STMT(BPF_JMP | BPF_JA, 7),                        // 16
+
+    // Wide header
+    /*  9 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_START_WIDE, 0, 14),
+                                                                   // 10, 24
+    /* 10 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, WIDE_TYPE),
+    /* 11 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ACC_PER, 2, 0),   // 14, 12
+    /* 12 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, FWD, 1, 0),       // 14, 13
+    /* 13 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SUBSCRIBE, 0, 10), // 14, 24
+    /* 14 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, WIDE_TYPE + LEN_AFTER_TYPE),
+    /* 15 */ BPF_STMT(BPF_ALU | BPF_ADD | BPF_K,
+               WIDE_TYPE + HEADER_AFTER_TYPE + END_LEN),
+
+    // The datagram must end right after the payload, with PACKET_END
+    /* 16 */ BPF_STMT(BPF_MISC | BPF_TAX, 0),
+    /* 17 */ BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+    /* 18 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_X, 0, 0, 5),         // 19, 24
+    /* 19 */ BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, END_LEN),
+    /* 20 */ BPF_STMT(BPF_MISC | BPF_TAX, 0),
+    /* 21 */ BPF_STMT(BPF_LD | BPF_H | BPF_IND, 0),
+    /* 22 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_END, 0, 1), // 23, 24
+
+    /* 23 */ BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF), // Keep all of it
+    /* 24 */ BPF_STMT(BPF_RET | BPF_K, 0),          // Drop
+  };
+  struct sock_fprog prog = {
+    .len = sizeof(code) / sizeof(code[0]),
+    .filter = code,
+  };
+
+
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))
+      == -1) {
+    perror("prefilter_attach: Couldn't attach filter");
+    return false;
+  }
+
+
+  return true;
+}
+
+
+uint32_t prefilter_socket_drops(int fd) {
+  uint32_t meminfo[SK_MEMINFO_VARS];
+  socklen_t len = sizeof(meminfo);
+
+
+  if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == -1
+      || len <= SK_MEMINFO_DROPS * sizeof(uint32_t)) {
+    return 0;
+  }
+
+
+  return meminfo[SK_MEMINFO_DROPS];
+}
@@ -0,0 +1,29 @@
+#ifndef PREFILTER_H
+#define PREFILTER_H
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// A classic BPF socket filter that drops packets the server would reject
+// anyway, in the kernel, before they cost a wakeup and a copy: a bad
+// PACKET_START (narrow or wide), a type other than ACC_PER, FWD or
+// SUBSCRIBE, a length field that doesn't match the datagram's size, or a
+// bad PACKET_END. server_check_packet() still checks everything; the filter
+// only saves it the work. Classic BPF can't count, so what it drops shows
+// up only in the socket's drop count, along with packets dropped because
+// the receive buffer was full.
+
+
+// Attach the filter to a UDP socket, replacing any filter on it
+// Return value: True if OK, false otherwise
+bool prefilter_attach(int fd);
+
+
+// Return value: Packets the socket has dropped, filtered out or not
+// (SO_MEMINFO), or 0 if that's not known
+uint32_t prefilter_socket_drops(int fd);
+
+
+#endif // PREFILTER_H
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "ratelimit.h"
+
+
+// Helper; monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Helper; take a token from a bucket full again at '*full_ns', unless that
+// would leave it owing more than 'burst' tokens
+static bool take_token(uint64_t* full_ns, uint64_t interval_ns,
+  unsigned burst) {
+  uint64_t now = now_ns();
+  uint64_t full = (*full_ns > now ? *full_ns : now) + interval_ns;
+
+
+  if (full - now > burst * interval_ns) {
+    return false;
+  }
+
+  *full_ns = full;
+
+
+  return true;
+}
+
+
+bool rate_limit_init(rate_limit* r, size_t n_clients, unsigned client_rate,
+  unsigned subnet_rate, unsigned burst) {
+  memset(r, 0, sizeof(rate_limit));
+
+  r->burst = burst ? burst : DEFAULT_RATE_BURST;
+
+  if (client_rate > 0) {
+    if ((r->clients = calloc(n_clients, sizeof(uint64_t))) == NULL) {
+      goto fail;
+    }
+    r->n_clients = n_clients;
+    r->client_interval_ns = 1000000000ULL / client_rate;
+  }
+
+  if (subnet_rate > 0) {
+    if ((r->subnets = calloc(RATE_SUBNET_BUCKETS, sizeof(subnet_bucket)))
+        == NULL) {
+      goto fail;
+    }
+    r->subnet_interval_ns = 1000000000ULL / subnet_rate;
+  }
+
+
+  return true;
+
+
+fail:
+  fprintf(stderr, "rate_limit_init: Out of memory!\n");
+  rate_limit_destroy(r);
+  return false;
+}
+
+
+void rate_limit_destroy(rate_limit* r) {
+  free(r->clients);
+  free(r->subnets);
+  memset(r, 0, sizeof(rate_limit));
+}
+
+
+bool rate_limit_subnet(rate_limit* r, in_addr_t ip) {
+  uint32_t subnet = ntohl(ip) >> (32 - RATE_SUBNET_PREFIX);
+  subnet_bucket* b;
+
+
+  if (!r->subnets) {
+    return true;
+  }
+
+  // Fibonacci hashing spreads neighbouring subnets over the table
+  b = &r->subnets[(subnet * 2654435761U) >> 20 & (RATE_SUBNET_BUCKETS - 1)];
+  if (b->subnet != subnet) {
+    b->subnet = subnet;
+    b->full_ns = 0;
+  }
+
+  if (!take_token(&b->full_ns, r->subnet_interval_ns, r->burst)) {
+    ++r->n_subnet_throttled;
+    return false;
+  }
+
+
+  return true;
+}
+
+
+bool rate_limit_client(rate_limit* r, size_t client) {
+  if (!r->clients || client >= r->n_clients) {
+    return true;
+  }
+
+  if (!take_token(&r->clients[client], r->client_interval_ns, r->burst)) {
+    ++r->n_client_throttled;
+    return false;
+  }
+
+
+  return true;
+}
+
+
+void rate_limit_forget(rate_limit* r, size_t client) {
+  if (r->clients && client < r->n_clients) {
+    r->clients[client] = 0;
+  }
+}
+
+
+void rate_limit_dump_stats(rate_limit const* r) {
+  fprintf(stderr, "rate_limit: %lu requests throttled per client (%s), "
+    "%lu per /%d subnet (%s), burst %u\n", r->n_client_throttled,
+    r->clients ? "limited" : "unlimited", r->n_subnet_throttled,
+    RATE_SUBNET_PREFIX, r->subnets ? "limited" : "unlimited", r->burst);
+}
@@ -0,0 +1,81 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/ip.h>
+
+
+// Token buckets that keep any one client, or any one source subnet, from
+// taking more than its share of the server, e.g. a gateway retrying in a
+// tight loop. A bucket holds up to 'burst' tokens and refills at 'rate' a
+// second; each request takes one, and a request that finds its bucket empty
+// is throttled before anything is looked up for it.
+//
+// A bucket is kept as a single time: when it will be full again (a token
+// bucket in GCRA form), so there's no refilling to do. Clients are numbered
+// as in the reply cache (replycache.h): narrow IDs by ID, wide ones after
+// them by session. Subnets share a direct-mapped table of buckets; one that
+// lands on a bucket another subnet holds takes it over, full. Not
+// thread-safe.
+
+
+#define RATE_SUBNET_PREFIX 24     // Bits of the source address that make a
+                                  // subnet
+#define RATE_SUBNET_BUCKETS 4096  // Power of 2
+#define DEFAULT_RATE_BURST 64     // Enough for a full pipelining window
+
+
+typedef struct {
+  uint32_t subnet;                // Host order; 0 in an unused bucket
+  uint64_t full_ns;               // When the bucket is full again
+} subnet_bucket;
+
+
+typedef struct {
+  uint64_t* clients;              // Per client: when its bucket is full
+  size_t n_clients;               // again; NULL if clients aren't limited
+  subnet_bucket* subnets;         // NULL if subnets aren't limited
+  uint64_t client_interval_ns;    // Time to earn a token, per client...
+  uint64_t subnet_interval_ns;    // ...and per subnet
+  unsigned burst;
+  size_t n_client_throttled;      // Statistics: requests throttled per
+  size_t n_subnet_throttled;      // client and per subnet
+} rate_limit;
+
+
+// Set up buckets for 'n_clients' clients and for subnets
+// Args:
+//   client_rate - Requests a second per client (0 = no limit)
+//   subnet_rate - Requests a second per subnet (0 = no limit)
+//   burst - Requests over the rate taken at once (0 = DEFAULT_RATE_BURST)
+// Return value: True if OK, false if allocation failed
+bool rate_limit_init(rate_limit* r, size_t n_clients, unsigned client_rate,
+  unsigned subnet_rate, unsigned burst);
+
+
+// Free the buckets
+void rate_limit_destroy(rate_limit* r);
+
+
+// Take a token for a request from a source address (network order)
+// Return value: True if the subnet's within its rate, false if throttled
+bool rate_limit_subnet(rate_limit* r, in_addr_t ip);
+
+
+// Take a token for a request from a client
+// Return value: True if the client's within its rate, false if throttled
+bool rate_limit_client(rate_limit* r, size_t client);
+
+
+// Fill a client's bucket, e.g. for a new client taking over its number
+void rate_limit_forget(rate_limit* r, size_t client);
+
+
+// Print statistics
+void rate_limit_dump_stats(rate_limit const* r);
+
+
+#endif // RATELIMIT_H
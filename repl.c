@@ -0,0 +1,744 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "repl.h"
+
+
+#define RECONNECT_NS 1000000000ULL // Between attempts to reach the primary
+
+
+// Helper; wall-clock time in ns, comparable across processes
+static uint64_t realtime_ns(void) {
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Helper; fill in a message
+static void repl_encode(repl_msg* msg, repl_msg_type type, uint32_t epoch,
+  uint64_t seq, uint64_t sent_ns, delta_op op, client_info const* entry) {
+  memset(msg, 0, sizeof(repl_msg));
+  msg->type = type;
+  msg->epoch = htonl(epoch);
+  msg->seq = htobe64(seq);
+  msg->sent_ns = htobe64(sent_ns);
+
+  if (entry) {
+    delta_encode(&msg->rec, op, entry);
+  }
+}
+
+
+// Helper; blocking send of a whole buffer
+static bool send_all(int fd, void const* buf, size_t len) {
+  uint8_t const* pos = buf;
+
+
+  while (len > 0) {
+    ssize_t n = send(fd, pos, len, MSG_NOSIGNAL);
+
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+
+    pos += n;
+    len -= n;
+  }
+
+
+  return true;
+}
+
+
+// Helper; print a peer's address
+static void print_addr(char const* prefix, struct sockaddr_in const* addr) {
+  char ip_str[INET_ADDRSTRLEN];
+
+
+  fprintf(stderr, "%s %s:%u\n", prefix,
+    inet_ntop(AF_INET, &addr->sin_addr, ip_str, INET_ADDRSTRLEN),
+    ntohs(addr->sin_port));
+}
+
+
+//
+// Primary
+//
+
+
+// Snapshot rows waiting to be sent by a snapshot thread
+typedef struct {
+  repl_peer* peer;
+  uint32_t epoch;
+  uint64_t seq;                // Where the log replay starts
+  repl_msg buf[REPL_BATCH];
+  size_t n;
+} snapshot_out;
+
+
+// Helper; send the buffered snapshot rows
+static bool snapshot_flush(snapshot_out* out) {
+  bool ok = send_all(out->peer->fd, out->buf, out->n * sizeof(repl_msg));
+
+
+  out->n = 0;
+
+
+  return ok;
+}
+
+
+// Helper; buffer a snapshot row; passed to the snapshot callback
+static bool snapshot_emit(client_info const* entry, void* ctx) {
+  snapshot_out* out = (snapshot_out*)ctx;
+
+
+  repl_encode(&out->buf[out->n++], REPL_SNAPSHOT_ROW, out->epoch, out->seq,
+    0, DELTA_INSERT, entry);
+
+
+  return out->n < REPL_BATCH || snapshot_flush(out);
+}
+
+
+// Snapshot thread; owns the peer's socket until it changes the state
+static void* repl_snapshot_thread(void* arg) {
+  repl_peer* peer = (repl_peer*)arg;
+  repl_primary* p = peer->primary;
+  snapshot_out out;
+  bool ok;
+
+
+  out.peer = peer;
+  out.epoch = p->epoch;
+  out.seq = peer->next_seq;
+  out.n = 0;
+
+  repl_encode(&out.buf[out.n++], REPL_SNAPSHOT_BEGIN, out.epoch, out.seq, 0,
+    0, NULL);
+
+  if ((ok = p->snapshot(p->snapshot_ctx, &snapshot_emit, &out))) {
+    repl_encode(&out.buf[out.n++], REPL_SNAPSHOT_END, out.epoch, out.seq, 0,
+      0, NULL);
+    ok = ok && snapshot_flush(&out);
+  }
+
+  if (!ok) {
+    print_addr("repl_snapshot_thread: Snapshot failed for", &peer->addr);
+  }
+
+  __atomic_store_n(&peer->state, ok ? PEER_STREAMING : PEER_FAILED,
+    __ATOMIC_RELEASE);
+
+
+  return NULL;
+}
+
+
+// Helper; disconnect a replica
+static void repl_peer_close(repl_peer* peer) {
+  close(peer->fd);
+  peer->fd = -1;
+  peer->state = PEER_FREE;
+}
+
+
+// Helper; queue the next batch for a replica once the last one is sent
+// Return value: False if the replica was dropped
+static bool repl_peer_fill(repl_primary* p, repl_peer* peer, bool heartbeat) {
+  size_t n = 0;
+
+
+  if (peer->out_off < peer->out_len) {
+    return true;
+  }
+
+  if (p->head - peer->next_seq > REPL_LOG_SIZE) {
+    print_addr("repl_primary_flush: Dropping replica that fell behind:",
+      &peer->addr);
+    ++p->n_dropped;
+    repl_peer_close(peer);
+    return false;
+  }
+
+  while (n < REPL_BATCH && peer->next_seq < p->head) {
+    peer->out[n++] = p->log[peer->next_seq++ & (REPL_LOG_SIZE - 1)];
+  }
+
+  if (n == 0 && heartbeat) {
+    repl_encode(&peer->out[n++], REPL_HEARTBEAT, p->epoch, p->head,
+      realtime_ns(), 0, NULL);
+  }
+
+  peer->out_len = n * sizeof(repl_msg);
+  peer->out_off = 0;
+
+
+  return true;
+}
+
+
+// Helper; read what's arrived of a replica's hello, and once it's all
+// there, resume the replica from the log if it can be, else start sending
+// it a snapshot
+static void repl_peer_greet(repl_primary* p, repl_peer* peer, bool ready) {
+  ssize_t n = recv(peer->fd, (uint8_t*)&peer->hello + peer->hello_len,
+    sizeof(repl_hello) - peer->hello_len, MSG_DONTWAIT);
+  uint64_t seq;
+
+
+  if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      && realtime_ns() < peer->hello_deadline_ns) {
+    return;
+  }
+
+  if (n <= 0) {
+    print_addr("repl_primary_flush: No hello from", &peer->addr);
+    repl_peer_close(peer);
+    return;
+  }
+
+  if ((peer->hello_len += n) < sizeof(repl_hello)) {
+    return;
+  }
+
+  seq = be64toh(peer->hello.next_seq);
+
+
+  // Positions in another run's log, or ones it no longer has, mean nothing
+  if (seq != REPL_FROM_SCRATCH && ntohl(peer->hello.epoch) == p->epoch
+      && seq <= p->head && p->head - seq <= REPL_LOG_SIZE) {
+    peer->next_seq = seq;
+    peer->state = PEER_STREAMING;
+    ++p->n_resumed;
+    print_addr("repl_primary_flush: Resuming", &peer->addr);
+    return;
+  }
+
+  if (seq != REPL_FROM_SCRATCH) {
+    print_addr("repl_primary_flush: Log doesn't cover the resume of",
+      &peer->addr);
+  }
+
+  if (!ready) {
+    print_addr("repl_primary_flush: Not loaded yet; turning away",
+      &peer->addr);
+    repl_peer_close(peer);
+    return;
+  }
+
+
+  // The snapshot thread sends with blocking calls
+  peer->next_seq = p->head;
+  peer->state = PEER_SNAPSHOT;
+
+  if (fcntl(peer->fd, F_SETFL, fcntl(peer->fd, F_GETFL) & ~O_NONBLOCK) == -1
+      || (errno = pthread_create(&peer->thread, NULL, &repl_snapshot_thread,
+          peer)) != 0) {
+    perror("repl_primary_flush: Couldn't start snapshot thread");
+    repl_peer_close(peer);
+    return;
+  }
+
+  peer->joinable = true;
+  ++p->n_snapshots;
+  print_addr("repl_primary_flush: Sending a snapshot to", &peer->addr);
+}
+
+
+bool repl_primary_init(repl_primary* p, uint16_t port, int listen_fd,
+  repl_snapshot_fn snapshot, void* snapshot_ctx) {
+  struct sockaddr_in addr;
+  int on = 1;
+
+
+  memset(p, 0, sizeof(repl_primary));
+  for (size_t i = 0; i < REPL_MAX_PEERS; ++i) {
+    p->peers[i].fd = -1;
+  }
+  p->snapshot = snapshot;
+  p->snapshot_ctx = snapshot_ctx;
+
+  // Distinct across restarts and handoffs, whose logs start over
+  p->epoch = (uint32_t)(realtime_ns() / 1000) ^ (uint32_t)getpid() << 16;
+  p->epoch = p->epoch ? p->epoch : 1;
+
+  if ((p->log = calloc(REPL_LOG_SIZE, sizeof(repl_msg))) == NULL) {
+    fprintf(stderr, "repl_primary_init: Out of memory!\n");
+    return false;
+  }
+
+
+  if ((p->listen_fd = listen_fd) != -1) {
+    fprintf(stderr, "repl_primary_init: Serving replicas on inherited port "
+      "%u\n", port);
+    return true;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+
+  if ((p->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1
+      || setsockopt(p->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+        == -1
+      || bind(p->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+      || listen(p->listen_fd, REPL_MAX_PEERS) == -1) {
+    perror("repl_primary_init: Couldn't listen for replicas");
+    return false;
+  }
+
+  fprintf(stderr, "repl_primary_init: Serving replicas on port %u\n", port);
+
+
+  return true;
+}
+
+
+void repl_primary_accept(repl_primary* p) {
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  repl_peer* peer = NULL;
+  int fd, on = 1;
+
+
+  if ((fd = accept(p->listen_fd, (struct sockaddr*)&addr, &addrlen)) == -1) {
+    return;
+  }
+
+  for (size_t i = 0; i < REPL_MAX_PEERS && !peer; ++i) {
+    if (p->peers[i].state == PEER_FREE) {
+      peer = &p->peers[i];
+    }
+  }
+
+  if (!peer) {
+    print_addr("repl_primary_accept: Too many replicas; turning away", &addr);
+    close(fd);
+    return;
+  }
+
+  // The hello's read from the event loop
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  peer->primary = p;
+  peer->fd = fd;
+  peer->addr = addr;
+  peer->hello_len = 0;
+  peer->hello_deadline_ns = realtime_ns() + REPL_HELLO_TIMEOUT_MS * 1000000ULL;
+  peer->out_len = peer->out_off = 0;
+  peer->state = PEER_HELLO;
+}
+
+
+size_t repl_primary_poll_fds(repl_primary const* p, struct pollfd* fds) {
+  size_t n = 0;
+
+
+  for (size_t i = 0; i < REPL_MAX_PEERS; ++i) {
+    if (p->peers[i].state == PEER_HELLO) {
+      fds[n].fd = p->peers[i].fd;
+      fds[n].events = POLLIN;
+      ++n;
+    }
+  }
+
+
+  return n;
+}
+
+
+void repl_primary_publish(repl_primary* p, delta_op op,
+  client_info const* entry) {
+  repl_encode(&p->log[p->head & (REPL_LOG_SIZE - 1)], REPL_UPDATE, p->epoch,
+    p->head, realtime_ns(), op, entry);
+  ++p->head;
+}
+
+
+void repl_primary_flush(repl_primary* p, bool ready) {
+  uint64_t now = realtime_ns();
+  bool heartbeat = now - p->last_heartbeat_ns >= REPL_TICK_MS * 1000000ULL;
+
+
+  if (heartbeat) {
+    p->last_heartbeat_ns = now;
+  }
+
+  for (size_t i = 0; i < REPL_MAX_PEERS; ++i) {
+    repl_peer* peer = &p->peers[i];
+    int state = __atomic_load_n(&peer->state, __ATOMIC_ACQUIRE);
+
+    if (state == PEER_HELLO) {
+      repl_peer_greet(p, peer, ready);
+      state = peer->state;
+    }
+
+    if (state == PEER_FREE || state == PEER_HELLO || state == PEER_SNAPSHOT) {
+      continue;
+    }
+
+    // The snapshot thread is done with the socket
+    if (peer->joinable) {
+      pthread_join(peer->thread, NULL);
+      peer->joinable = false;
+    }
+
+    if (state == PEER_FAILED) {
+      repl_peer_close(peer);
+      continue;
+    }
+
+
+    // Send until caught up or the socket's full
+    bool beat = heartbeat;
+
+    while (repl_peer_fill(p, peer, beat) && peer->out_len > 0) {
+      ssize_t n = send(peer->fd, (uint8_t*)peer->out + peer->out_off,
+        peer->out_len - peer->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+      if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          print_addr("repl_primary_flush: Lost replica", &peer->addr);
+          repl_peer_close(peer);
+        }
+        break;
+      }
+
+      peer->out_off += n;
+      if (peer->out_off < peer->out_len) {
+        break;
+      }
+
+      peer->out_len = peer->out_off = 0;
+      beat = false;
+    }
+  }
+}
+
+
+void repl_primary_dump_stats(repl_primary const* p) {
+  char ip_str[INET_ADDRSTRLEN];
+
+
+  fprintf(stderr, "repl: primary at seq %lu of epoch %08x, %lu snapshots "
+    "sent, %lu replicas resumed, %lu dropped\n", (unsigned long)p->head,
+    p->epoch, p->n_snapshots, p->n_resumed, p->n_dropped);
+
+  for (size_t i = 0; i < REPL_MAX_PEERS; ++i) {
+    repl_peer const* peer = &p->peers[i];
+    int state = __atomic_load_n(&peer->state, __ATOMIC_ACQUIRE);
+
+    if (state == PEER_FREE) {
+      continue;
+    }
+
+    fprintf(stderr, "  replica %s:%u: %s, %lu behind\n",
+      inet_ntop(AF_INET, &peer->addr.sin_addr, ip_str, INET_ADDRSTRLEN),
+      ntohs(peer->addr.sin_port),
+      state == PEER_HELLO ? "hello" : state == PEER_SNAPSHOT ? "snapshot"
+        : "streaming",
+      (unsigned long)(p->head - peer->next_seq));
+  }
+}
+
+
+//
+// Replica
+//
+
+
+// Helper; drop the connection to the primary
+static void repl_replica_disconnect(repl_replica* r) {
+  close(r->fd);
+  r->fd = -1;
+  r->connecting = false;
+  r->in_len = 0;
+}
+
+
+// Helper; say where to start, once connected
+static void repl_replica_hello(repl_replica* r) {
+  repl_hello hello;
+  int on = 1;
+
+
+  memset(&hello, 0, sizeof(hello));
+  hello.epoch = htonl(r->synced ? r->epoch : 0);
+  hello.next_seq = htobe64(r->synced ? r->next_seq : REPL_FROM_SCRATCH);
+
+  // A fresh connection's buffer takes it whole
+  if (send(r->fd, &hello, sizeof(hello), MSG_DONTWAIT | MSG_NOSIGNAL)
+      != sizeof(hello)) {
+    repl_replica_disconnect(r);
+    return;
+  }
+
+  setsockopt(r->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  print_addr("repl_replica_connect: Connected to primary", &r->primary);
+}
+
+
+// Helper; start connecting to the primary
+static void repl_replica_connect(repl_replica* r) {
+  r->last_attempt_ns = realtime_ns();
+
+  if ((r->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+    perror("repl_replica_connect: Couldn't create socket");
+    return;
+  }
+
+  if (connect(r->fd, (struct sockaddr*)&r->primary, sizeof(r->primary))
+      == 0) {
+    repl_replica_hello(r);
+  } else if (errno == EINPROGRESS) {
+    r->connecting = true;
+  } else {
+    repl_replica_disconnect(r);
+  }
+}
+
+
+// Helper; the log can't be followed from where we are; start over from a
+// snapshot, serving what we have meanwhile
+static void repl_replica_resync(repl_replica* r) {
+  r->synced = false;
+  ++r->n_resyncs;
+}
+
+
+// Helper; handle one message
+// Return value: False if the connection should be dropped
+static bool repl_replica_handle(repl_replica* r, repl_msg const* msg,
+  repl_apply_fn fn, void* ctx) {
+  uint32_t epoch = ntohl(msg->epoch);
+  uint64_t seq = be64toh(msg->seq);
+  uint64_t sent_ns = be64toh(msg->sent_ns);
+  delta_op op = 0;
+  client_info entry;
+
+
+  memset(&entry, 0, sizeof(entry));
+
+  switch (msg->type) {
+    case REPL_SNAPSHOT_BEGIN:
+      r->n_snapshot_rows = 0;
+      break;
+
+    case REPL_SNAPSHOT_ROW:
+    case REPL_UPDATE:
+      if (!delta_decode(&msg->rec, &op, &entry)) {
+        fprintf(stderr, "repl_replica_receive: Bad record\n");
+        return false;
+      }
+      break;
+
+    case REPL_SNAPSHOT_END:
+    case REPL_HEARTBEAT:
+      break;
+
+    default:
+      fprintf(stderr, "repl_replica_receive: Bad message type %u\n",
+        msg->type);
+      return false;
+  }
+
+
+  // Positions in a restarted primary's log aren't ours
+  if (r->synced && epoch != r->epoch
+      && (msg->type == REPL_HEARTBEAT || msg->type == REPL_UPDATE)) {
+    fprintf(stderr, "repl_replica_receive: Primary restarted (epoch %08x, "
+      "was %08x); resyncing\n", epoch, r->epoch);
+    repl_replica_resync(r);
+    return false;
+  }
+
+  if (msg->type == REPL_HEARTBEAT) {
+    r->primary_head = seq > r->primary_head ? seq : r->primary_head;
+    return true;
+  }
+
+  if (msg->type == REPL_UPDATE) {
+    if (!r->synced || seq > r->next_seq) {
+      fprintf(stderr, "repl_replica_receive: Gap in the log at %lu; "
+        "resyncing\n", (unsigned long)r->next_seq);
+      repl_replica_resync(r);
+      return false;
+    }
+
+    if (seq < r->next_seq) {
+      return true; // Already have it
+    }
+  }
+
+
+  if (!fn((repl_msg_type)msg->type, op, &entry, ctx)) {
+    fprintf(stderr, "repl_replica_receive: Couldn't apply; giving up\n");
+    r->gave_up = true;
+    return false;
+  }
+
+
+  switch (msg->type) {
+    case REPL_SNAPSHOT_ROW:
+      ++r->n_snapshot_rows;
+      break;
+
+    case REPL_SNAPSHOT_END:
+      r->synced = true;
+      r->epoch = epoch;
+      r->next_seq = seq;
+      r->primary_head = seq;
+      fprintf(stderr, "repl_replica_receive: Snapshot of %lu rows applied\n",
+        r->n_snapshot_rows);
+      break;
+
+    case REPL_UPDATE: {
+      uint64_t now = realtime_ns();
+      uint64_t lag = now > sent_ns ? now - sent_ns : 0;
+
+      if (r->n_applied++ == 0) {
+        r->first_apply_ns = now;
+      }
+      r->last_apply_ns = now;
+      r->lag_last_ns = lag;
+      r->lag_sum_ns += lag;
+      r->lag_max_ns = lag > r->lag_max_ns ? lag : r->lag_max_ns;
+      r->next_seq = seq + 1;
+      r->primary_head = r->next_seq > r->primary_head
+        ? r->next_seq : r->primary_head;
+      break;
+    }
+  }
+
+
+  return true;
+}
+
+
+void repl_replica_init(repl_replica* r, struct sockaddr_in const* primary) {
+  memset(r, 0, sizeof(repl_replica));
+  r->fd = -1;
+  r->primary = *primary;
+
+  repl_replica_connect(r);
+}
+
+
+short repl_replica_events(repl_replica const* r) {
+  return r->connecting ? POLLOUT : POLLIN;
+}
+
+
+void repl_replica_receive(repl_replica* r, repl_apply_fn fn, void* ctx) {
+  ssize_t n;
+  size_t pos = 0;
+  int error;
+  socklen_t error_len = sizeof(error);
+
+
+  if (r->fd == -1) {
+    return;
+  }
+
+  if (r->connecting) {
+    if (getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1
+        || error != 0) {
+      repl_replica_disconnect(r);
+      return;
+    }
+
+    r->connecting = false;
+    repl_replica_hello(r);
+    return;
+  }
+
+  n = recv(r->fd, r->in + r->in_len, sizeof(r->in) - r->in_len, MSG_DONTWAIT);
+
+  if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK
+        && errno != EINTR)) {
+    print_addr("repl_replica_receive: Lost primary", &r->primary);
+    repl_replica_disconnect(r);
+    return;
+  }
+
+  if (n == -1) {
+    return;
+  }
+
+  r->in_len += n;
+
+
+  while (r->in_len - pos >= sizeof(repl_msg)) {
+    repl_msg msg;
+
+    memcpy(&msg, r->in + pos, sizeof(msg));
+    pos += sizeof(msg);
+
+    if (!repl_replica_handle(r, &msg, fn, ctx)) {
+      repl_replica_disconnect(r);
+      return;
+    }
+  }
+
+  memmove(r->in, r->in + pos, r->in_len - pos);
+  r->in_len -= pos;
+}
+
+
+void repl_replica_tick(repl_replica* r) {
+  uint64_t now = realtime_ns();
+
+
+  // A connect that hangs is given up on like one that failed
+  if (r->connecting && now - r->last_attempt_ns >= RECONNECT_NS) {
+    repl_replica_disconnect(r);
+  }
+
+  if (r->fd == -1 && !r->gave_up && now - r->last_attempt_ns >= RECONNECT_NS) {
+    repl_replica_connect(r);
+  }
+}
+
+
+void repl_replica_dump_stats(repl_replica const* r) {
+  char ip_str[INET_ADDRSTRLEN];
+  double secs = (r->last_apply_ns - r->first_apply_ns) / 1e9;
+
+
+  fprintf(stderr, "repl: replica of %s:%u, %s, next seq %lu, %lu behind\n",
+    inet_ntop(AF_INET, &r->primary.sin_addr, ip_str, INET_ADDRSTRLEN),
+    ntohs(r->primary.sin_port),
+    r->gave_up ? "gave up" : r->fd == -1 || r->connecting ? "disconnected"
+      : r->synced ? "streaming" : "snapshot",
+    (unsigned long)r->next_seq,
+    (unsigned long)(r->primary_head > r->next_seq
+      ? r->primary_head - r->next_seq : 0));
+  fprintf(stderr, "  epoch %08x, %lu resyncs from a snapshot\n", r->epoch,
+    r->n_resyncs);
+  fprintf(stderr, "  %lu snapshot rows, %lu updates applied (%.0f/s), "
+    "lag last %.3f ms, avg %.3f ms, max %.3f ms\n", r->n_snapshot_rows,
+    r->n_applied, secs > 0 ? r->n_applied / secs : 0.0,
+    r->lag_last_ns / 1e6,
+    r->n_applied > 0 ? r->lag_sum_ns / 1e6 / r->n_applied : 0.0,
+    r->lag_max_ns / 1e6);
+}
@@ -0,0 +1,216 @@
+#ifndef REPL_H
+#define REPL_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netinet/ip.h>
+
+#include "database.h"
+#include "delta.h"
+
+
+// Primary/replica replication of the subscriber index over TCP. A replica
+// connects and says where it wants to start: from scratch, or from a log
+// position it already has (after a reconnect). Log positions only mean
+// something within one run of the primary, so every message carries the
+// primary's epoch, picked at random when it starts, and a replica can only
+// resume within the epoch its rows came from; a replica the log can't
+// resume gets a snapshot instead, and one that finds a gap in the log or a
+// new epoch reconnects asking for one. From scratch, the primary
+// streams a snapshot of its rows from a separate thread, and then every
+// change it applies, in order, from a log that remembers the last
+// REPL_LOG_SIZE changes. The snapshot is fuzzy: rows may change while it's
+// being read, but every such change is also in the log after the
+// snapshot's starting position, and replaying upserts and deletes is
+// idempotent, so the replica converges.
+//
+// Neither side blocks its event loop on the network: connections are made
+// and hellos read without blocking, the primary queues log records per
+// replica and sends what the socket takes, and drops replicas that fall
+// more than REPL_LOG_SIZE changes behind. Both sides are driven from the
+// server's poll() loop, and should be ticked at least every REPL_TICK_MS
+// for heartbeats, hello timeouts and reconnects.
+
+
+#define REPL_LOG_SIZE 65536   // Changes kept for replicas to catch up on
+#define REPL_MAX_PEERS 8      // Replicas per primary
+#define REPL_BATCH 256        // Messages per send()/recv()
+#define REPL_TICK_MS 100      // Heartbeat and reconnect granularity
+#define REPL_FROM_SCRATCH UINT64_MAX // Hello from a replica with no data
+#define REPL_HELLO_TIMEOUT_MS 1000 // For a replica to say where it starts
+
+
+typedef enum {
+  REPL_SNAPSHOT_BEGIN = 1, // Forget any earlier snapshot rows
+  REPL_SNAPSHOT_ROW = 2,   // A row; seq is where the log replay starts
+  REPL_SNAPSHOT_END = 3,   // Snapshot complete
+  REPL_UPDATE = 4,         // A change from the log
+  REPL_HEARTBEAT = 5,      // Nothing new; seq is the primary's log head
+} repl_msg_type;
+
+
+// On-wire message; integers are in network byte order
+typedef struct {
+  uint8_t type;        // repl_msg_type
+  uint8_t reserved[3];
+  uint32_t epoch;      // Primary's run the log position belongs to
+  uint64_t seq;        // Log position (see repl_msg_type)
+  uint64_t sent_ns;    // Primary's CLOCK_REALTIME when the change was applied
+                       // (or the heartbeat sent); lag assumes synced clocks
+  delta_record rec;    // The row or change, for rows and updates
+} repl_msg;
+
+
+// What a replica sends on connecting; integers are in network byte order
+typedef struct {
+  uint32_t epoch;      // Primary's run next_seq belongs to; 0 if none
+  uint32_t reserved;
+  uint64_t next_seq;   // Log position to resume at, or REPL_FROM_SCRATCH
+} repl_hello;
+
+
+// Produces a snapshot on the primary by calling 'emit' for every row, each
+// key once; runs on a separate thread, so it may only read thread-safe
+// structures. Returns false if 'emit' did.
+typedef bool (*repl_emit_fn)(client_info const* entry, void* emit_ctx);
+typedef bool (*repl_snapshot_fn)(void* ctx, repl_emit_fn emit,
+  void* emit_ctx);
+
+
+// Applies a message on the replica; returns false to give up replicating
+typedef bool (*repl_apply_fn)(repl_msg_type type, delta_op op,
+  client_info const* entry, void* ctx);
+
+
+typedef enum {
+  PEER_FREE,
+  PEER_HELLO,          // Waiting for the replica to say where it starts
+  PEER_SNAPSHOT,       // Snapshot thread owns the socket
+  PEER_STREAMING,      // Event loop sends log records
+  PEER_FAILED,         // Snapshot thread gave up; to be closed
+} repl_peer_state;
+
+
+struct repl_primary;
+
+
+// A connected replica, as seen by the primary
+typedef struct {
+  struct repl_primary* primary;
+  int fd;
+  int state;               // repl_peer_state; written by the snapshot thread
+  pthread_t thread;        // Snapshot thread...
+  bool joinable;           // ...if it hasn't been joined yet
+  struct sockaddr_in addr;
+  repl_hello hello;        // Hello read so far...
+  size_t hello_len;        // ...bytes of it...
+  uint64_t hello_deadline_ns; // ...and when to give up on the rest
+  uint64_t next_seq;       // Next log record to queue
+  repl_msg out[REPL_BATCH]; // Queued messages...
+  size_t out_len;          // ...bytes of them...
+  size_t out_off;          // ...and bytes already sent
+} repl_peer;
+
+
+typedef struct repl_primary {
+  int listen_fd;
+  repl_peer peers[REPL_MAX_PEERS];
+  repl_msg* log;           // Ring of the last REPL_LOG_SIZE changes
+  uint32_t epoch;          // This run's; never 0
+  uint64_t head;           // Sequence number of the next change
+  uint64_t last_heartbeat_ns;
+  repl_snapshot_fn snapshot;
+  void* snapshot_ctx;
+  size_t n_snapshots;      // Statistics: snapshots sent...
+  size_t n_resumed;        // ...replicas resumed from the log...
+  size_t n_dropped;        // ...and replicas dropped for falling behind
+} repl_primary;
+
+
+typedef struct {
+  int fd;                  // -1 while disconnected
+  bool connecting;         // fd's connect() hasn't completed yet
+  struct sockaddr_in primary;
+  bool synced;             // Snapshot complete; resume from next_seq...
+  uint32_t epoch;          // ...of this run of the primary
+  bool gave_up;            // Unrecoverable; stop reconnecting
+  uint64_t next_seq;       // Next log record expected
+  uint8_t in[REPL_BATCH * sizeof(repl_msg)]; // Partial messages
+  size_t in_len;
+  uint64_t last_attempt_ns;
+  uint64_t primary_head;   // Statistics: primary's log head, last we heard
+  size_t n_snapshot_rows;  // ...rows received in snapshots
+  size_t n_resyncs;        // ...times the log couldn't be followed
+  size_t n_applied;        // ...log records applied
+  uint64_t first_apply_ns; // ...when the first and last were
+  uint64_t last_apply_ns;
+  uint64_t lag_last_ns;    // ...apply time minus primary's apply time
+  uint64_t lag_max_ns;
+  uint64_t lag_sum_ns;
+} repl_replica;
+
+
+// Listen for replicas on a TCP port
+// Args:
+//   listen_fd - A socket already listening on the port (e.g. handed over by
+//   the server we replace), or -1 to open one
+// Return value: True if OK, false otherwise
+bool repl_primary_init(repl_primary* p, uint16_t port, int listen_fd,
+  repl_snapshot_fn snapshot, void* snapshot_ctx);
+
+
+// Accept a replica; call when listen_fd is readable. Its hello is read by
+// repl_primary_flush().
+void repl_primary_accept(repl_primary* p);
+
+
+// Sockets of replicas whose hello hasn't arrived, to poll() for reading
+// along with listen_fd
+// Return value: How many were put in 'fds' (at most REPL_MAX_PEERS)
+size_t repl_primary_poll_fds(repl_primary const* p, struct pollfd* fds);
+
+
+// Append a change to the log and queue it for every streaming replica
+void repl_primary_publish(repl_primary* p, delta_op op,
+  client_info const* entry);
+
+
+// Read hellos, send what's queued, heartbeat idle replicas, and reap
+// finished snapshot threads; call on every loop iteration
+// Args:
+//   ready - Whether a snapshot can be taken now; if not, replicas that need
+//   one are turned away and retry later
+void repl_primary_flush(repl_primary* p, bool ready);
+
+
+// Print statistics
+void repl_primary_dump_stats(repl_primary const* p);
+
+
+// Start replicating from a primary; connection failures aren't fatal, since
+// repl_replica_tick() keeps retrying
+void repl_replica_init(repl_replica* r, struct sockaddr_in const* primary);
+
+
+// Events to poll() fd for: writable while connecting, else readable
+short repl_replica_events(repl_replica const* r);
+
+
+// Finish connecting, or read and apply whatever arrived; call when fd has
+// any of repl_replica_events()
+void repl_replica_receive(repl_replica* r, repl_apply_fn fn, void* ctx);
+
+
+// Reconnect if disconnected; call on every loop iteration
+void repl_replica_tick(repl_replica* r);
+
+
+// Print statistics: position, lag and apply rate
+void repl_replica_dump_stats(repl_replica const* r);
+
+
+#endif // REPL_H
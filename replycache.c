@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "replycache.h"
+
+
+bool reply_cache_init(reply_cache* c, size_t n_clients, size_t depth) {
+  memset(c, 0, sizeof(reply_cache));
+
+  if ((c->replies = calloc(n_clients * depth, sizeof(cached_reply)))
+      == NULL) {
+    fprintf(stderr, "reply_cache_init: Out of memory!\n");
+    return false;
+  }
+
+  c->n_clients = n_clients;
+  c->depth = depth;
+
+
+  return true;
+}
+
+
+void reply_cache_destroy(reply_cache* c) {
+  free(c->replies);
+  memset(c, 0, sizeof(reply_cache));
+}
+
+
+void reply_cache_put(reply_cache* c, size_t client, sequence_num seq,
+  void const* buf, size_t len) {
+  cached_reply* r;
+
+
+  if (client >= c->n_clients || len > REPLY_MAX) {
+    return;
+  }
+
+  r = &c->replies[client * c->depth + seq % c->depth];
+  r->seq = seq;
+  r->len = len;
+  memcpy(r->data, buf, len);
+  ++c->n_kept;
+}
+
+
+void reply_cache_clear(reply_cache* c, size_t client, sequence_num seq) {
+  if (client < c->n_clients) {
+    c->replies[client * c->depth + seq % c->depth].len = 0;
+  }
+}
+
+
+cached_reply const* reply_cache_get(reply_cache* c, size_t client,
+  sequence_num seq) {
+  cached_reply const* r;
+
+
+  if (client >= c->n_clients) {
+    return NULL;
+  }
+
+  r = &c->replies[client * c->depth + seq % c->depth];
+  if (r->len == 0 || r->seq != seq) {
+    return NULL;
+  }
+
+  ++c->n_resent;
+
+
+  return r;
+}
+
+
+void reply_cache_forget(reply_cache* c, size_t client) {
+  if (client < c->n_clients) {
+    memset(&c->replies[client * c->depth], 0,
+      c->depth * sizeof(cached_reply));
+  }
+}
+
+
+void reply_cache_dump_stats(reply_cache const* c) {
+  fprintf(stderr, "replies: %lu per client for %lu clients; %lu kept, "
+    "%lu sent again for duplicates\n", c->depth, c->n_clients, c->n_kept,
+    c->n_resent);
+}
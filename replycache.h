@@ -0,0 +1,77 @@
+#ifndef REPLYCACHE_H
+#define REPLYCACHE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "packet.h"
+
+
+// The last few verdicts sent to each client, flattened, so a retransmitted
+// request whose verdict was lost gets the same verdict again, without
+// another lookup, instead of a DUP_PACK reject. Each client has 'depth'
+// entries, picked by sequence number modulo depth, so a pipelining client's
+// last 'depth' replies are all kept. Clients are numbered by the server:
+// narrow IDs by ID, wide ones after them by session. Replies too long for
+// an entry (not verdicts to plain access requests) aren't kept. Not
+// thread-safe.
+
+
+#define REPLY_MAX 30                // Longest flattened reply kept
+#define REPLY_NONE SIZE_MAX         // No client to keep replies for
+
+
+typedef struct {
+  sequence_num seq;
+  uint8_t len;                      // 0 if empty
+  uint8_t data[REPLY_MAX];
+} cached_reply;
+
+
+typedef struct {
+  cached_reply* replies;            // 'depth' per client
+  size_t n_clients;
+  size_t depth;
+  size_t n_kept;                    // Statistics: replies kept...
+  size_t n_resent;                  // ...and sent again for duplicates
+} reply_cache;
+
+
+// Allocate a cache of 'depth' replies for each of 'n_clients' clients
+// Return value: True if OK, false if allocation failed
+bool reply_cache_init(reply_cache* c, size_t n_clients, size_t depth);
+
+
+// Free a cache
+void reply_cache_destroy(reply_cache* c);
+
+
+// Keep a flattened reply to a client's request 'seq'
+void reply_cache_put(reply_cache* c, size_t client, sequence_num seq,
+  void const* buf, size_t len);
+
+
+// Drop the reply kept in the entry a client's new request 'seq' will take,
+// when 'seq' is claimed; not every request leaves a reply there (forwarded,
+// parked and SUBSCRIBE ones don't), and a duplicate of one mustn't get the
+// reply from the sequence number's last lap
+void reply_cache_clear(reply_cache* c, size_t client, sequence_num seq);
+
+
+// Find the reply to a client's request 'seq'
+// Return value: The reply, or NULL if it's not kept
+cached_reply const* reply_cache_get(reply_cache* c, size_t client,
+  sequence_num seq);
+
+
+// Drop a client's replies, when its number goes to another client
+void reply_cache_forget(reply_cache* c, size_t client);
+
+
+// Print statistics
+void reply_cache_dump_stats(reply_cache const* c);
+
+
+#endif // REPLYCACHE_H
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#include "reuseport.h"
+#include "packet.h"
+
+
+// Offsets into the datagram; a reuseport program sees the UDP payload only
+#define ID 2                        // After PACKET_START or PACKET_START_WIDE
+#define NARROW_TYPE 3               // After a narrow ID
+#define NARROW_NUM 8                // After the type, sequence number, length
+                                    // and an ACC_PER's tech type
+
+
+// Helper; attach the steering program to the group 'fd' is in
+static bool attach_steering(int fd, size_t n) {
+  // Jumps are relative to the next instruction; the comments give targets
+  struct sock_filter code[] = {
+    /* 0 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0),
+    /* 1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_START, 0, 2),  // 2, 4
+    /* 2 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ID),
+    /* 3 */ BPF_STMT(BPF_JMP | BPF_JA, 2),                           // 6
+    /* 4 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_START_WIDE, 0, 3),
+                                                                    // 5, 8
+    /* 5 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, ID), // Host order after load
+    /* 6 */ BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n),
+    /* 7 */ BPF_STMT(BPF_RET | BPF_A, 0),
+    /* 8 */ BPF_STMT(BPF_RET | BPF_K, n), // No such socket: the kernel hashes
+  };
+  struct sock_fprog prog = {
+    .len = sizeof(code) / sizeof(code[0]),
+    .filter = code,
+  };
+
+
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+        sizeof(prog)) == -1) {
+    perror("reuseport_open: Couldn't attach steering program");
+    return false;
+  }
+
+
+  return true;
+}
+
+
+bool reuseport_steer_by_key(int fd, size_t n, subscriber_num const* bounds,
+  size_t n_bounds) {
+  struct sock_filter code[16 + 2 * REUSEPORT_MAX_WORKERS];
+  size_t len = 0, by_id, wide;
+
+
+  if (n_bounds == 0 || n_bounds > n || n > REUSEPORT_MAX_WORKERS) {
+    fprintf(stderr, "reuseport_steer_by_key: Bad range count %lu!\n",
+      n_bounds);
+    return false;
+  }
+
+  // Jump offsets are relative to the next instruction, so the targets'
+  // places are worked out from the code's shape first: the header checks,
+  // a JGE/RET pair per range above the first, the first's RET, then the
+  // narrow and wide ID paths
+  by_id = 5 + 2 * (n_bounds - 1) + 1;
+  wide = by_id + 3;
+
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0);
+  code[len] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+    PACKET_START, 0, wide - len - 1);
+  ++len;
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+    NARROW_TYPE);
+  code[len] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ACC_PER,
+    0, by_id - len - 1);
+  ++len;
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+    NARROW_NUM); // Host order after load
+
+  // Highest range first: the first bound the number reaches picks it
+  for (size_t i = n_bounds - 1; i > 0; --i) {
+    code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K,
+      bounds[i], 0, 1);
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+  }
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+  // Anything else from a narrow ID: by ID, as reuseport_open() steers it
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ID);
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n);
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+  // Wide IDs likewise; no PACKET_START at all goes to the kernel's hash
+  code[len] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+    PACKET_START_WIDE, 0, 3);
+  ++len;
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, ID);
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n);
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, n);
+
+  struct sock_fprog prog = {
+    .len = len,
+    .filter = code,
+  };
+
+
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+        sizeof(prog)) == -1) {
+    perror("reuseport_steer_by_key: Couldn't attach steering program");
+    return false;
+  }
+
+
+  return true;
+}
+
+
+bool reuseport_open(struct sockaddr_in const* addr, size_t n, int* fds) {
+  size_t i;
+
+
+  if (n == 0 || n > REUSEPORT_MAX_WORKERS) {
+    fprintf(stderr, "reuseport_open: Between 1 and %d sockets!\n",
+      REUSEPORT_MAX_WORKERS);
+    return false;
+  }
+
+  // The group's sockets are numbered in the order they're bound
+  for (i = 0; i < n; ++i) {
+    if ((fds[i] = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+      perror("reuseport_open: Couldn't create socket");
+      goto fail;
+    }
+
+    if (setsockopt(fds[i], SOL_SOCKET, SO_REUSEPORT, &(int){ 1 },
+          sizeof(int)) == -1) {
+      perror("reuseport_open: Couldn't set SO_REUSEPORT");
+      ++i;
+      goto fail;
+    }
+
+    if (bind(fds[i], (struct sockaddr const*)addr,
+          sizeof(struct sockaddr_in)) == -1) {
+      perror("reuseport_open: Couldn't bind socket to address");
+      ++i;
+      goto fail;
+    }
+  }
+
+  if (!attach_steering(fds[0], n)) {
+    goto fail;
+  }
+
+
+  return true;
+
+
+fail:
+  while (i-- > 0) {
+    close(fds[i]);
+  }
+  return false;
+}
@@ -0,0 +1,53 @@
+#ifndef REUSEPORT_H
+#define REUSEPORT_H
+
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <netinet/ip.h>
+
+#include "database.h"
+
+
+// Several UDP sockets bound to one address with SO_REUSEPORT, one per
+// worker, and a classic BPF program on the group that picks the socket a
+// packet goes to from the client ID in its header: client_id % n, for
+// narrow and wide headers alike. The kernel's own choice hashes the
+// 4-tuple, which can split a client's sequence stream between workers if
+// it changes ports, or send every client behind one address to the same
+// one; steering by ID gives each worker its clients' receive windows,
+// sessions and reply cache outright. Packets without a PACKET_START
+// (narrow or wide) are left to the kernel's hash; ones too short to hold
+// an ID go to the first socket.
+//
+// Workers that each own a shard of the database (see shard.h) are steered
+// by key instead, once the shard ranges are known.
+
+
+#define REUSEPORT_MAX_WORKERS 64
+
+
+// Open 'n' sockets bound to 'addr', steered by client ID as above
+// Args:
+//   fds - Where to put them; fds[i] gets the clients with ID % n == i
+// Return value: True if OK, false otherwise (and no sockets are left open)
+bool reuseport_open(struct sockaddr_in const* addr, size_t n, int* fds);
+
+
+// Replace the steering program of the group 'fd' is in with one that sends
+// access requests from narrow client IDs by subscriber number: to socket i
+// if the number is at least bounds[i] and below bounds[i + 1]. Narrow IDs'
+// receive windows can be shared by the workers (they're claimed with a CAS,
+// see seqstate.h), so their requests may go to any of them; wide IDs'
+// sessions are one worker's, so everything else is still steered by ID.
+// Args:
+//   n - Sockets in the group
+//   bounds - Lowest number of each socket's range, ascending; bounds[0] is
+//   taken to be 0
+//   n_bounds - Ranges, at most n; sockets past them get no requests by key
+// Return value: True if OK, false otherwise
+bool reuseport_steer_by_key(int fd, size_t n, subscriber_num const* bounds,
+  size_t n_bounds);
+
+
+#endif // REUSEPORT_H
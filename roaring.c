@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "roaring.h"
+
+
+// Helper; index of the container for 'key', or where it would be inserted
+static size_t find_container(roaring const* r, uint16_t key, bool* found) {
+  size_t lo = 0, hi = r->n_containers;
+
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (r->containers[mid].key < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  *found = lo < r->n_containers && r->containers[lo].key == key;
+
+
+  return lo;
+}
+
+
+// Helper; position of 'low' in an array container, or where it would go
+static size_t find_low(roaring_container const* c, uint16_t low, bool* found) {
+  size_t lo = 0, hi = c->card;
+
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (c->data.array[mid] < low) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  *found = lo < c->card && c->data.array[lo] == low;
+
+
+  return lo;
+}
+
+
+// Helper; membership within a container
+static bool container_contains(roaring_container const* c, uint16_t low) {
+  bool found;
+
+
+  if (c->is_bitmap) {
+    return (c->data.bitmap[low / 64] >> (low % 64)) & 1;
+  }
+
+  find_low(c, low, &found);
+
+
+  return found;
+}
+
+
+// Helper; convert a full array container into a bitmap
+static bool container_to_bitmap(roaring_container* c) {
+  uint64_t* bitmap = calloc(ROARING_BITMAP_WORDS, sizeof(uint64_t));
+
+
+  if (!bitmap) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < c->card; ++i) {
+    bitmap[c->data.array[i] / 64] |= 1ULL << (c->data.array[i] % 64);
+  }
+
+  free(c->data.array);
+  c->data.bitmap = bitmap;
+  c->is_bitmap = true;
+
+
+  return true;
+}
+
+
+void roaring_init(roaring* r) {
+  memset(r, 0, sizeof(roaring));
+}
+
+
+void roaring_destroy(roaring* r) {
+  for (size_t i = 0; i < r->n_containers; ++i) {
+    if (r->containers[i].is_bitmap) {
+      free(r->containers[i].data.bitmap);
+    } else {
+      free(r->containers[i].data.array);
+    }
+  }
+
+  free(r->containers);
+  roaring_init(r);
+}
+
+
+bool roaring_add(roaring* r, uint32_t value) {
+  uint16_t key = value >> 16, low = value & 0xFFFF;
+  bool found;
+  size_t index = find_container(r, key, &found);
+
+
+  // New container
+  if (!found) {
+    if (r->n_containers == r->cap) {
+      size_t cap = r->cap ? r->cap * 2 : 4;
+      roaring_container* grown =
+        realloc(r->containers, cap * sizeof(roaring_container));
+
+      if (!grown) {
+        return false;
+      }
+
+      r->containers = grown;
+      r->cap = cap;
+    }
+
+    memmove(&r->containers[index + 1], &r->containers[index],
+      (r->n_containers - index) * sizeof(roaring_container));
+    memset(&r->containers[index], 0, sizeof(roaring_container));
+    r->containers[index].key = key;
+    ++r->n_containers;
+  }
+
+
+  roaring_container* c = &r->containers[index];
+
+  if (c->is_bitmap) {
+    uint64_t bit = 1ULL << (low % 64);
+
+    if (!(c->data.bitmap[low / 64] & bit)) {
+      c->data.bitmap[low / 64] |= bit;
+      ++c->card;
+    }
+
+    return true;
+  }
+
+
+  size_t pos = find_low(c, low, &found);
+  if (found) {
+    return true;
+  }
+
+  if (c->card == ROARING_ARRAY_MAX) {
+    return container_to_bitmap(c) && roaring_add(r, value);
+  }
+
+  if (c->card == c->cap) {
+    uint32_t cap = c->cap ? c->cap * 2 : 4;
+    uint16_t* grown = realloc(c->data.array, cap * sizeof(uint16_t));
+
+    if (!grown) {
+      return false;
+    }
+
+    c->data.array = grown;
+    c->cap = cap;
+  }
+
+  memmove(&c->data.array[pos + 1], &c->data.array[pos],
+    (c->card - pos) * sizeof(uint16_t));
+  c->data.array[pos] = low;
+  ++c->card;
+
+
+  return true;
+}
+
+
+void roaring_remove(roaring* r, uint32_t value) {
+  uint16_t key = value >> 16, low = value & 0xFFFF;
+  bool found;
+  size_t index = find_container(r, key, &found);
+
+
+  if (!found) {
+    return;
+  }
+
+  roaring_container* c = &r->containers[index];
+
+  if (c->is_bitmap) {
+    uint64_t bit = 1ULL << (low % 64);
+
+    if (c->data.bitmap[low / 64] & bit) {
+      c->data.bitmap[low / 64] &= ~bit;
+      --c->card;
+    }
+  } else {
+    size_t pos = find_low(c, low, &found);
+
+    if (found) {
+      memmove(&c->data.array[pos], &c->data.array[pos + 1],
+        (c->card - pos - 1) * sizeof(uint16_t));
+      --c->card;
+    }
+  }
+
+
+  // Drop empty containers; dense ones that thin out stay bitmaps
+  if (c->card == 0) {
+    if (c->is_bitmap) {
+      free(c->data.bitmap);
+    } else {
+      free(c->data.array);
+    }
+
+    memmove(&r->containers[index], &r->containers[index + 1],
+      (r->n_containers - index - 1) * sizeof(roaring_container));
+    --r->n_containers;
+  }
+}
+
+
+bool roaring_contains(roaring const* r, uint32_t value) {
+  bool found;
+  size_t index = find_container(r, value >> 16, &found);
+
+
+  return found && container_contains(&r->containers[index], value & 0xFFFF);
+}
+
+
+size_t roaring_cardinality(roaring const* r) {
+  size_t card = 0;
+
+
+  for (size_t i = 0; i < r->n_containers; ++i) {
+    card += r->containers[i].card;
+  }
+
+
+  return card;
+}
+
+
+size_t roaring_and_cardinality(roaring const* a, roaring const* b) {
+  size_t card = 0;
+  size_t i = 0, j = 0;
+
+
+  // Merge-join on container keys
+  while (i < a->n_containers && j < b->n_containers) {
+    roaring_container const* ca = &a->containers[i];
+    roaring_container const* cb = &b->containers[j];
+
+    if (ca->key < cb->key) {
+      ++i;
+      continue;
+    } else if (ca->key > cb->key) {
+      ++j;
+      continue;
+    }
+
+    if (ca->is_bitmap && cb->is_bitmap) {
+      for (size_t w = 0; w < ROARING_BITMAP_WORDS; ++w) {
+        card += __builtin_popcountll(ca->data.bitmap[w] & cb->data.bitmap[w]);
+      }
+    } else {
+      // Probe the other container with each value of an array
+      roaring_container const* arr = ca->is_bitmap ? cb : ca;
+      roaring_container const* other = ca->is_bitmap ? ca : cb;
+
+      for (uint32_t k = 0; k < arr->card; ++k) {
+        card += container_contains(other, arr->data.array[k]);
+      }
+    }
+
+    ++i;
+    ++j;
+  }
+
+
+  return card;
+}
+
+
+void roaring_for_each_andnot(roaring const* a, roaring const* b,
+  roaring_fn fn, void* ctx) {
+  for (size_t i = 0; i < a->n_containers; ++i) {
+    roaring_container const* c = &a->containers[i];
+    roaring_container const* other = NULL;
+    uint32_t high = (uint32_t)c->key << 16;
+    bool found;
+
+    if (b) {
+      size_t j = find_container(b, c->key, &found);
+      other = found ? &b->containers[j] : NULL;
+    }
+
+    if (c->is_bitmap) {
+      for (size_t w = 0; w < ROARING_BITMAP_WORDS; ++w) {
+        uint64_t word = c->data.bitmap[w];
+
+        if (other && other->is_bitmap) {
+          word &= ~other->data.bitmap[w];
+        }
+
+        while (word) {
+          uint16_t low = w * 64 + __builtin_ctzll(word);
+          word &= word - 1;
+
+          if (other && !other->is_bitmap && container_contains(other, low)) {
+            continue;
+          }
+          if (!fn(high | low, ctx)) {
+            return;
+          }
+        }
+      }
+    } else {
+      for (uint32_t k = 0; k < c->card; ++k) {
+        uint16_t low = c->data.array[k];
+
+        if (other && container_contains(other, low)) {
+          continue;
+        }
+        if (!fn(high | low, ctx)) {
+          return;
+        }
+      }
+    }
+  }
+}
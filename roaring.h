@@ -0,0 +1,78 @@
+#ifndef ROARING_H
+#define ROARING_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// Compressed bitmap of 32-bit values in the style of Roaring: values are
+// grouped by their high 16 bits into containers, each of which is either a
+// sorted array of low halves (sparse) or a 2^16-bit bitmap (dense),
+// switching at ROARING_ARRAY_MAX values.
+
+
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_BITMAP_WORDS (65536 / 64)
+
+
+typedef struct {
+  uint16_t key;        // High 16 bits of the values in here
+  bool is_bitmap;
+  uint32_t card;       // Number of values
+  uint32_t cap;        // Capacity of 'array' (array containers only)
+  union {
+    uint16_t* array;   // Sorted low halves
+    uint64_t* bitmap;  // ROARING_BITMAP_WORDS words
+  } data;
+} roaring_container;
+
+
+typedef struct {
+  roaring_container* containers; // Sorted by key
+  size_t n_containers;
+  size_t cap;
+} roaring;
+
+
+// Callback for roaring_for_each_andnot(); return false to stop early
+typedef bool (*roaring_fn)(uint32_t value, void* ctx);
+
+
+// Initialize an empty bitmap
+void roaring_init(roaring* r);
+
+
+// Free a bitmap's memory
+void roaring_destroy(roaring* r);
+
+
+// Add a value
+// Return value: False if out of memory
+bool roaring_add(roaring* r, uint32_t value);
+
+
+// Remove a value (no-op if absent)
+void roaring_remove(roaring* r, uint32_t value);
+
+
+// Membership test
+bool roaring_contains(roaring const* r, uint32_t value);
+
+
+// Number of values
+size_t roaring_cardinality(roaring const* r);
+
+
+// Size of the intersection of two bitmaps, without materializing it
+size_t roaring_and_cardinality(roaring const* a, roaring const* b);
+
+
+// Visit the values of 'a' that aren't in 'b' (or all of them, if 'b' is
+// NULL), in increasing order
+void roaring_for_each_andnot(roaring const* a, roaring const* b,
+  roaring_fn fn, void* ctx);
+
+
+#endif // ROARING_H
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "seqstate.h"
+
+
+bool seqstate_open(seqstate* s, char const* filename, size_t n_clients) {
+  struct stat st;
+  seqstate_header* hdr;
+
+
+  memset(s, 0, sizeof(seqstate));
+  s->map = MAP_FAILED;
+  s->n_clients = n_clients;
+  s->map_len = CACHE_LINE + n_clients * sizeof(seq_slot);
+
+  if ((s->fd = open(filename, O_RDWR | O_CREAT, 0644)) == -1
+      || fstat(s->fd, &st) == -1) {
+    perror("seqstate_open: Couldn't open sequence table");
+    goto fail;
+  }
+
+
+  // Anything but our exact layout starts over from zero
+  if ((size_t)st.st_size != s->map_len
+      && (ftruncate(s->fd, 0) == -1 || ftruncate(s->fd, s->map_len) == -1)) {
+    perror("seqstate_open: Couldn't size sequence table");
+    goto fail;
+  }
+
+  if ((s->map = mmap(NULL, s->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+        s->fd, 0)) == MAP_FAILED) {
+    perror("seqstate_open: Couldn't map sequence table");
+    goto fail;
+  }
+
+  hdr = (seqstate_header*)s->map;
+  s->windows = (seq_slot*)((uint8_t*)s->map + CACHE_LINE);
+  s->restored = memcmp(hdr->magic, SEQSTATE_MAGIC, sizeof(hdr->magic)) == 0
+    && hdr->version == SEQSTATE_VERSION && hdr->n_clients == n_clients;
+
+  if (!s->restored) {
+    memset(s->windows, 0, n_clients * sizeof(seq_slot));
+    hdr->version = SEQSTATE_VERSION;
+    hdr->n_clients = n_clients;
+    memcpy(hdr->magic, SEQSTATE_MAGIC, sizeof(hdr->magic));
+  }
+
+
+  return true;
+
+
+fail:
+  seqstate_close(s);
+  return false;
+}
+
+
+void seqstate_close(seqstate* s) {
+  if (s->map != MAP_FAILED && s->map) {
+    munmap(s->map, s->map_len);
+  }
+  if (s->fd != -1) {
+    close(s->fd);
+  }
+
+  s->map = NULL;
+  s->windows = NULL;
+  s->fd = -1;
+}
+
+
+int seq_window_accept(seq_window* w, sequence_num seq) {
+  uint64_t seen = __atomic_load_n(&w->state, __ATOMIC_ACQUIRE);
+  uint64_t received;
+  uint64_t state;
+  sequence_num next;
+  sequence_num ahead;
+  unsigned slide;
+
+
+  do {
+    next = seen & 0xFF;
+    received = seen >> 8;
+    ahead = seq - next; // Modulo 256
+
+    if (ahead >= SEQ_WINDOW) {
+      return ahead < urange(sequence_num) / 2 ? OUT_OF_SEQ : DUP_PACK;
+    }
+    if ((received >> ahead) & 1) {
+      return DUP_PACK;
+    }
+
+    // Mark it, then slide past every number received in a row from the
+    // start
+    received |= 1ULL << ahead;
+    slide = __builtin_ctzll(~received); // Bit SEQ_WINDOW is always clear
+    received >>= slide;
+    next += slide;
+    state = received << 8 | next;
+
+    // Lost a race if the window changed since it was read; look again
+  } while (!__atomic_compare_exchange_n(&w->state, &seen, state, false,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+
+  return 0;
+}
+
+
+void seq_window_read(seq_window const* w, sequence_num* next,
+  uint64_t* received) {
+  uint64_t state = __atomic_load_n(&w->state, __ATOMIC_ACQUIRE);
+
+
+  *next = state & 0xFF;
+  *received = state >> 8;
+}
@@ -0,0 +1,100 @@
+#ifndef SEQSTATE_H
+#define SEQSTATE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "packet.h"
+
+
+// The server's per-client sequence table, kept in a small file mapped
+// MAP_SHARED, so a restarted server picks up where the last one left off
+// and clients don't see a burst of OUT_OF_SEQ/DUP_PACK rejects. Updates are
+// plain stores into the mapping; the kernel writes the page back, so the
+// state survives the process dying (not the machine).
+//
+// Each client has a receive window of SEQ_WINDOW sequence numbers, starting
+// at the oldest one not yet received, so it can pipeline requests: any new
+// number in the window is accepted, in any order, and the window slides on
+// once the ones before it have arrived. Distances are taken modulo 256;
+// numbers up to half the sequence space ahead of the window are OUT_OF_SEQ,
+// the rest are behind it, and DUP_PACK.
+//
+// A window is one 64-bit word, so any number of threads can claim sequence
+// numbers with compare-and-swap and no locks: a number is accepted by
+// exactly one of them. The flat table pads each window to a cache line, so
+// threads serving different clients don't share lines.
+
+
+#define SEQSTATE_MAGIC "SEQSTATE"
+#define SEQSTATE_VERSION 3
+#define SEQ_WINDOW 56 // Requests a client may have in flight; the bitmap
+                      // shares a word with 'next'
+#define CACHE_LINE 64
+
+
+// A client's receive window
+typedef struct {
+  uint64_t state;      // Low byte: oldest sequence number not yet received
+                       // ('next'); bit 8 + i set: next + i has arrived
+  uint8_t unacked;     // Accepted since the client's last CUM_ACK (see
+                       // ackbatch.h); meaningless across restarts; not
+                       // thread-safe
+} seq_window;
+
+
+// A window alone on its cache line
+typedef union {
+  seq_window win;
+  uint8_t pad[CACHE_LINE];
+} __attribute__((aligned(CACHE_LINE))) seq_slot;
+
+
+// On-disk layout: this header, padded to a cache line, then one seq_slot
+// per client ID
+typedef struct {
+  char magic[8];       // SEQSTATE_MAGIC, without the terminator
+  uint32_t version;    // SEQSTATE_VERSION
+  uint32_t n_clients;  // Entries following the header
+} seqstate_header;
+
+
+typedef struct {
+  int fd;
+  void* map;
+  size_t map_len;
+  seq_slot* windows;   // Per client ID
+  size_t n_clients;
+  bool restored;       // The file held a valid table when opened
+} seqstate;
+
+
+// Open (or create) a sequence table file; a missing, truncated or foreign
+// file is (re)initialized to all zeroes
+// Return value: True if OK, false on I/O errors
+bool seqstate_open(seqstate* s, char const* filename, size_t n_clients);
+
+
+// Unmap and close; the table stays in the file
+void seqstate_close(seqstate* s);
+
+
+// Check a sequence number against a window and, if it's new and in the
+// window, mark it received; atomic
+// Return value: 0 if it was accepted; OUT_OF_SEQ if it's ahead of the window,
+// or DUP_PACK if it has arrived before
+int seq_window_accept(seq_window* w, sequence_num seq);
+
+
+// Read a window atomically
+// Args:
+//   next - Set to the oldest sequence number not yet received
+//   received - Set to the numbers after it that have arrived (bit i:
+//     next + i; bit 0 never is)
+void seq_window_read(seq_window const* w, sequence_num* next,
+  uint64_t* received);
+
+
+#endif // SEQSTATE_H
@@ -5,187 +5,1571 @@
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <unistd.h>
 #include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 
 #include "server.h"
 #include "packet.h"
 #include "database.h"
 #include "raw_iterator.h"
+#include "shard.h"
+#include "btree.h"
+#include "uring.h"
+#include "subtable.h"
+#include "verdict_cache.h"
+#include "tech_index.h"
+#include "tail.h"
+#include "repl.h"
+#include "hashring.h"
+#include "watch.h"
+#include "seqstate.h"
+#include "handoff.h"
+#include "prefilter.h"
+#include "reuseport.h"
 
 
-bool server_init(server* serv, struct sockaddr_in* addr, char const* filename) {
+// Size of what a forwarding node appends to the request's payload: the
+// client's address and port, in network order
+#define FWD_TRAILER_LEN (sizeof(in_addr_t) + sizeof(in_port_t))
+
+#define LOAD_TICK_MS 100 // How soon a failed background load is noticed
+
+
+static volatile sig_atomic_t stats_requested = 0; // Set by SIGUSR1
+static volatile sig_atomic_t delta_requested = 0; // Set by SIGHUP
+
+
+// Signal handler; the dump itself happens in server_run()
+static void request_stats(int signum) {
+  (void)signum;
+  stats_requested = 1;
+}
+
+
+// Signal handler; the delta is applied in server_run()
+static void request_delta(int signum) {
+  (void)signum;
+  delta_requested = 1;
+}
+
+
+// Helper; whether a subscriber is ours to serve
+static bool server_owns(server const* serv, subscriber_num num) {
+  return !serv->cluster || hash_ring_owner(serv->cluster, num) == serv->self;
+}
+
+
+// Helper; stream a text database into 'db', and into the partial table (if
+// there is one) so that rows can be served as soon as they're read. In a
+// cluster, other nodes' rows are skipped, so only our partition counts
+// against MAX_ENTRIES; they're counted into 'n_not_owned', not into 'serv',
+// as this may run on the loader thread.
+static bool stream_database_file(server* serv, char const* filename,
+  database* db, size_t* n_not_owned) {
+  FILE* fp = fopen(filename, "r");
+  char* line = NULL; // Buffer for getline()
+  size_t line_cap = 0;
+  ssize_t line_len;
+  bool ok = true;
+
+
+  if (!fp) {
+    perror("server_load_text: Couldn't open database");
+    return false;
+  }
+
+  while (ok && (line_len = getline(&line, &line_cap, fp)) != -1) {
+    client_info entry;
+
+    if (parse_database_line(line, line_len, &entry) != (size_t)line_len) {
+      fprintf(stderr, "server_load_text: Malformed record: %s", line);
+      ok = false;
+    } else if (!server_owns(serv, entry.number)) {
+      ++*n_not_owned;
+    } else if (db->n_filled >= MAX_ENTRIES) {
+      fprintf(stderr, "server_load_text: database too large!\n");
+      ok = false;
+    } else {
+      db->entries[db->n_filled++] = entry;
+      if (serv->partial.slots) {
+        subtable_upsert(&serv->partial, &entry);
+      }
+    }
+  }
+
+  free(line);
+  fclose(fp);
+
+
+  if (ok) {
+    database_sort(db);
+  }
+
+
+  return ok;
+}
+
+
+// Helper; build the derived indexes over a sorted database and make it the
+// one requests are served from, with the count of rows left to other nodes
+// that came with it. Takes ownership of 'db'. May run on the
+// loader thread: nothing is stored into 'serv' until the publishing store
+// of 'loading', and the event loop reads db, shards and techs only once it
+// has seen 'loading' false.
+static bool server_publish_db(server* serv, database* db,
+  size_t n_not_owned) {
+  server_config const* config = &serv->config;
+  shard_set shards;
+  tech_index* techs = NULL;
+
+
+  // Move the database next to us if asked; parsing may have run anywhere
+  if (config->numa_local) {
+    database* replica = database_replicate(db, -1, config->db_flags);
+
+    if (replica) {
+      database_delete(db);
+      db = replica;
+      fprintf(stderr, "server_publish_db: Database replicated to node %d\n",
+        database_current_node());
+    }
+  }
+
+
+  // A shard per worker if asked; the first worker steers requests by key
+  // once it knows the ranges, and the others split the same database the
+  // same way
+  memset(&shards, 0, sizeof(shards));
+  if (config->shard_workers) {
+    subscriber_num bounds[MAX_SHARDS];
+
+    if (!shard_set_init(&shards, db, config->n_workers, serv->worker,
+          serv->shard_load)) {
+      fprintf(stderr, "server_publish_db: Couldn't shard database!\n");
+      database_delete(db);
+      return false;
+    }
+
+    for (size_t i = 0; i < shards.n_shards; ++i) {
+      bounds[i] = shards.shards[i].lo;
+    }
+
+    if (serv->worker == 0 && !reuseport_steer_by_key(serv->sock_fd,
+          config->n_workers, bounds, shards.n_shards)) {
+      goto fail;
+    }
+  }
+
+
+  // Per-tech bitmaps if asked
+  if (config->tech_index) {
+    if ((techs = malloc(sizeof(tech_index))) == NULL) {
+      fprintf(stderr, "server_publish_db: Out of memory!\n");
+      goto fail;
+    }
+
+    tech_index_init(techs);
+    if (!tech_index_build(techs, db)) {
+      tech_index_destroy(techs);
+      free(techs);
+      goto fail;
+    }
+  }
+
+
+  // Publish; everything above must be visible before 'loading' reads false
+  serv->shards = shards;
+  serv->techs = techs;
+  serv->n_not_owned = n_not_owned;
+  serv->db = db;
+  __atomic_store_n(&serv->loading, false, __ATOMIC_RELEASE);
+
+
+  return true;
+
+
+fail:
+  if (shards.n_shards > 0) {
+    shard_set_destroy(&shards);
+  }
+  database_delete(db);
+  return false;
+}
+
+
+// Helper; build the in-memory index from a text database and publish it
+// Args:
+//   streaming - Read rows through the partial table (for background loads)
+//   instead of the all-at-once mpc parse; cluster nodes always stream, to
+//   filter rows as they're read
+static bool server_load_text(server* serv, char const* filename,
+  bool streaming) {
+  server_config const* config = &serv->config;
+  database* db = database_new(config->db_flags);
+  size_t n_not_owned = 0;
+
+
+  if (!db) {
+    fprintf(stderr, "server_load_text: Couldn't allocate database!\n");
+    return false;
+  }
+
+  if (!(streaming || serv->cluster
+        ? stream_database_file(serv, filename, db, &n_not_owned)
+        : parse_database_file(filename, db))) {
+    fprintf(stderr, "server_load_text: Couldn't initialize database!\n"); 
+    database_delete(db);
+    return false;
+  }
+
+
+  return server_publish_db(serv, db, n_not_owned);
+}
+
+
+// Loader thread for background loads
+static void* server_load_thread(void* arg) {
+  server* serv = (server*)arg;
+
+
+  // The event loop stops on a failed load rather than answer TRY_LATER
+  // forever
+  if (server_load_text(serv, serv->db_filename, true)) {
+    fprintf(stderr, "server_load_thread: Switched to the full index\n");
+  } else {
+    fprintf(stderr, "server_load_thread: Load failed!\n");
+    __atomic_store_n(&serv->load_failed, true, __ATOMIC_RELEASE);
+  }
+
+
+  return NULL;
+}
+
+
+// State for server_snapshot()'s walks
+typedef struct {
+  server* serv;
+  repl_emit_fn emit;
+  void* emit_ctx;
+} snapshot_walk;
+
+
+// Helper; whether a row is in the loaded index, ignoring the overlay; safe
+// to call from other threads
+static bool server_in_base(server const* serv, subscriber_num num) {
+  client_info entry;
+
+
+  return serv->use_disk_db ? btree_lookup(&serv->disk_db, num, &entry)
+    : lookup(serv->db, num) != NULL;
+}
+
+
+// Helper; emit a row of the loaded index, as changed by the overlay
+static bool server_snapshot_base_row(client_info const* entry, void* ctx) {
+  snapshot_walk* walk = (snapshot_walk*)ctx;
+  client_info changed;
+
+
+  switch (subtable_lookup(&walk->serv->overlay, entry->number, &changed)) {
+    case SUBTABLE_DELETED:
+      return true;
+    case SUBTABLE_LIVE:
+      return walk->emit(&changed, walk->emit_ctx);
+    default:
+      return walk->emit(entry, walk->emit_ctx);
+  }
+}
+
+
+// Helper; emit an overlay row that the walk over the loaded index didn't
+static bool server_snapshot_overlay_row(subtable_state state,
+  client_info const* entry, void* ctx) {
+  snapshot_walk* walk = (snapshot_walk*)ctx;
+
+
+  if (state != SUBTABLE_LIVE || server_in_base(walk->serv, entry->number)) {
+    return true;
+  }
+
+
+  return walk->emit(entry, walk->emit_ctx);
+}
+
+
+// Snapshot for replicas; runs on a replication thread, and only reads the
+// loaded index (immutable once published) and the lock-free overlay
+static bool server_snapshot(void* ctx, repl_emit_fn emit, void* emit_ctx) {
+  snapshot_walk walk = { (server*)ctx, emit, emit_ctx };
+  server* serv = walk.serv;
+
+
+  if (serv->use_disk_db) {
+    if (!btree_for_each(&serv->disk_db, &server_snapshot_base_row, &walk)) {
+      return false;
+    }
+  } else {
+    for (size_t i = 0; i < serv->db->n_filled; ++i) {
+      if (!server_snapshot_base_row(&serv->db->entries[i], &walk)) {
+        return false;
+      }
+    }
+  }
+
+
+  return subtable_for_each(&serv->overlay, &server_snapshot_overlay_row,
+    &walk);
+}
+
+
+// State for server_resync()'s walk
+typedef struct {
+  server* serv;
+  database const* snapshot;
+  size_t n_changed;
+} resync_walk;
+
+
+// Helper; a row as it's served: the overlay's change if any, else the
+// loaded index's
+static bool server_current_row(server const* serv, subscriber_num num,
+  client_info* out) {
+  client_info* entry;
+
+
+  switch (subtable_lookup(&serv->overlay, num, out)) {
+    case SUBTABLE_LIVE:
+      return true;
+    case SUBTABLE_DELETED:
+      return false;
+    default:
+      break;
+  }
+
+  if (serv->use_disk_db) {
+    return btree_lookup(&serv->disk_db, num, out);
+  }
+
+  if ((entry = lookup(serv->db, num)) != NULL) {
+    *out = *entry;
+  }
+
+
+  return entry != NULL;
+}
+
+
+// Helper; delete a served row the new snapshot doesn't have
+static bool server_resync_gone(client_info const* entry, void* ctx) {
+  resync_walk* walk = (resync_walk*)ctx;
+
+
+  if (lookup(walk->snapshot, entry->number)) {
+    return true;
+  }
+
+  ++walk->n_changed;
+
+
+  return server_apply_update(walk->serv, entry, true);
+}
+
+
+// Helper; bring what's served in line with a snapshot taken after the first
+// one was published (our primary couldn't resume us). Only rows that differ
+// are applied, through server_apply_update() like any other change, so
+// subscribers, the derived indexes and our own replicas hear of them; they
+// count against the overlay's capacity. Takes ownership of 'snapshot'.
+static bool server_resync(server* serv, database* snapshot) {
+  resync_walk walk = { serv, snapshot, 0 };
+  bool ok = server_snapshot(serv, &server_resync_gone, &walk);
+
+
+  for (size_t i = 0; ok && i < snapshot->n_filled; ++i) {
+    client_info const* entry = &snapshot->entries[i];
+    client_info current;
+
+    if (!server_current_row(serv, entry->number, &current)
+        || current.ttype != entry->ttype || current.paid != entry->paid) {
+      ++walk.n_changed;
+      ok = server_apply_update(serv, entry, false);
+    }
+  }
+
+  database_delete(snapshot);
+
+  fprintf(stderr, "server_apply_repl: Resynced with a new snapshot; %lu "
+    "rows differed\n", walk.n_changed);
+
+
+  return ok;
+}
+
+
+// Apply a message from our primary; the first snapshot is collected like a
+// background load, and published once complete; later ones are collected
+// on the side and applied as changes
+static bool server_apply_repl(repl_msg_type type, delta_op op,
+  client_info const* entry, void* ctx) {
+  server* serv = (server*)ctx;
+  database* db = serv->repl_db;
+
+
+  switch (type) {
+    case REPL_SNAPSHOT_BEGIN:
+      if (!db && (db = serv->repl_db = database_new(serv->config.db_flags))
+          == NULL) {
+        fprintf(stderr, "server_apply_repl: Couldn't allocate database!\n");
+        return false;
+      }
+      db->n_filled = 0;
+      return true;
+
+    case REPL_SNAPSHOT_ROW:
+      if (!db || db->n_filled >= MAX_ENTRIES) {
+        fprintf(stderr, "server_apply_repl: Snapshot too large!\n");
+        return false;
+      }
+      db->entries[db->n_filled++] = *entry;
+      if (serv->partial.slots) {
+        subtable_upsert(&serv->partial, entry);
+      }
+      return true;
+
+    case REPL_SNAPSHOT_END:
+      if (!db) {
+        return false;
+      }
+      serv->repl_db = NULL;
+      database_sort(db);
+      return serv->db ? server_resync(serv, db)
+        : server_publish_db(serv, db, 0);
+
+    default:
+      return server_apply_update(serv, entry, op == DELTA_DELETE);
+  }
+}
+
+
+// Helper; receive the state of the server we replace, and serve on its
+// socket. The database and replication listener are handed back for later;
+// either is -1 if it wasn't sent.
+static bool server_take_over(server* serv, char const* path,
+  handoff_header* hdr, int* db_fd, int* repl_fd, void** body) {
+  int fds[HANDOFF_MAX_FDS];
+  size_t n_fds;
+  size_t n_expected;
+  socklen_t addrlen = sizeof(serv->addr);
+
+
+  if (!handoff_receive(path, hdr, fds, &n_fds, body)) {
+    return false;
+  }
+
+  n_expected = 1 + !!(hdr->flags & HANDOFF_HAS_DB)
+    + !!(hdr->flags & HANDOFF_HAS_REPL);
+  if (n_fds != n_expected || hdr->body_len != hdr->n_clients
+        * sizeof(seq_slot) + hdr->n_overlay * sizeof(delta_record)) {
+    fprintf(stderr, "server_init: Handoff doesn't add up\n");
+    for (size_t i = 0; i < n_fds; ++i) {
+      close(fds[i]);
+    }
+    free(*body);
+    return false;
+  }
+
+  serv->sock_fd = fds[0];
+  *db_fd = hdr->flags & HANDOFF_HAS_DB ? fds[1] : -1;
+  *repl_fd = hdr->flags & HANDOFF_HAS_REPL ? fds[n_fds - 1] : -1;
+
+  if (getsockname(serv->sock_fd, (struct sockaddr*)&serv->addr, &addrlen)
+      == -1) {
+    perror("server_init: Handed-over socket is unusable");
+    return false;
+  }
+
+  fprintf(stderr, "server_init: Took over from %s: socket, %s%s%u changed "
+    "rows\n", path, *db_fd != -1 ? "database, " : "",
+    *repl_fd != -1 ? "replication listener, " : "", hdr->n_overlay);
+
+
+  return true;
+}
+
+
+// Helper; apply the changed rows of a handoff body
+static void server_apply_taken_overlay(server* serv, handoff_header const* hdr,
+  void const* body) {
+  delta_record const* recs = (delta_record const*)((uint8_t const*)body
+    + hdr->n_clients * sizeof(seq_slot));
+
+
+  for (size_t i = 0; i < hdr->n_overlay; ++i) {
+    delta_record rec;
+    delta_op op;
+    client_info entry;
+
+    memcpy(&rec, &recs[i], sizeof(rec)); // May be unaligned
+    if (delta_decode(&rec, &op, &entry)) {
+      server_apply_update(serv, &entry, op == DELTA_DELETE);
+    }
+  }
+}
+
+
+// Helper; fork a worker for each of the 'n' sockets but the first, which
+// this process keeps, and leave each process only its own socket
+static bool server_fork_workers(server* serv, int const* fds, size_t n) {
+  pid_t parent = getpid();
+
+
+  serv->worker = 0;
+  for (size_t i = 1; i < n; ++i) {
+    pid_t pid = fork();
+
+    if (pid == -1) {
+      perror("server_init: Couldn't fork worker");
+      return false; // Workers forked so far go with us
+    }
+
+    if (pid == 0) {
+      // Don't outlive the first worker, even if it died before we got here
+      if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1 || getppid() != parent) {
+        _exit(1);
+      }
+      serv->worker = i;
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    if (i != serv->worker) {
+      close(fds[i]);
+    }
+  }
+  serv->sock_fd = fds[serv->worker];
+
+  fprintf(stderr, "server_init: Worker %lu of %lu, pid %d\n",
+    serv->worker + 1, n, (int)getpid());
+
+
+  return true;
+}
+
+
+bool server_init(server* serv, struct sockaddr_in* addr, char const* filename,
+  server_config const* config) {
   char ip_str[INET_ADDRSTRLEN]; // For printing info
+  server_config defaults; // Used if no config was given
+  handoff_header taken; // State taken over from the server we replace...
+  int taken_db_fd = -1; // ...its database...
+  int taken_repl_fd = -1; // ...replication listener...
+  void* taken_body = NULL; // ...sequence table and changed rows
+
+
+  if (config == NULL) {
+    memset(&defaults, 0, sizeof(defaults));
+    config = &defaults;
+  }
+
+
+  fprintf(stderr, "server_init: Initializing server...\n");
+
+  if (config->n_workers > 1 && (config->takeover_path
+        || config->handoff_path || config->repl_port || config->seq_file)) {
+    fprintf(stderr, "server_init: Workers can't hand off, take over, serve "
+      "replicas or keep a sequence file!\n");
+    return false;
+  }
+
+  if (config->shard_workers && config->n_workers < 2) {
+    fprintf(stderr, "server_init: Shards go to workers; need at least 2!\n");
+    return false;
+  }
+
+
+  // Setup a socket, or take over the one of the server we replace
+  serv->worker = 0;
+  if (config->takeover_path) {
+    if (!server_take_over(serv, config->takeover_path, &taken, &taken_db_fd,
+          &taken_repl_fd, &taken_body)) {
+      return false;
+    }
+  } else {
+    // Fill in with default address if needed
+    if (addr == NULL) {
+      memset(&serv->addr, 0, sizeof(serv->addr));
+      serv->addr.sin_family = AF_INET;
+      serv->addr.sin_addr.s_addr = htonl(INADDR_ANY);
+      serv->addr.sin_port = htons(DEFAULT_PORT);
+    } else {
+      memcpy(&serv->addr, addr, sizeof(struct sockaddr_in));
+    }
+
+
+    // Several workers share the port, each getting its clients' packets;
+    // otherwise bind the socket
+    if (config->n_workers > 1) {
+      int fds[REUSEPORT_MAX_WORKERS];
+
+      // Workers steered by key share narrow clients, so those clients'
+      // windows and the shards' load are mapped for all of them to see
+      if (config->shard_workers) {
+        serv->windows = mmap(NULL, sizeof(serv->local_windows),
+          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (serv->windows == MAP_FAILED) {
+          perror("server_init: Couldn't map shared windows");
+          return false;
+        }
+
+        if ((serv->shard_load = shard_load_map()) == NULL) {
+          return false;
+        }
+      }
+
+      if (!reuseport_open(&serv->addr, config->n_workers, fds)
+          || !server_fork_workers(serv, fds, config->n_workers)) {
+        return false;
+      }
+    } else {
+      if ((serv->sock_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("server_init: Couldn't create socket");
+        return false;
+      }
+
+      if ((bind(serv->sock_fd, (struct sockaddr*)&serv->addr,
+            sizeof(struct sockaddr_in)) == -1)) {
+        perror("server_init: Couldn't bind socket to address");
+        return false;
+      }
+    }
+  }
+
+
+  // Junk is dropped before it wakes us up
+  if (config->prefilter && !prefilter_attach(serv->sock_fd)) {
+    return false;
+  }
+
+
+  // Kernel receive timestamps, to tell how long requests queued
+  serv->n_shed = 0;
+  serv->max_queued_ns = 0;
+  serv->timestamps = config->deadline_ms > 0 || config->slow_delay_ms > 0;
+  if (serv->timestamps && setsockopt(serv->sock_fd, SOL_SOCKET,
+        SO_TIMESTAMPNS, &(int){ 1 }, sizeof(int)) == -1) {
+    perror("server_init: Couldn't enable receive timestamps");
+    return false;
+  }
+
+
+  // Initialize next expected sequence numbers, carrying them over from the
+  // last run if asked
+  serv->seq_state.fd = -1;
+  if (config->seq_file) {
+    if (!seqstate_open(&serv->seq_state, config->seq_file,
+          NARROW_CLIENT_IDS)) {
+      return false;
+    }
+
+    serv->windows = serv->seq_state.windows;
+    fprintf(stderr, "server_init: Sequence numbers %s %s\n",
+      serv->seq_state.restored ? "restored from" : "starting over in",
+      config->seq_file);
+  } else if (!config->shard_workers) {
+    serv->windows = serv->local_windows;
+    memset(serv->windows, 0, sizeof(serv->local_windows));
+  }
+
+  // The server we replace knows better than any file
+  if (taken_body && taken.n_clients == NARROW_CLIENT_IDS) {
+    memcpy(serv->windows, taken_body, sizeof(serv->local_windows));
+  }
+
+  // Windows carried over can't have ACKs pending here
+  for (size_t i = 0; i < NARROW_CLIENT_IDS; ++i) {
+    serv->windows[i].win.unacked = 0;
+  }
+
+  // Wide client IDs get sessions as they show up
+  if (!session_init(&serv->sessions, config->session_capacity > 0
+        ? config->session_capacity : DEFAULT_SESSION_CAPACITY,
+        config->session_idle_sec)) {
+    return false;
+  }
+
+
+  // Join the cluster, if any, before loading, so the load can skip rows
+  // that aren't ours
+  serv->cluster = NULL;
+  serv->n_not_owned = serv->n_forwarded = serv->n_fwd_served = 0;
+
+  if (config->ring_file) {
+    int self;
 
+    if ((serv->cluster = malloc(sizeof(hash_ring))) == NULL
+        || !hash_ring_load(serv->cluster, config->ring_file)) {
+      fprintf(stderr, "server_init: Couldn't load cluster ring!\n");
+      return false;
+    }
+
+    self = config->ring_self > 0 ? (int)config->ring_self - 1
+      : hash_ring_find_port(serv->cluster, ntohs(serv->addr.sin_port));
+    if (self < 0 || (size_t)self >= serv->cluster->n_nodes) {
+      fprintf(stderr, "server_init: We're not a node of %s!\n",
+        config->ring_file);
+      return false;
+    }
+
+    serv->self = self;
+  }
+
+
+  // Read in database; B+tree files are mapped rather than read in, and text
+  // files may be loaded in the background while we already serve
+  serv->config = *config;
+  serv->db = NULL;
+  serv->techs = NULL;
+  serv->partial.slots = NULL;
+  serv->loading = false;
+  serv->load_failed = false;
+  memset(&serv->shards, 0, sizeof(serv->shards));
+  serv->tail.inotify_fd = serv->tail.fd = -1;
+  serv->primary = NULL;
+  serv->replica = NULL;
+  serv->repl_db = NULL;
+  serv->use_disk_db = filename && btree_is_file(filename);
+
+  // Start following before loading, so rows appended meanwhile aren't
+  // missed; the ones the load reads as well are just applied twice
+  if (config->follow) {
+    if (serv->use_disk_db || !filename) {
+      fprintf(stderr, "server_init: Can only follow a text database\n");
+    } else if (!tailer_open(&serv->tail, filename)) {
+      return false;
+    } else if (taken_body && taken.tail_offset > 0
+        && (off_t)taken.tail_offset <= serv->tail.offset) {
+      // Pick up where the server we replace stopped reading
+      serv->tail.offset = taken.tail_offset;
+      serv->tail.realign = false;
+    }
+  }
+
+  if (config->replica) {
+    // The snapshot streams in like a background load
+    if (!subtable_init(&serv->partial, MAX_ENTRIES)
+        || (serv->repl_db = database_new(config->db_flags)) == NULL) {
+      fprintf(stderr, "server_init: Couldn't allocate database!\n");
+      return false;
+    }
+
+    serv->loading = true;
+  } else if (taken_db_fd != -1 && !serv->use_disk_db) {
+    // Handed over; the pages stay shared with the old server's copy
+    database* db = database_import(taken_db_fd);
+
+    if (!db || !server_publish_db(serv, db, 0)) {
+      fprintf(stderr, "server_init: Couldn't use the handed-over "
+        "database!\n");
+      return false;
+    }
+
+    fprintf(stderr, "server_init: Took over a database of %lu entries\n",
+      db->n_filled);
+  } else if (serv->use_disk_db) {
+    if (!btree_open(&serv->disk_db, filename)) {
+      fprintf(stderr, "server_init: Couldn't open B+tree database!\n");
+      return false;
+    }
+
+    if (config->shard_workers) {
+      fprintf(stderr, "server_init: Can't shard a B+tree database\n");
+    }
+
+    if (serv->cluster) {
+      fprintf(stderr, "server_init: Serving the whole B+tree; only text "
+        "databases are partitioned\n");
+    }
+
+    // One pass over the leaves; afterwards verdicts need no disk access
+    if (config->tech_index) {
+      if ((serv->techs = malloc(sizeof(tech_index))) == NULL) {
+        fprintf(stderr, "server_init: Out of memory!\n");
+        return false;
+      }
+
+      tech_index_init(serv->techs);
+      if (!tech_index_build_btree(serv->techs, &serv->disk_db)) {
+        return false;
+      }
+    }
+  } else if (config->background_load) {
+    if (!subtable_init(&serv->partial, MAX_ENTRIES)) {
+      return false;
+    }
+
+    serv->db_filename = filename;
+    serv->loading = true;
+
+    if ((errno = pthread_create(&serv->loader, NULL, &server_load_thread,
+          serv)) != 0) {
+      perror("server_init: Couldn't start loader thread");
+      return false;
+    }
+  } else if (!server_load_text(serv, filename, false)) {
+    return false;
+  }
+
+
+  // Rows changed after load
+  serv->n_updates = 0;
+  if (!subtable_init(&serv->overlay, config->overlay_capacity > 0
+        ? config->overlay_capacity : DEFAULT_OVERLAY_CAPACITY)) {
+    return false;
+  }
+
+
+  // Recent verdicts, for narrow IDs and then every session
+  serv->replies = NULL;
+  serv->reply_slot = REPLY_NONE;
+  if (config->reply_depth > 0
+      && ((serv->replies = malloc(sizeof(reply_cache))) == NULL
+        || !reply_cache_init(serv->replies,
+          NARROW_CLIENT_IDS + serv->sessions.capacity, config->reply_depth))) {
+    fprintf(stderr, "server_init: Couldn't allocate reply cache!\n");
+    return false;
+  }
+
+
+  // Rate limits, numbering clients like the reply cache
+  serv->limits = NULL;
+  serv->throttled = false;
+  if ((config->client_rate > 0 || config->subnet_rate > 0)
+      && ((serv->limits = malloc(sizeof(rate_limit))) == NULL
+        || !rate_limit_init(serv->limits,
+          NARROW_CLIENT_IDS + serv->sessions.capacity, config->client_rate,
+          config->subnet_rate, config->rate_burst))) {
+    fprintf(stderr, "server_init: Couldn't set up rate limits!\n");
+    return false;
+  }
+
+
+  // Backpressure, numbering clients like the reply cache
+  serv->pressure = NULL;
+  if ((config->slow_delay_ms > 0 || config->slow_queue_pct > 0)
+      && ((serv->pressure = malloc(sizeof(backpressure))) == NULL
+        || !backpressure_init(serv->pressure, serv->sock_fd,
+          NARROW_CLIENT_IDS + serv->sessions.capacity, config->slow_delay_ms,
+          config->slow_queue_pct, config->slow_interval_us))) {
+    fprintf(stderr, "server_init: Couldn't set up backpressure!\n");
+    return false;
+  }
+
+
+  // Delayed ACKs
+  serv->acks = NULL;
+  if (config->ack_delay_us > 0) {
+    if ((serv->acks = malloc(sizeof(ack_batch))) == NULL) {
+      fprintf(stderr, "server_init: Out of memory!\n");
+      return false;
+    }
+    ack_batch_init(serv->acks, serv->sock_fd, config->ack_delay_us);
+  }
+
+
+  // Subscriptions to invalidations
+  serv->watches = NULL;
+  if (config->watch_capacity > 0
+      && ((serv->watches = malloc(sizeof(watch_table))) == NULL
+        || !watch_init(serv->watches, config->watch_capacity,
+          serv->sock_fd))) {
+    fprintf(stderr, "server_init: Couldn't allocate subscriptions!\n");
+    return false;
+  }
+
+
+  // Front cache
+  if (config->cache_entries > 0
+      && !verdict_cache_init(&serv->cache, config->cache_entries)) {
+    return false;
+  }
+
+
+  // Rows the server we replace had changed since its load; applied before
+  // replication starts, so they aren't logged as new changes
+  if (taken_body) {
+    server_apply_taken_overlay(serv, &taken, taken_body);
+    free(taken_body);
+  }
+  if (taken_db_fd != -1) {
+    close(taken_db_fd);
+  }
+
+
+  // Replication, either way
+  if (config->repl_port > 0
+      && ((serv->primary = malloc(sizeof(repl_primary))) == NULL
+        || !repl_primary_init(serv->primary, config->repl_port,
+          taken_repl_fd, &server_snapshot, serv))) {
+    fprintf(stderr, "server_init: Couldn't serve replicas!\n");
+    return false;
+  }
+
+  if (config->replica) {
+    if ((serv->replica = malloc(sizeof(repl_replica))) == NULL) {
+      fprintf(stderr, "server_init: Out of memory!\n");
+      return false;
+    }
+
+    repl_replica_init(serv->replica, &config->primary_addr);
+  }
+
+
+  // Set up async leaf reads
+  serv->ring.fd = -1;
+  serv->parked = NULL;
+  serv->max_parked = serv->n_parked = 0;
+  serv->n_parked_total = serv->n_park_full = 0;
+
+  if (serv->use_disk_db && config->max_parked > 0) {
+    uint8_t* pages; // Leaf buffers, one per slot
+
+    if (!uring_init(&serv->ring, config->max_parked)) {
+      fprintf(stderr, "server_init: No io_uring; lookups will block\n");
+    } else if ((serv->parked = calloc(config->max_parked, sizeof(parked_req)))
+          == NULL
+        || posix_memalign((void**)&pages, BTREE_PAGE_SIZE,
+          config->max_parked * BTREE_PAGE_SIZE) != 0) {
+      fprintf(stderr, "server_init: Couldn't allocate parking slots!\n");
+      return false;
+    } else {
+      serv->max_parked = config->max_parked;
+      for (size_t i = 0; i < serv->max_parked; ++i) {
+        serv->parked[i].page = pages + i * BTREE_PAGE_SIZE;
+      }
+    }
+  }
+
+
+  // Be ready to hand all this to our own replacement
+  serv->handed_off = false;
+  serv->handoff_fd = -1;
+  if (config->handoff_path
+      && (serv->handoff_fd = handoff_listen(config->handoff_path)) == -1) {
+    return false;
+  }
+
+
+  // Install stats dump handler; no SA_RESTART so that recvfrom() wakes up
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = &request_stats;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+  sa.sa_handler = &request_delta;
+  sigaction(SIGHUP, &sa, NULL);
+
+
+  fprintf(stderr, "Done initializing!\n");
+  fprintf(stderr, "Server IP: %s\n",
+    inet_ntop(AF_INET, &serv->addr.sin_addr, ip_str, INET_ADDRSTRLEN));
+  fprintf(stderr, "Server port: %u\n", ntohs(serv->addr.sin_port));
+
+
+  return true;
+}
+
+
+// Helper; lookup a subscriber in whichever index the server is using
+static bool server_lookup(server* serv, subscriber_num num, client_info* out) {
+  client_info* entry;
+
+
+  if (serv->use_disk_db) {
+    return btree_lookup(&serv->disk_db, num, out);
+  }
+
+  // Our shard's copy is the one in our cache; requests steered here by
+  // client ID may be for anyone's
+  entry = serv->shards.n_shards > 0
+      && shard_owner(&serv->shards, num) == serv->shards.own
+    ? shard_lookup(&serv->shards, num) : lookup(serv->db, num);
+  if (entry) {
+    *out = *entry;
+  }
+
+
+  return entry != NULL;
+}
+
+
+// Helper; forward an access request to the node that owns its subscriber.
+// The FWD packet keeps the client's ID, sequence number and payload, and
+// appends the client's address, so the owner can reply as if it had been
+// asked directly.
+// Return value: True if forwarded, false if the request is ours to serve
+static bool server_forward(server* serv, struct sockaddr_in const* ret,
+  packet_info const* pi) {
+  uint8_t const* req = pi->cont.data_info.payload;
+  uint8_t payload[urange(payload_len)];
+  size_t req_len = pi->cont.data_info.len;
+  subscriber_num num;
+  size_t owner;
+  packet_info fwd_pi;
+
+
+  // Requests too short to name a subscriber, or too long to carry the
+  // trailer, get answered here as usual
+  if (!serv->cluster || req_len < sizeof(tech_type) + sizeof(num)
+      || req_len + FWD_TRAILER_LEN > sizeof(payload) - 1) {
+    return false;
+  }
+
+  memcpy(&num, req + sizeof(tech_type), sizeof(num));
+  if ((owner = hash_ring_owner(serv->cluster, ntohl(num))) == serv->self) {
+    return false;
+  }
+
+
+  memcpy(payload, req, req_len);
+  memcpy(payload + req_len, &ret->sin_addr.s_addr, sizeof(in_addr_t));
+  memcpy(payload + req_len + sizeof(in_addr_t), &ret->sin_port,
+    sizeof(in_port_t));
+
+  fwd_pi.type = FWD;
+  fwd_pi.id = pi->id;
+  fwd_pi.cont.data_info.seq_num = pi->cont.data_info.seq_num;
+  fwd_pi.cont.data_info.len = req_len + FWD_TRAILER_LEN;
+  fwd_pi.cont.data_info.payload = payload;
+
+  size_t flattened_len =
+    flatten(&fwd_pi, serv->send_buf, sizeof(serv->send_buf));
+
+  if (sendto(
+      serv->sock_fd,
+      serv->send_buf,
+      flattened_len,
+      0,
+      (struct sockaddr*)&serv->cluster->nodes[owner].addr,
+      sizeof(struct sockaddr_in)) == -1) {
+    perror("server_forward: Unable to forward request");
+  }
+
+  fprintf(stderr, "server_forward: Forwarded request for %u to node %lu\n",
+    ntohl(num), owner);
+  ++serv->n_forwarded;
+
+
+  return true;
+}
+
+
+// Helper; answer an access request forwarded by another node, replying to
+// the client it came from. Forwarded requests are never forwarded again, so
+// nodes with different rings can't bounce one around; the owner according
+// to the forwarder is the one that answers.
+static void server_serve_forwarded(server* serv, struct sockaddr_in const* from,
+  packet_info const* pi) {
+  uint8_t const* payload = pi->cont.data_info.payload;
+  size_t req_len = pi->cont.data_info.len - FWD_TRAILER_LEN;
+  struct sockaddr_in client;
+  packet_info req_pi = *pi;
+
+
+  // Only cluster nodes may have us reply elsewhere
+  if (!serv->cluster || hash_ring_find(serv->cluster, from) < 0) {
+    fprintf(stderr, "server_serve_forwarded: Forwarded request from a "
+      "stranger; dropped\n");
+    return;
+  }
+
+  memset(&client, 0, sizeof(client));
+  client.sin_family = AF_INET;
+  memcpy(&client.sin_addr.s_addr, payload + req_len, sizeof(in_addr_t));
+  memcpy(&client.sin_port, payload + req_len + sizeof(in_addr_t),
+    sizeof(in_port_t));
+
+  req_pi.type = ACC_PER;
+  req_pi.cont.data_info.len = req_len;
+  ++serv->n_fwd_served;
+
+  server_handle_req(serv, &client, &req_pi);
+}
+
+
+// Helper; take a client's subscriptions, and echo the numbers taken. Other
+// nodes' numbers are left out: changes to their rows are applied there, so
+// we'd never invalidate them.
+static void server_handle_subscribe(server* serv, struct sockaddr_in const* ret,
+  packet_info const* pi) {
+  uint8_t const* payload = pi->cont.data_info.payload;
+  size_t n_nums = pi->cont.data_info.len / sizeof(subscriber_num);
+  subscriber_num taken[SUBSCRIBE_MAX_NUMS]; // Network order
+  size_t n_taken = 0;
+  packet_info reply_pi = *pi;
+
+
+  for (size_t i = 0; serv->watches && i < n_nums; ++i) {
+    subscriber_num num;
+
+    memcpy(&num, payload + i * sizeof(num), sizeof(num));
+    if (server_owns(serv, ntohl(num))
+        && watch_add(serv->watches, ntohl(num), pi->id, ret)) {
+      taken[n_taken++] = num;
+    }
+  }
+
+  fprintf(stderr, "server_handle_subscribe: Took %lu of %lu subscriptions\n",
+    n_taken, n_nums);
+
+
+  reply_pi.cont.data_info.len = n_taken * sizeof(subscriber_num);
+  reply_pi.cont.data_info.payload = taken;
+
+  size_t flattened_len =
+    flatten(&reply_pi, serv->send_buf, sizeof(serv->send_buf));
+
+  if (sendto(
+      serv->sock_fd,
+      serv->send_buf,
+      flattened_len,
+      0,
+      (struct sockaddr*)ret,
+      sizeof(struct sockaddr_in)) == -1) {
+    fprintf(stderr, "server_handle_subscribe: Unable to send reply!\n");
+  }
+}
+
+
+// Helper; send a reply of the given type to an access request
+static void server_send_reply(server* serv, struct sockaddr_in const* ret,
+  packet_info const* pi, packet_type type) {
+  packet_info reply_pi; // Response to client
+
+
+  // We're basically echoing back the request data, so the payload can be
+  // copied from the request
+  reply_pi.type = type;
+  reply_pi.id = pi->id;
+  reply_pi.cont.data_info.seq_num = pi->cont.data_info.seq_num;
+  reply_pi.cont.data_info.len = pi->cont.data_info.len;
+  reply_pi.cont.data_info.payload = pi->cont.data_info.payload;
+
+
+  size_t flattened_len =
+    flatten(&reply_pi, serv->send_buf, sizeof(serv->send_buf));
+
+  // Kept for retransmits of the request
+  if (serv->replies && serv->reply_slot != REPLY_NONE) {
+    reply_cache_put(serv->replies, serv->reply_slot,
+      pi->cont.data_info.seq_num, serv->send_buf, flattened_len);
+  }
+
+
+
+  // Send out the reply
+  if (sendto(
+      serv->sock_fd,
+      serv->send_buf,
+      flattened_len,
+      0,
+      (struct sockaddr*)ret,
+      sizeof(struct sockaddr_in)) == -1) {
+    fprintf(stderr, "server_handle_req: Unable to send reply!\n");
+  } 
+}
+
+
+// Helper; answer a duplicate request with the verdict it got before, if
+// that's kept
+// Return value: True if resent, false if the duplicate is to be rejected
+static bool server_resend_reply(server* serv, struct sockaddr_in const* ret,
+  packet_info const* pi) {
+  cached_reply const* reply;
+
+
+  if (!serv->replies || serv->reply_slot == REPLY_NONE
+      || (reply = reply_cache_get(serv->replies, serv->reply_slot,
+          pi->cont.data_info.seq_num)) == NULL) {
+    return false;
+  }
+
+  fprintf(stderr, "server_run: Resending the verdict for duplicate %u\n",
+    pi->cont.data_info.seq_num);
+
+  if (sendto(serv->sock_fd, reply->data, reply->len, 0,
+        (struct sockaddr const*)ret, sizeof(struct sockaddr_in)) == -1) {
+    perror("server_resend_reply: Unable to send reply");
+  }
+
+
+  return true;
+}
+
+
+// Process a received packet
+void server_process_packet(server* serv, struct sockaddr_in const* ret) {
+  packet_info pi; // For storing interpreted packet
+  int code; // For return value of server_check_packet()
+  seq_window* window; // The client's receive window
+  char ip_str[INET_ADDRSTRLEN]; // For pretty-printing addresses
+
+
+  // Validate
+  code = server_check_packet(serv, ret, &pi, &window);
+
+
+  // Notify of any errors if present
+  if (code == DUP_PACK && server_resend_reply(serv, ret, &pi)) {
+    // Its verdict was lost; it got it again
+
+  } else if (code != 0) {
+    alert_reject(&pi, (reject_code)code);
+    
+    // Reply to client with reject message
+    fprintf(stderr, "server_run: Sending REJECT message\n");
+    server_send_reject(serv, &pi, ret, (reject_code)code);
+
+  } else if (pi.type == FWD) {
+    // Already ACKed by the node the client sent it to
+    server_serve_forwarded(serv, ret, &pi);
+
+  } else if (serv->throttled) {
+    // Over its rate; it's cheapest to say nothing, and the client times out
+    // and sends again. Otherwise it's told to back off and send it again,
+    // without an ACK or a lookup.
+    if (serv->config.rate_reply) {
+      server_send_reply(serv, ret, &pi, BUSY);
+    }
+
+  } else if (!window) {
+    // A new wide client, and every session's taken; it keeps its sequence
+    // number and sends it again once it's backed off
+    fprintf(stderr, "server_run: No room for client %u; busy\n", pi.id);
+    server_send_reply(serv, ret, &pi, BUSY);
+
+  } else { // All is well
+    // FIXME: pretty print sub_num, etc.
+    fprintf(stderr, "server_run: Received message: \"%s\"\n",
+      (char const*)pi.cont.data_info.payload);
+    fprintf(stderr, "server_run: from %s:%u\n", inet_ntop(AF_INET,
+      &ret->sin_addr, ip_str, INET_ADDRSTRLEN), ntohs(ret->sin_port));
+
+
+    // Acknowledge the sequence number, which checking marked received,
+    // now or with the client's next CUM_ACK
+    if (serv->acks) {
+      ack_batch_note(serv->acks, pi.id, ret, window);
+    } else {
+      fprintf(stderr, "server_run: Sending ACK for sequence number %u\n",
+        pi.cont.data_info.seq_num);
+      server_send_ack(serv, pi.id, pi.cont.data_info.seq_num, ret);
+    }
+
+    // Ask it to pace itself if we're falling behind
+    if (serv->pressure) {
+      backpressure_note(serv->pressure, pi.id, serv->reply_slot, ret);
+    }
+
+    
+    // Check database and send the appropriate response, unless another
+    // node's the one to
+    if (pi.type == SUBSCRIBE) {
+      server_handle_subscribe(serv, ret, &pi);
+    } else if (!server_forward(serv, ret, &pi)) {
+      server_handle_req(serv, ret, &pi);
+    }
+  }
+}
+
+
+// Helper; decide the verdict for a lookup result
+// Args:
+//   entry - The subscriber's entry, or NULL if not found
+static packet_type server_verdict(client_info const* entry, tech_type ttype) {
+  if (!entry) {
+    // Subscriber not found
+    fprintf(stderr, "server_handle_req: Subscriber not found!\n");
+    return NOT_EXIST;
+
+  } else if (entry->ttype != ttype) {
+    // Nonexistent tech type
+    fprintf(stderr, "server_handle_req: Subscriber has no access to tech!\n");
+    return NOT_EXIST;
+
+  } else if (!entry->paid) {
+    // Entry's there, but hasn't paid
+    fprintf(stderr, "server_handle_req: Subscriber has not paid!\n");
+    return NOT_PAID;
+
+  } else {
+     // Subscriber granted access
+    fprintf(stderr, "server_handle_req: Subscriber granted access.\n");  
+    return ACC_OK;
+  }
+}
+
+
+// Helper; park a request if its B+tree leaf isn't resident
+// Return value: True if parked (the reply comes later), false if the lookup
+// should be done right away
+static bool server_try_park(server* serv, struct sockaddr_in const* ret,
+  packet_info const* pi, subscriber_num num, tech_type ttype) {
+  unsigned char resident; // From mincore()
+
+
+  if (!serv->use_disk_db || serv->ring.fd == -1) {
+    return false;
+  }
+
+
+  // Resident leaves are cheap; only the page fault case is worth parking
+  uint32_t page_no = btree_leaf_page(&serv->disk_db, num);
+  void* page = (void*)(serv->disk_db.map + (size_t)page_no * BTREE_PAGE_SIZE);
+
+  if (mincore(page, BTREE_PAGE_SIZE, &resident) == 0 && (resident & 1)) {
+    return false;
+  }
+
+
+  // Find a free slot; if there's none, just block on this one
+  size_t slot;
+  for (slot = 0; slot < serv->max_parked && serv->parked[slot].in_use; ++slot);
+
+  if (slot == serv->max_parked) {
+    ++serv->n_park_full;
+    return false;
+  }
+
+
+  parked_req* req = &serv->parked[slot];
+  req->ret = *ret;
+  req->pi = *pi;
+  req->reply_slot = serv->reply_slot;
+  memcpy(req->payload, pi->cont.data_info.payload, pi->cont.data_info.len);
+  req->pi.cont.data_info.payload = req->payload;
+  req->num = num;
+  req->ttype = ttype;
+
+  if (!uring_submit_read(&serv->ring, serv->disk_db.fd, req->page,
+        BTREE_PAGE_SIZE, (off_t)page_no * BTREE_PAGE_SIZE, slot)) {
+    return false;
+  }
+
+  req->in_use = true;
+  ++serv->n_parked;
+  ++serv->n_parked_total;
+  fprintf(stderr, "server_handle_req: Parked lookup of %u (slot %lu)\n", num,
+    slot);
+
+
+  return true;
+}
+
+
+void server_handle_req(server* serv, struct sockaddr_in const* ret,
+  packet_info const* pi) {
+  raw_iterator rit; // For reading request
+  subscriber_num num;
+  tech_type ttype;
 
-  fprintf(stderr, "server_init: Initializing server...\n");
+  
+  // Read in the request info
+  rit_init(&rit, serv->recv_buf, sizeof(serv->recv_buf));
+  rit.curr = (uint8_t*)pi->cont.data_info.payload; // Within recv_buf
+  rit_read(&rit, sizeof(ttype), &ttype);
+  rit_read(&rit, sizeof(subscriber_num), &num);
+  num = ntohl(num);
 
 
-  // Setup a socket
-  if ((serv->sock_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-    perror("server_init: Couldn't create socket");
-    return false;
+  // Lookup the subscriber
+  fprintf(stderr, "server_handle_req: Looking up %u...\n", num);
+  client_info entry;
+  bool found;
+  packet_type verdict;
+  subtable_state changed; // State of the row in the overlay
+  bool loading = __atomic_load_n(&serv->loading, __ATOMIC_ACQUIRE);
+  bool use_cache = !loading && serv->config.cache_entries > 0;
+
+  if (!loading && serv->partial.slots) {
+    // The loader's done with it, and we're its only reader
+    subtable_destroy(&serv->partial);
   }
 
+  if (use_cache && verdict_cache_get(&serv->cache, num, ttype, &verdict)) {
+    fprintf(stderr, "server_handle_req: Verdict cache hit\n");
+    server_send_reply(serv, ret, pi, verdict);
+    return;
+  } else if ((changed = subtable_lookup(&serv->overlay, num, &entry))
+      != SUBTABLE_ABSENT) {
+    // Changed since load; the overlay wins over every other index
+    verdict = server_verdict(changed == SUBTABLE_LIVE ? &entry : NULL, ttype);
+  } else if (loading) {
+    // Absence from a partial table proves nothing, so only hits are answered
+    if (subtable_lookup(&serv->partial, num, &entry) != SUBTABLE_LIVE) {
+      fprintf(stderr, "server_handle_req: Still loading; try later\n");
+      server_send_reply(serv, ret, pi, TRY_LATER);
+      return;
+    }
 
-  // Fill in with default address if needed
-  if (addr == NULL) {
-    memset(&serv->addr, 0, sizeof(serv->addr));
-    serv->addr.sin_family = AF_INET;
-    serv->addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serv->addr.sin_port = htons(DEFAULT_PORT);
+    verdict = server_verdict(&entry, ttype);
+  } else if (serv->techs) {
+    // Two bitmap probes; never touches the database itself
+    verdict = tech_index_verdict(serv->techs, num, ttype);
+  } else if (server_try_park(serv, ret, pi, num, ttype)) {
+    return;
   } else {
-    memcpy(&serv->addr, addr, sizeof(struct sockaddr_in));
+    found = server_lookup(serv, num, &entry);
+    verdict = server_verdict(found ? &entry : NULL, ttype);
   }
 
 
-  // Bind the socket
-  if ((bind(serv->sock_fd, (struct sockaddr*)&serv->addr,
-        sizeof(struct sockaddr_in)) == -1)) {
-    perror("server_init: Couldn't bind socket to address");
-    return false;
+  if (use_cache) {
+    verdict_cache_put(&serv->cache, num, ttype, verdict);
   }
 
+  server_send_reply(serv, ret, pi, verdict);
+}
+
 
-  // Initialize next expected sequence numbers
-  memset(serv->expect_recv, 0, sizeof(serv->expect_recv));
+bool server_apply_update(server* serv, client_info const* entry,
+  bool deleted) {
+  client_info old; // Current row, to be dropped from the tech index
+  subtable_state changed = subtable_lookup(&serv->overlay, entry->number, &old);
+  bool loaded = !__atomic_load_n(&serv->loading, __ATOMIC_ACQUIRE);
+  bool had_old = changed == SUBTABLE_LIVE
+    || (changed == SUBTABLE_ABSENT && loaded
+      && server_lookup(serv, entry->number, &old));
 
 
-  // Read in database
-  if (!parse_database_file(filename, &serv->db)) {
-    fprintf(stderr, "server_init: Couldn't initialize database!\n"); 
+  if (!(deleted ? subtable_delete(&serv->overlay, entry->number)
+        : subtable_upsert(&serv->overlay, entry))) {
+    fprintf(stderr, "server_apply_update: Overlay full; update to %u lost!\n",
+      entry->number);
     return false;
   }
 
 
-  fprintf(stderr, "Done initializing!\n");
-  fprintf(stderr, "Server IP: %s\n",
-    inet_ntop(AF_INET, &serv->addr.sin_addr, ip_str, INET_ADDRSTRLEN));
-  fprintf(stderr, "Server port: %u\n", ntohs(serv->addr.sin_port));
+  // Keep the derived structures in step
+  if (serv->config.cache_entries > 0) {
+    verdict_cache_invalidate(&serv->cache, entry->number);
+  }
 
+  // Until the load's published, the overlay alone covers the change
+  if (loaded && serv->techs) {
+    if (had_old) {
+      tech_index_remove(serv->techs, &old);
+    }
+    if (!deleted) {
+      tech_index_add(serv->techs, entry);
+    }
+  }
 
-  return true;
-}
+  ++serv->n_updates;
 
+  // Only paid/tech changes (and rows appearing or going) alter verdicts
+  if (serv->watches && (deleted ? had_old : !had_old
+        || old.ttype != entry->ttype || old.paid != entry->paid)) {
+    watch_invalidate(serv->watches, entry->number);
+  }
 
-// Process a received packet
-void server_process_packet(server* serv, struct sockaddr_in const* ret) {
-  packet_info pi; // For storing interpreted packet
-  int code; // For return value of server_check_packet()
-  char ip_str[INET_ADDRSTRLEN]; // For pretty-printing addresses
+  if (serv->primary) {
+    repl_primary_publish(serv->primary,
+      deleted ? DELTA_DELETE : had_old ? DELTA_UPDATE : DELTA_INSERT, entry);
+  }
 
 
-  // Validate
-  code = server_check_packet(serv, &pi);
+  return true;
+}
 
 
-  // Notify of any errors if present
-  if (code != 0) {
-    alert_reject(&pi, (reject_code)code);
-    
-    // Reply to client with reject message
-    fprintf(stderr, "server_run: Sending REJECT message\n");
-    server_send_reject(serv, &pi, ret, (reject_code)code);
+// Helper; apply a row appended to the followed database file
+static bool server_apply_tailed(client_info const* entry, void* ctx) {
+  server* serv = (server*)ctx;
 
-  } else { // All is well
-    // FIXME: pretty print sub_num, etc.
-    fprintf(stderr, "server_run: Received message: \"%s\"\n",
-      (char const*)pi.cont.data_info.payload);
-    fprintf(stderr, "server_run: from %s:%u\n", inet_ntop(AF_INET,
-      &ret->sin_addr, ip_str, INET_ADDRSTRLEN), ntohs(ret->sin_port));
 
+  return !server_owns(serv, entry->number)
+    || server_apply_update(serv, entry, false);
+}
 
-    // Send an ACK, and update next expected sequence number
-    fprintf(stderr, "server_run: Sending ACK for sequence number %u\n",
-      pi.cont.data_info.seq_num);
-    server_send_ack(serv, pi.id, ret);
-    ++serv->expect_recv[pi.id];
 
-    
-    // Check database and send the appropriate response
-    server_handle_req(serv, ret, &pi);
-  }
-}
+// Helper; apply one record of a delta file
+static bool server_apply_delta_record(delta_op op, client_info const* entry,
+  void* ctx) {
+  server* serv = (server*)ctx;
 
 
-void server_handle_req(server* serv, struct sockaddr_in const* ret,
-  packet_info const* pi) {
-  raw_iterator rit; // For reading request
-  subscriber_num num;
-  tech_type ttype;
-  packet_info reply_pi; // Response to client
+  return !server_owns(serv, entry->number)
+    || server_apply_update(serv, entry, op == DELTA_DELETE);
+}
 
-  
-  // Read in the request info
-  rit_init(&rit, serv->recv_buf, sizeof(serv->recv_buf));
-  rit.curr += sizeof(PACKET_START) + sizeof(client_id) + sizeof(uint16_t)
-    + sizeof(sequence_num) + sizeof(payload_len); // Skip to the payload
-  rit_read(&rit, sizeof(ttype), &ttype);
-  rit_read(&rit, sizeof(subscriber_num), &num);
-  num = ntohl(num);
 
+bool server_apply_delta(server* serv, char const* filename) {
+  size_t n_before = serv->n_updates;
+  bool ok = delta_apply(filename, &server_apply_delta_record, serv);
 
-  // Lookup the subscriber
-  fprintf(stderr, "server_handle_req: Looking up %u...\n", num);
-  client_info* entry = lookup(&serv->db, num);
 
+  fprintf(stderr, "server_apply_delta: Applied %lu changes from %s%s\n",
+    serv->n_updates - n_before, filename, ok ? "" : " (incomplete!)");
 
 
-  // Check lookup result and setup reply packet
-  if (!entry) {
-    // Subscriber not found
-    reply_pi.type = NOT_EXIST;
-    fprintf(stderr, "server_handle_req: Subscriber not found!\n");
+  return ok;
+}
 
-  } else if (entry->ttype != ttype) {
-    // Nonexistent tech type
-    fprintf(stderr, "server_handle_req: Subscriber has no access to tech!\n");
-    reply_pi.type = NOT_EXIST;
 
-  } else if (!entry->paid) {
-    // Entry's there, but hasn't paid
-    fprintf(stderr, "server_handle_req: Subscriber has not paid!\n");
-    reply_pi.type = NOT_PAID;
+void server_complete_parked(server* serv) {
+  uint64_t slot; // Completed request's slot
+  int res; // Result of the read
 
-  } else {
-     // Subscriber granted access
-    fprintf(stderr, "server_handle_req: Subscriber granted access.\n");  
-    reply_pi.type = ACC_OK;
-  }
 
-  // We're basically echoing back the request data, so the payload can be
-  // copied from the request
-  reply_pi.id = pi->id;
-  reply_pi.cont.data_info.seq_num = pi->cont.data_info.seq_num;
-  reply_pi.cont.data_info.len = pi->cont.data_info.len;
-  reply_pi.cont.data_info.payload = pi->cont.data_info.payload;
+  while (uring_reap(&serv->ring, &slot, &res)) {
+    parked_req* req = &serv->parked[slot];
+    client_info entry;
+    bool found;
+    subtable_state changed;
 
 
-  size_t flattened_len =
-    flatten(&reply_pi, serv->send_buf, sizeof(serv->send_buf));
+    // The row may have changed while we were waiting; a short or failed
+    // read still has the mapping to fall back on
+    if ((changed = subtable_lookup(&serv->overlay, req->num, &entry))
+        != SUBTABLE_ABSENT) {
+      found = changed == SUBTABLE_LIVE;
+    } else if (res == BTREE_PAGE_SIZE) {
+      found = btree_search_leaf(req->page, req->num, &entry);
+    } else {
+      fprintf(stderr, "server_complete_parked: Leaf read failed (%d)\n", res);
+      found = btree_lookup(&serv->disk_db, req->num, &entry);
+    }
 
+    packet_type verdict = server_verdict(found ? &entry : NULL, req->ttype);
+    if (serv->config.cache_entries > 0) {
+      verdict_cache_put(&serv->cache, req->num, req->ttype, verdict);
+    }
 
+    serv->reply_slot = req->reply_slot;
+    server_send_reply(serv, &req->ret, &req->pi, verdict);
 
-  // Send out the reply
-  if (sendto(
-      serv->sock_fd,
-      serv->send_buf,
-      flattened_len,
-      0,
-      (struct sockaddr*)ret,
-      sizeof(struct sockaddr_in)) == -1) {
-    fprintf(stderr, "server_handle_req: Unable to send reply!\n");
-  } 
+    req->in_use = false;
+    --serv->n_parked;
+  }
 }
 
 
-void server_send_ack(server* serv, client_id id, struct sockaddr_in const* ret) {
+void server_send_ack(server* serv, client_id id, sequence_num seq,
+  struct sockaddr_in const* ret) {
   char ip_str[INET_ADDRSTRLEN]; // For msg printing
 
 
   packet_info pi;
   pi.type = ACK;
   pi.id = id;
-  pi.cont.ack_info.recvd_seq_num = serv->expect_recv[id];
+  pi.cont.ack_info.recvd_seq_num = seq;
 
 
   size_t flattened_len = flatten(&pi, serv->send_buf, sizeof(serv->send_buf));
@@ -237,22 +1621,323 @@ void server_send_reject(server* serv, packet_info const* bad_pi,
 }
 
 
+// Helper; state for collecting the overlay's rows into a handoff body
+typedef struct {
+  delta_record* recs;
+  size_t n_recs;
+  size_t max_recs;
+} overlay_dump;
+
+
+// Helper; add one overlay slot to a handoff body
+static bool server_dump_overlay_row(subtable_state state,
+  client_info const* entry, void* ctx) {
+  overlay_dump* dump = (overlay_dump*)ctx;
+
+
+  if (dump->n_recs == dump->max_recs) {
+    return false; // Filled up while we walked
+  }
+
+  delta_encode(&dump->recs[dump->n_recs++],
+    state == SUBTABLE_LIVE ? DELTA_INSERT : DELTA_DELETE, entry);
+
+
+  return true;
+}
+
+
+// Hand our socket, database and state to a replacement that connected to
+// handoff_fd. Afterwards we stop reading requests, and server_run() returns
+// once parked requests are answered.
+static void server_hand_off(server* serv) {
+  handoff_header hdr;
+  int fds[HANDOFF_MAX_FDS];
+  size_t n_fds = 0;
+  int db_fd = -1;
+  overlay_dump dump;
+  uint8_t* body;
+  int conn = accept(serv->handoff_fd, NULL, NULL);
+
+
+  if (conn == -1) {
+    return;
+  }
+
+  // ACKs owed go out before their windows go over
+  if (serv->acks) {
+    ack_batch_flush(serv->acks, true);
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = HANDOFF_MAGIC;
+  hdr.version = HANDOFF_VERSION;
+  fds[n_fds++] = serv->sock_fd;
+
+
+  // A text database that's done loading goes over as a memory file; the
+  // replacement loads anything else itself
+  if (!__atomic_load_n(&serv->loading, __ATOMIC_ACQUIRE) && serv->db
+      && (db_fd = database_export(serv->db)) != -1) {
+    fds[n_fds++] = db_fd;
+    hdr.flags |= HANDOFF_HAS_DB;
+  }
+
+  if (serv->primary) {
+    fds[n_fds++] = serv->primary->listen_fd;
+    hdr.flags |= HANDOFF_HAS_REPL;
+  }
+
+  if (serv->tail.inotify_fd != -1 && !serv->tail.realign) {
+    hdr.tail_offset = serv->tail.offset - serv->tail.buf_len;
+  }
+
+
+  // Body: the sequence table, then the overlay
+  dump.max_recs = serv->overlay.n_filled;
+  dump.n_recs = 0;
+  if ((body = malloc(sizeof(serv->local_windows)
+        + dump.max_recs * sizeof(delta_record))) == NULL) {
+    fprintf(stderr, "server_hand_off: Out of memory!\n");
+    goto done;
+  }
+
+  memcpy(body, serv->windows, sizeof(serv->local_windows));
+  dump.recs = (delta_record*)(body + sizeof(serv->local_windows));
+  subtable_for_each(&serv->overlay, &server_dump_overlay_row, &dump);
+
+  hdr.n_clients = NARROW_CLIENT_IDS;
+  hdr.n_overlay = dump.n_recs;
+  hdr.body_len = sizeof(serv->local_windows)
+    + dump.n_recs * sizeof(delta_record);
+
+  if (handoff_send(conn, &hdr, fds, n_fds, body)) {
+    serv->handed_off = true;
+    close(serv->handoff_fd);
+    serv->handoff_fd = -1;
+    fprintf(stderr, "server_hand_off: Handed off %s%u changed rows; "
+      "draining\n", db_fd != -1 ? "database and " : "", hdr.n_overlay);
+  }
+
+  free(body);
+
+
+done:
+  if (db_fd != -1) {
+    close(db_fd);
+  }
+  close(conn);
+}
+
+
+// Helper; how long a received packet queued on the socket, going by its
+// kernel receive timestamp
+// Return value: The time in nanoseconds; 0 if it has no timestamp
+static uint64_t server_queued_ns(struct msghdr* msg) {
+  struct cmsghdr* cmsg;
+  struct timespec stamp, now;
+
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      // The kernel stamps with the wall clock
+      memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+      clock_gettime(CLOCK_REALTIME, &now);
+
+      // Signed, since the clock may have stepped back since
+      int64_t queued = (int64_t)(now.tv_sec - stamp.tv_sec) * 1000000000LL
+        + (now.tv_nsec - stamp.tv_nsec);
+
+      return queued > 0 ? (uint64_t)queued : 0;
+    }
+  }
+
+
+  return 0;
+}
+
+
 void server_run(server* serv) {
   struct sockaddr_in client_addr; // To store client IP address
-  socklen_t addrlen = sizeof(struct sockaddr_in); // For length of client address
   ssize_t n_recvd; // To hold number of bytes received
+  union {               // Aligned room for a receive timestamp
+    char buf[CMSG_SPACE(sizeof(struct timespec))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = serv->recv_buf,
+    .iov_len = sizeof(serv->recv_buf) };
+  struct msghdr msg;
+  uint64_t queued_ns; // How long the packet waited on the socket
+  struct pollfd fds[6 + REPL_MAX_PEERS]; // The socket, the ring for parked
+                        // lookups, inotify for the followed database,
+                        // replication, a replacement taking over, and
+                        // replicas yet to say hello
+  nfds_t n_fds;
+  int tick = serv->primary || serv->replica ? REPL_TICK_MS : -1;
+  int timeout;
 
   memset(&client_addr, 0, sizeof(client_addr));
 
+  fds[0].fd = serv->sock_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = serv->ring.fd; // Ignored by poll() if -1
+  fds[1].events = POLLIN;
+  fds[2].fd = serv->tail.inotify_fd; // Ditto
+  fds[2].events = POLLIN;
+  fds[3].fd = serv->primary ? serv->primary->listen_fd : -1;
+  fds[3].events = POLLIN;
+  fds[5].fd = serv->handoff_fd;
+  fds[5].events = POLLIN;
+
+
+  // Rows appended while the server we replace handed off
+  if (serv->tail.inotify_fd != -1) {
+    tailer_drain(&serv->tail, &server_apply_tailed, serv);
+  }
+
   
   // Wait...
   fprintf(stderr, "server_run: Waiting for messages...\n");
-  while ((n_recvd =
-    recvfrom(serv->sock_fd, serv->recv_buf, sizeof(serv->recv_buf), 0,
-      (struct sockaddr*)&client_addr, &addrlen))) // XXX: this implicitly exits upon receiving a 0-byte packet!!
-  {
+  while (1) {
+    if (stats_requested) {
+      stats_requested = 0;
+      server_dump_stats(serv);
+    }
+
+    if (__atomic_load_n(&serv->load_failed, __ATOMIC_ACQUIRE)) {
+      fprintf(stderr, "server_run: Couldn't load the database; exiting\n");
+      break;
+    }
+
+    if (delta_requested) {
+      delta_requested = 0;
+      if (serv->config.delta_file) {
+        server_apply_delta(serv, serv->config.delta_file);
+      }
+    }
+
+    // Replica's connection; changes on reconnects
+    fds[4].fd = serv->replica ? serv->replica->fd : -1;
+    fds[4].events = serv->replica ? repl_replica_events(serv->replica) : 0;
+    n_fds = 6 + (serv->primary && !serv->handed_off
+      ? repl_primary_poll_fds(serv->primary, &fds[6]) : 0);
+
+    // Handed off: the replacement reads requests, follows the database and
+    // takes new replicas; we just finish what's parked
+    if (serv->handed_off) {
+      if (serv->n_parked == 0) {
+        fprintf(stderr, "server_run: Drained; exiting\n");
+        break;
+      }
+      fds[0].fd = fds[2].fd = fds[3].fd = fds[5].fd = -1;
+    }
+
+    // Wake up for delayed ACKs, too
+    timeout = serv->acks ? ack_batch_timeout_ms(serv->acks) : -1;
+    if (timeout == -1 || (tick != -1 && tick < timeout)) {
+      timeout = tick;
+    }
+
+    // ...and to notice a background load failing
+    if (__atomic_load_n(&serv->loading, __ATOMIC_ACQUIRE)
+        && (timeout == -1 || timeout > LOAD_TICK_MS)) {
+      timeout = LOAD_TICK_MS;
+    }
+
+    if (poll(fds, n_fds, timeout) == -1) {
+      if (errno != EINTR) {
+        perror("server_run: poll() failed");
+      }
+      continue;
+    }
+
+
+    // Finish parked requests first; they've been waiting longest
+    if (fds[1].revents & POLLIN) {
+      server_complete_parked(serv);
+    }
+
+    if (fds[2].revents & POLLIN) {
+      tailer_drain(&serv->tail, &server_apply_tailed, serv);
+    }
+
+
+    // Replication; changes made above go out to replicas right away
+    if (serv->replica) {
+      if (fds[4].revents) {
+        repl_replica_receive(serv->replica, &server_apply_repl, serv);
+      }
+      repl_replica_tick(serv->replica);
+    }
+
+    if (serv->primary) {
+      if (fds[3].revents & POLLIN) {
+        repl_primary_accept(serv->primary);
+      }
+      repl_primary_flush(serv->primary,
+        !__atomic_load_n(&serv->loading, __ATOMIC_ACQUIRE)
+          && (serv->db || serv->use_disk_db));
+    }
+
+    // Clients learn of this iteration's changes in one batch
+    if (serv->watches) {
+      watch_flush(serv->watches);
+    }
+
+    if (serv->acks) {
+      ack_batch_flush(serv->acks, false);
+    }
+
+    session_expire(&serv->sessions);
+
+    // Nothing more is read once the sequence table has been handed over
+    if (fds[5].revents & POLLIN) {
+      server_hand_off(serv);
+    }
+
+    if (serv->handed_off || !(fds[0].revents & POLLIN)) {
+      continue;
+    }
+
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &client_addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    n_recvd = recvmsg(serv->sock_fd, &msg, MSG_DONTWAIT);
+
+    if (n_recvd == 0) {
+      break; // XXX: this implicitly exits upon receiving a 0-byte packet!!
+    }
+
     if (n_recvd == -1) {
-      perror("server_run: recvfrom() failed");
+      if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("server_run: recvmsg() failed");
+      }
+      continue;
+    }
+
+
+    // How long it queued tells if we're keeping up
+    queued_ns = serv->timestamps ? server_queued_ns(&msg) : 0;
+    if (queued_ns > serv->max_queued_ns) {
+      serv->max_queued_ns = queued_ns;
+    }
+
+    if (serv->pressure) {
+      backpressure_sample(serv->pressure, queued_ns);
+    }
+
+    // A request that queued past the deadline has been given up on, and
+    // likely sent again already; shed it before any work's done for it. Its
+    // sequence number stays free for the retransmit.
+    if (serv->config.deadline_ms > 0
+        && queued_ns > serv->config.deadline_ms * 1000000ULL) {
+      ++serv->n_shed;
       continue;
     }
 
@@ -271,47 +1956,191 @@ void server_run(server* serv) {
 }
 
 
-int server_check_packet(server* serv, packet_info* pi) {
-  // Read and check the packet for errors
+void server_dump_stats(server const* serv) {
+  bool loading = __atomic_load_n(&serv->loading, __ATOMIC_ACQUIRE);
+
+
+  if (loading) {
+    fprintf(stderr, "server_dump_stats: Loading, %lu rows so far\n",
+      serv->partial.n_filled);
+  } else if (serv->db || serv->use_disk_db) {
+    fprintf(stderr, "server_dump_stats: %lu entries\n", serv->use_disk_db
+      ? (unsigned long)serv->disk_db.hdr.n_entries : serv->db->n_filled);
+  }
+
+  if (!loading && serv->shards.n_shards > 0) {
+    shard_dump_stats(&serv->shards);
+  }
+
+  // The row count is published with the database
+  if (serv->cluster) {
+    fprintf(stderr, "cluster: node %lu of %lu; %lu rows left to other "
+      "nodes, %lu requests forwarded, %lu served for other nodes\n",
+      serv->self + 1, serv->cluster->n_nodes,
+      loading ? 0 : serv->n_not_owned, serv->n_forwarded, serv->n_fwd_served);
+  }
+
+  fprintf(stderr, "overlay: %lu rows changed, %lu updates applied\n",
+    serv->overlay.n_filled, serv->n_updates);
+
+  if (serv->config.n_workers > 1) {
+    fprintf(stderr, "server: worker %lu of %lu, serving clients with ID %% "
+      "%lu == %lu%s\n", serv->worker + 1, serv->config.n_workers,
+      serv->config.n_workers, serv->worker, serv->config.shard_workers
+      ? ", or narrow clients' requests for our shard" : "");
+  }
+
+  if (serv->config.prefilter) {
+    fprintf(stderr, "prefilter: %u packets dropped by the socket, malformed "
+      "or for want of buffer space\n", prefilter_socket_drops(serv->sock_fd));
+  }
+
+  if (serv->config.deadline_ms > 0) {
+    fprintf(stderr, "shedding: %lu requests dropped after queueing over "
+      "%u ms; longest queued %.1f ms\n", serv->n_shed,
+      serv->config.deadline_ms, serv->max_queued_ns / 1e6);
+  }
+
+  session_dump_stats(&serv->sessions);
+
+  if (serv->tail.inotify_fd != -1) {
+    tailer_dump_stats(&serv->tail);
+  }
+
+  if (serv->primary) {
+    repl_primary_dump_stats(serv->primary);
+  }
+
+  if (serv->replica) {
+    repl_replica_dump_stats(serv->replica);
+  }
+
+  if (serv->watches) {
+    watch_dump_stats(serv->watches);
+  }
+
+  if (serv->acks) {
+    ack_batch_dump_stats(serv->acks);
+  }
+
+  if (serv->replies) {
+    reply_cache_dump_stats(serv->replies);
+  }
+
+  if (serv->limits) {
+    rate_limit_dump_stats(serv->limits);
+  }
+
+  if (serv->pressure) {
+    backpressure_dump_stats(serv->pressure);
+  }
+
+  if (serv->config.cache_entries > 0) {
+    verdict_cache_dump_stats(&serv->cache);
+  }
+
+  if (serv->max_parked > 0) {
+    fprintf(stderr, "parked: now = %lu, total = %lu, blocked (slots full) = "
+      "%lu\n", serv->n_parked, serv->n_parked_total, serv->n_park_full);
+  }
+}
+
+
+int server_check_packet(server* serv, struct sockaddr_in const* from,
+  packet_info* pi, seq_window** window) {
+  session* sess;
+  bool created;
+
+
+  // Read and check the packet for errors; fields a bad header leaves unread
+  // stay zero
+  memset(pi, 0, sizeof(packet_info));
+  *window = NULL;
+  serv->reply_slot = REPLY_NONE;
+  serv->throttled = false;
+
   int code = interpret_packet(serv->recv_buf, pi, sizeof(serv->recv_buf));
 
 
-  // This server only accepts access requests
-  if (pi->type != ACC_PER) {
+  // This server only accepts access requests, possibly forwarded by another
+  // node of its cluster, and subscriptions
+  if (pi->type != ACC_PER && pi->type != FWD && pi->type != SUBSCRIBE) {
     fprintf(stderr, "server_check_packet: Non access-request received!\n");
     return BAD_TYPE;
   }
 
 
   // Check for invalid length field: does the raw packet end on the expected
-  // boundary?
+  // boundary? The header's length depends on the client ID's width, so go
+  // by where the payload was found.
   uint8_t* payload_end =
-    serv->recv_buf
-      + sizeof(PACKET_START)
-      + sizeof(client_id)
-      + sizeof(uint16_t) // XXX: packet type
-      + sizeof(sequence_num)
-      + sizeof(payload_len)
-      + pi->cont.data_info.len;
+    (uint8_t*)pi->cont.data_info.payload + pi->cont.data_info.len;
   uint8_t* expected_payload_end =
     serv->recv_buf + serv->last_recvd_len - sizeof(PACKET_END);
 
   
-  if (payload_end != expected_payload_end) {
+  if (payload_end != expected_payload_end
+      || (pi->type == FWD && pi->cont.data_info.len < FWD_TRAILER_LEN)
+      || (pi->type == SUBSCRIBE
+        && pi->cont.data_info.len % sizeof(subscriber_num) != 0)) {
     return BAD_LEN;
   }
 
 
-  // Check for additional errors
-  if (code == 0) {
-    // Check sequence number
-    // FIXME: special case: both zero -> overflow!...or will it wrap around??
-    if (pi->cont.data_info.seq_num != serv->expect_recv[pi->id]) {
-      if (pi->cont.data_info.seq_num > serv->expect_recv[pi->id]) {
-        return OUT_OF_SEQ;
-      } else {
-        return DUP_PACK;
+  // Check for additional errors; forwarded requests were sequenced by the
+  // node that forwarded them
+  if (code == 0 && pi->type != FWD) {
+    // A flooding subnet is dropped before it can take up sessions
+    if (serv->limits
+        && !rate_limit_subnet(serv->limits, from->sin_addr.s_addr)) {
+      serv->throttled = true;
+      return 0;
+    }
+
+    // Narrow IDs index the flat table; wide ones have sessions, and a new
+    // session's window starts at whatever the client sends first
+    if (pi->id < NARROW_CLIENT_IDS) {
+      *window = &serv->windows[pi->id].win;
+      serv->reply_slot = pi->id;
+    } else if ((sess = session_find(&serv->sessions, pi->id, from,
+          pi->cont.data_info.seq_num, &created)) != NULL) {
+      *window = &sess->win;
+      serv->reply_slot = NARROW_CLIENT_IDS + (sess - serv->sessions.sessions);
+
+      // Replies kept (and tokens spent) by the session's last client aren't
+      // this one's
+      if (created && serv->replies) {
+        reply_cache_forget(serv->replies, serv->reply_slot);
       }
+      if (created && serv->limits) {
+        rate_limit_forget(serv->limits, serv->reply_slot);
+      }
+    } else {
+      return 0;
+    }
+
+    if (serv->limits && !serv->throttled
+        && !rate_limit_client(serv->limits, serv->reply_slot)) {
+      serv->throttled = true;
+    }
+
+    // A throttled request leaves its sequence number free, to be sent
+    // again, whether it's dropped or answered BUSY
+    if (serv->throttled) {
+      *window = NULL;
+      serv->reply_slot = REPLY_NONE;
+      return 0;
+    }
+
+    // Check sequence number; anything new within the window goes, so
+    // clients can pipeline requests. Claimed here and now, so it's accepted
+    // once however many threads see it.
+    code = seq_window_accept(*window, pi->cont.data_info.seq_num);
+
+    // Whatever was kept for the number's last lap isn't this request's
+    if (code == 0 && serv->replies && serv->reply_slot != REPLY_NONE) {
+      reply_cache_clear(serv->replies, serv->reply_slot,
+        pi->cont.data_info.seq_num);
     }
   }
 
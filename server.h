@@ -5,12 +5,34 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <netinet/ip.h>
+#include <pthread.h>
 
 #include "packet.h"
 #include "database.h"
+#include "shard.h"
+#include "btree.h"
+#include "uring.h"
+#include "subtable.h"
+#include "verdict_cache.h"
+#include "tech_index.h"
+#include "tail.h"
+#include "delta.h"
+#include "repl.h"
+#include "hashring.h"
+#include "watch.h"
+#include "seqstate.h"
+#include "session.h"
+#include "ackbatch.h"
+#include "replycache.h"
+#include "ratelimit.h"
+#include "backpressure.h"
+#include "prefilter.h"
+#include "reuseport.h"
 
 
 #define DEFAULT_PORT 4321
+#define DEFAULT_OVERLAY_CAPACITY 65536 // Rows that can change after load
+#define DEFAULT_SESSION_CAPACITY 65536 // Clients with wide IDs at once
 
 // Get the size of the range of an unsigned type
 // XXX: taken from http://stackoverflow.com/questions/2053843/min-and-max-value-of-data-type-in-c
@@ -18,16 +40,153 @@
                     (0xFULL << ((sizeof(t) * 8ULL) - 4ULL))) + 1)
 
 
+// Server tunables; a zeroed config gives the defaults
+typedef struct {
+  unsigned db_flags; // Flags for database_new(), e.g. DB_HUGEPAGES
+  bool numa_local;   // Replicate the database onto the NUMA node we run on
+  bool shard_workers; // Give each of n_workers a key-range shard, and steer
+                     // requests to the one owning their subscriber
+  size_t max_parked; // Max B+tree lookups waiting on disk at once; 0 makes
+                     // them synchronous
+  bool background_load; // Serve while a text database loads in a thread
+  size_t cache_entries; // Size of the verdict front cache (0 = no cache)
+  bool tech_index;   // Build per-tech bitmaps and answer requests from them
+  size_t overlay_capacity; // Rows that can change after load (0 = default)
+  bool follow;       // Apply rows appended to a text database as they're
+                     // written
+  char const* delta_file; // Delta (see dbdiff) to apply on SIGHUP, or NULL
+  uint16_t repl_port; // Serve replicas on this TCP port (0 = don't)
+  bool replica;      // Load from a primary instead of a file...
+  struct sockaddr_in primary_addr; // ...at this address, and follow it
+  char const* ring_file; // Cluster ring (see hashring.h); serve only our
+                     // partition of it, and forward the rest. NULL = serve
+                     // every row
+  size_t ring_self;  // Our node in the ring, 1-based; 0 = the node with our
+                     // port
+  size_t watch_capacity; // Client subscriptions to pushed invalidations
+                     // (0 = take none)
+  char const* seq_file; // Keep the per-client sequence table in this file,
+                     // so restarts don't reject every client's next packet
+                     // (NULL = start from zero)
+  char const* takeover_path; // Take over from the server handing off on
+                     // this Unix socket instead of binding (NULL = don't)
+  char const* handoff_path; // Hand off to a replacement that connects to
+                     // this Unix socket (NULL = don't)
+  size_t session_capacity; // Clients with wide IDs tracked at once
+                     // (0 = DEFAULT_SESSION_CAPACITY)
+  unsigned session_idle_sec; // Forget a wide client after this long without
+                     // packets (0 = DEFAULT_SESSION_IDLE_SEC)
+  unsigned ack_delay_us; // Acknowledge requests with delayed CUM_ACKs (see
+                     // ackbatch.h) instead of an ACK each (0 = don't)
+  size_t reply_depth; // Verdicts kept per client, to answer retransmits
+                     // with (0 = reject them as duplicates)
+  unsigned client_rate; // Requests a second each client may send (see
+                     // ratelimit.h; 0 = no limit)...
+  unsigned subnet_rate; // ...and each source subnet
+  unsigned rate_burst; // Requests over the rate let through at once
+                     // (0 = DEFAULT_RATE_BURST)
+  bool rate_reply;   // Answer throttled requests with BUSY, so clients back
+                     // off and resend, instead of dropping them
+  unsigned deadline_ms; // Drop requests that queued on the socket longer
+                     // than this, going by kernel receive timestamps
+                     // (0 = serve them all)
+  unsigned slow_delay_ms; // Tell clients to slow down (see backpressure.h)
+                     // while requests queue longer than this...
+  unsigned slow_queue_pct; // ...or the socket's receive buffer is fuller
+                     // than this, in percent (0 = never, for either)
+  unsigned slow_interval_us; // Pace first asked for
+                     // (0 = DEFAULT_SLOW_INTERVAL_US)
+  bool prefilter;    // Drop malformed packets in the kernel (see
+                     // prefilter.h)
+  size_t n_workers;  // Split clients by ID over this many worker
+                     // processes, each with its own socket (see
+                     // reuseport.h; 0 or 1 = just this one)
+} server_config;
+
+
+// An access request parked while its B+tree leaf is read in from disk
+typedef struct {
+  bool in_use;
+  struct sockaddr_in ret;         // Where the reply goes
+  packet_info pi;                 // The request; payload points into 'payload'
+  uint8_t payload[urange(payload_len)];
+  subscriber_num num;             // Requested subscriber
+  tech_type ttype;                // Requested technology
+  uint8_t* page;                  // Buffer the leaf page is read into
+  size_t reply_slot;              // The client's in the reply cache
+} parked_req;
+
+
 // Server state
 typedef struct {
-  sequence_num expect_recv[urange(client_id)]; // Mapping of clients to next
-                                            // expected sequence numbers  
+  seq_slot* windows;        // Receive windows of narrow client IDs; in
+                            // seq_state's file if there is one, else in
+                            // local_windows
+  seq_slot local_windows[NARROW_CLIENT_IDS];
+  seqstate seq_state;       // Persistent sequence table; fd is -1 if unused
+  session_table sessions;   // Receive windows of wide client IDs
+  ack_batch* acks;          // Delayed ACKs; NULL if every request is ACKed
+                            // right away
+  reply_cache* replies;     // Recent verdicts per client; NULL if not kept
+  size_t reply_slot;        // The current request's client in 'replies', or
+                            // REPLY_NONE
+  rate_limit* limits;       // Per-client and per-subnet buckets; NULL if
+                            // neither is limited
+  bool throttled;           // The current request is over its rate
+  bool timestamps;          // Received packets carry kernel timestamps
+  backpressure* pressure;   // Overload detection; NULL if clients are never
+                            // told to slow down
+  size_t n_shed;            // Statistics: requests dropped past the
+                            // deadline...
+  uint64_t max_queued_ns;   // ...and the longest any request queued
+  size_t worker;            // This process's share of the clients: those
+                            // with ID % config.n_workers == worker, or
+                            // the requests for its shard
   int sock_fd; // The server's send/recv socket
   struct sockaddr_in addr;  // The server's IP address/port
   uint8_t send_buf[BUFSIZ]; // Buffer for packets to be sent
   uint8_t recv_buf[BUFSIZ]; // Buffer for received packets
   size_t last_recvd_len;    // Size of last received packet (inside recv_buf)
-  database db;             // Subscriber database
+  server_config config;    // Tunables given to server_init()
+  database* db;            // Subscriber database; NULL until loaded
+  shard_set shards;        // Key-range shards of db, our worker's copied;
+                           // n_shards == 0 if unused
+  shard_load* shard_load;  // Shards' load, shared by the workers
+  btree disk_db;           // Disk-resident index, used instead of db if
+  bool use_disk_db;        // the database file is a B+tree
+  uring ring;              // For async leaf reads; fd is -1 if unused
+  parked_req* parked;      // Requests waiting on a leaf read
+  size_t max_parked;       // Capacity of 'parked'
+  size_t n_parked;         // Requests currently parked
+  size_t n_parked_total;   // Statistics: requests that had to be parked...
+  size_t n_park_full;      // ...and that were served blocking since all
+                           // slots were taken
+  bool loading;            // Background load in progress; serve from partial
+  bool load_failed;        // Background load failed; server_run() returns
+  subtable partial;        // Rows loaded so far, during a background load
+  char const* db_filename; // Database being loaded in the background
+  pthread_t loader;        // Background loader thread
+  verdict_cache cache;     // Front cache of verdicts, if cache_entries > 0
+  tech_index* techs;       // Per-tech bitmaps; NULL unless config.tech_index
+  subtable overlay;        // Rows upserted/deleted since load; checked
+                           // before every other index
+  size_t n_updates;        // Statistics: updates applied to the overlay
+  tailer tail;             // Follows the database file; inotify_fd is -1
+                           // if unused
+  repl_primary* primary;   // Replicas fed from here; NULL if none served
+  repl_replica* replica;   // Primary we follow; NULL if not a replica
+  database* repl_db;       // Snapshot being received from the primary
+  hash_ring* cluster;      // Ring of the cluster we're a node of; NULL if
+                           // we serve every row
+  size_t self;             // Our index in 'cluster'
+  size_t n_not_owned;      // Statistics: rows skipped as other nodes',
+                           // published with db...
+  size_t n_forwarded;      // ...requests forwarded to their owner...
+  size_t n_fwd_served;     // ...and served for other nodes
+  watch_table* watches;    // Subscriptions to invalidations; NULL if none
+                           // are taken
+  int handoff_fd;          // Listening for a replacement; -1 if not
+  bool handed_off;         // A replacement took over; drain and exit
 } server;
 
 
@@ -36,34 +195,99 @@ typedef struct {
 //   serv - the server object
 //   addr - A desired address to use; if NULL, INADDR_ANY is used, with
 //   DEFAULT_PORT
-//   filename - The database filename
+//   filename - The database filename; either text, or a B+tree file made by
+//   mkbtree. NULL for replicas, which load a snapshot from their primary.
+//   config - Tunables; if NULL, defaults are used. With background_load, the
+//   server is ready as soon as the socket's bound; until the text database
+//   is loaded, requests for rows not read yet are answered with TRY_LATER.
+//   With follow, rows appended to a text database later on are applied to
+//   the overlay as they come in; they count against overlay_capacity.
+//   With takeover_path, the UDP socket (and replication listener) of the
+//   server handing off there are used instead of binding, along with its
+//   sequence table and changed rows, and its text database unless this is
+//   a replica or a B+tree server; see handoff.h. Replicas of the old server
+//   resync with a snapshot.
+//   Replicas answer TRY_LATER until the primary's snapshot is in, and then
+//   apply its changes as they're streamed; a later snapshot (when the
+//   primary can't resume them) is applied as the row changes it amounts
+//   to. On a primary, every change applied with server_apply_update() is
+//   streamed to its replicas.
+//   With ring_file, a text database is streamed in and only the rows this
+//   node owns are kept (a B+tree is served whole); appended and delta rows
+//   are filtered the same way. Replicas keep whatever their primary sends.
+//   With n_workers > 1, the process forks into that many workers as soon as
+//   their sockets are bound, and each goes on to load the database and
+//   serve its own clients; it can't be combined with takeover_path,
+//   handoff_path, repl_port or seq_file, which are one server's. With
+//   shard_workers, each worker also keeps a copy of one key-range shard,
+//   and once the first has loaded, access requests from narrow client IDs
+//   are steered to the worker owning their subscriber instead; narrow IDs'
+//   receive windows are then shared by the workers. Others still go by ID,
+//   and are served from the whole database.
 // Return value: True if initialization was OK, false otherwise.
-bool server_init(server* serv, struct sockaddr_in* addr, char const* filename);
+bool server_init(server* serv, struct sockaddr_in* addr, char const* filename,
+  server_config const* config);
 
 
-// Process a received packet; validate and send ACK as necessary
+// Process a received packet; validate and send ACK as necessary. SUBSCRIBE
+// packets are sequenced and ACKed like access requests, and answered with
+// a SUBSCRIBE listing the numbers taken (none if the table's full or
+// config.watch_capacity is 0). In a cluster, only numbers this node owns
+// are taken, since only the owner sees their rows change; a request for a
+// subscriber owned by another node is ACKed here
+// (the client's sequence numbers are per node) and forwarded to the owner,
+// which replies to the client directly; see server_forward().
 void server_process_packet(server* serv, struct sockaddr_in const* ret);
 
 
-// Handle an access request, sending responses as appropriate
+// Handle an access request, sending responses as appropriate.
+// With a B+tree database and max_parked > 0, a request whose leaf page isn't
+// resident is parked behind an io_uring read instead of blocking the loop,
+// and answered later by server_complete_parked().
 void server_handle_req(server* serv, struct sockaddr_in const* ret,
   packet_info const* pi);
 
 
+// Upsert or delete a single row on top of the loaded index, without
+// rebuilding it. Readers of the overlay never block; the verdict cache and
+// tech index are kept in step too, and those aren't thread-safe, so call
+// this from the server's own thread. If the change can alter a verdict,
+// clients subscribed to the row are sent an INVALIDATE (batched, by
+// server_run()).
+// Return value: True if applied, false if the overlay is full
+bool server_apply_update(server* serv, client_info const* entry, bool deleted);
+
+
+// Apply a delta file (made by dbdiff) through server_apply_update()
+// Return value: True if every record was applied, false otherwise
+bool server_apply_delta(server* serv, char const* filename);
+
+
+// Answer parked requests whose leaf reads have completed
+void server_complete_parked(server* serv);
+
+
 // Validate a received packet
 // PRECONDITION: Server has just received a packet and has filled member
 // recv_buf with its contents
+// Args:
+//   from - The sender; wide client IDs are tracked per address
+//   window - Set to the client's receive window, in which the packet's
+//   sequence number is marked received if it's new; NULL for forwarded
+//   requests, for a new wide client when there's no room to track it, and
+//   for a throttled request (serv->throttled), whose sequence number is
+//   left free whether it's dropped or answered (config.rate_reply)
 // Return value: 0 if everything was OK; an (castable to reject_code)
 // appropriate error code otherwise
-int server_check_packet(server* serv, packet_info* pi);
+int server_check_packet(server* serv, struct sockaddr_in const* from,
+  packet_info* pi, seq_window** window);
 
 
 // Send an ACK packet
 // Precondition: The server just finished processing a valid received packet
-// from 'client'.
-// Postcondition: The last received sequence number for the client is
-// incremented.
-void server_send_ack(server* serv, client_id client, struct sockaddr_in const* ret);
+// from 'client', with sequence number 'seq'.
+void server_send_ack(server* serv, client_id client, sequence_num seq,
+  struct sockaddr_in const* ret);
 
 
 // Send a reject (error) packet
@@ -72,8 +296,17 @@ void server_send_reject(server* serv, packet_info const* bad_pi,
 
 
 // Run the server, i.e. wait indefinitely for packets, process, and reply with
-// ACKs as appropriate.
+// ACKs as appropriate. Rows appended to a followed database are applied
+// between packets.
+// Sending the process SIGUSR1 dumps the server's statistics; SIGHUP applies
+// config.delta_file, if given. With config.handoff_path, returns once a
+// replacement has taken over and parked requests are answered; also returns
+// if a background load fails (load_failed).
 void server_run(server* serv);
 
 
+// Print server statistics (shard load, etc.)
+void server_dump_stats(server const* serv);
+
+
 #endif // SERVER_H
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "session.h"
+
+
+// Helper; monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Helper; hash of a session's key (splitmix64's finalizer)
+static uint32_t key_hash(client_id id, in_addr_t ip, in_port_t port) {
+  uint64_t x = ((uint64_t)id << 32 | ip) ^ ((uint64_t)port << 48);
+
+
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+
+  return (uint32_t)(x ^ (x >> 31));
+}
+
+
+// Helper; put a session on the wheel, in the slot of tick 'due'
+static void file_session(session_table* t, uint32_t idx, uint32_t due) {
+  uint32_t* head = &t->wheel[due & (SESSION_WHEEL_SLOTS - 1)];
+
+
+  t->sessions[idx].wheel_next = *head;
+  *head = idx;
+}
+
+
+// Helper; drop a session from the index, shifting back the rest of its
+// probe run so lookups never stop short, and free it
+static void remove_session(session_table* t, uint32_t idx) {
+  session* s = &t->sessions[idx];
+  size_t mask = t->n_slots - 1;
+  size_t i = key_hash(s->id, s->ip, s->port) & mask;
+  size_t j;
+
+
+  while (t->slots[i].idx != idx) {
+    i = (i + 1) & mask;
+  }
+
+  // Entries further on may move into the hole, unless that would put them
+  // before their home slot
+  for (j = (i + 1) & mask; t->slots[j].idx != SESSION_NONE;
+      j = (j + 1) & mask) {
+    size_t home = t->slots[j].hash & mask;
+
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      t->slots[i] = t->slots[j];
+      i = j;
+    }
+  }
+
+  t->slots[i].idx = SESSION_NONE;
+
+
+  s->wheel_next = t->free_head;
+  t->free_head = idx;
+  --t->n_live;
+}
+
+
+bool session_init(session_table* t, size_t capacity, unsigned idle_sec) {
+  memset(t, 0, sizeof(session_table));
+
+  if (capacity == 0 || capacity >= SESSION_NONE) {
+    fprintf(stderr, "session_init: Bad capacity %lu\n", capacity);
+    return false;
+  }
+
+
+  // At most half full, so probe runs stay short
+  t->n_slots = 1;
+  while (t->n_slots < 2 * capacity) {
+    t->n_slots *= 2;
+  }
+
+  if ((t->sessions = malloc(capacity * sizeof(session))) == NULL
+      || (t->slots = malloc(t->n_slots * sizeof(session_slot))) == NULL) {
+    fprintf(stderr, "session_init: Out of memory!\n");
+    session_destroy(t);
+    return false;
+  }
+
+  for (size_t i = 0; i < t->n_slots; ++i) {
+    t->slots[i].idx = SESSION_NONE;
+  }
+
+
+  // Every session starts on the free list
+  t->capacity = capacity;
+  for (size_t i = 0; i < capacity; ++i) {
+    t->sessions[i].wheel_next = i + 1 < capacity ? i + 1 : SESSION_NONE;
+  }
+  t->free_head = 0;
+
+  for (size_t i = 0; i < SESSION_WHEEL_SLOTS; ++i) {
+    t->wheel[i] = SESSION_NONE;
+  }
+
+  t->idle_ticks = idle_sec ? idle_sec : DEFAULT_SESSION_IDLE_SEC;
+  t->start_ns = now_ns();
+
+
+  return true;
+}
+
+
+void session_destroy(session_table* t) {
+  free(t->sessions);
+  free(t->slots);
+  memset(t, 0, sizeof(session_table));
+}
+
+
+session* session_find(session_table* t, client_id id,
+  struct sockaddr_in const* addr, sequence_num seq, bool* created) {
+  in_addr_t ip = addr->sin_addr.s_addr;
+  in_port_t port = addr->sin_port;
+  uint32_t hash = key_hash(id, ip, port);
+  size_t mask = t->n_slots - 1;
+  size_t i;
+  uint32_t idx;
+  session* s;
+
+
+  *created = false;
+
+  for (i = hash & mask; t->slots[i].idx != SESSION_NONE; i = (i + 1) & mask) {
+    if (t->slots[i].hash != hash) {
+      continue;
+    }
+
+    s = &t->sessions[t->slots[i].idx];
+    if (s->id == id && s->ip == ip && s->port == port) {
+      s->last_tick = t->tick;
+      return s;
+    }
+  }
+
+
+  // New client; 'i' is the empty slot its run ended on
+  if ((idx = t->free_head) == SESSION_NONE) {
+    ++t->n_full;
+    return NULL;
+  }
+
+  s = &t->sessions[idx];
+  t->free_head = s->wheel_next;
+
+  s->id = id;
+  s->ip = ip;
+  s->port = port;
+  s->win.state = seq;
+  s->win.unacked = 0;
+  s->last_tick = t->tick;
+  t->slots[i].hash = hash;
+  t->slots[i].idx = idx;
+  file_session(t, idx, t->tick + t->idle_ticks);
+
+  ++t->n_live;
+  ++t->n_created;
+  *created = true;
+
+
+  return s;
+}
+
+
+void session_expire(session_table* t) {
+  uint32_t now = (now_ns() - t->start_ns) / 1000000000ULL;
+
+
+  // After a long stall, every slot is due once
+  if (now - t->tick > SESSION_WHEEL_SLOTS) {
+    t->tick = now - SESSION_WHEEL_SLOTS;
+  }
+
+  while (t->tick != now) {
+    uint32_t* head = &t->wheel[++t->tick & (SESSION_WHEEL_SLOTS - 1)];
+    uint32_t idx = *head;
+
+    // Detach the slot's list, then free or refile each session on it
+    *head = SESSION_NONE;
+
+    while (idx != SESSION_NONE) {
+      session* s = &t->sessions[idx];
+      uint32_t next = s->wheel_next;
+      uint32_t due = s->last_tick + t->idle_ticks;
+
+      if ((int32_t)(due - t->tick) <= 0) {
+        remove_session(t, idx);
+        ++t->n_expired;
+      } else {
+        file_session(t, idx, due);
+      }
+
+      idx = next;
+    }
+  }
+}
+
+
+void session_dump_stats(session_table const* t) {
+  fprintf(stderr, "session: %lu of %lu sessions live, %lu started, "
+    "%lu expired after %u s idle, %lu refused (full)\n", t->n_live,
+    t->capacity, t->n_created, t->n_expired, t->idle_ticks, t->n_full);
+}
@@ -0,0 +1,100 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/ip.h>
+
+#include "packet.h"
+#include "seqstate.h"
+
+
+// Per-client state for wide client IDs (NARROW_CLIENT_IDS and up), which
+// are too many for a flat table. A session is keyed by the ID and the
+// address it sends from, and holds the client's receive window.
+//
+// Sessions live in a fixed array, so pointers to them stay valid; they are
+// found through an open-addressed index of (hash, session) pairs, eight to
+// a cache line, so a probe only touches a session on a hash match. Removal
+// shifts the following run back instead of leaving tombstones.
+//
+// Sessions idle for idle_sec are reclaimed by a timer wheel of one-second
+// ticks. A session sits in the slot of the tick it would expire at if it
+// went quiet; packets only stamp it, and when its slot comes round it is
+// either freed or filed again for its new expiry. A packet from a client
+// without a session starts its window at that packet's sequence number, so
+// clients whose session expired (or that outlived a server restart) carry
+// on where they are. Not thread-safe.
+
+
+#define SESSION_WHEEL_SLOTS 256 // Power of 2
+#define SESSION_NONE UINT32_MAX // End of a list; also an empty index slot
+#define DEFAULT_SESSION_IDLE_SEC 300
+
+
+typedef struct {
+  seq_window win;
+  client_id id;
+  in_addr_t ip;            // Source address, network order
+  uint32_t last_tick;      // Tick of the last packet
+  uint32_t wheel_next;     // Next session in the same wheel slot, or on the
+                           // free list
+  in_port_t port;          // Network order
+} session;
+
+
+// One slot of the index
+typedef struct {
+  uint32_t hash;
+  uint32_t idx;            // Into 'sessions'; SESSION_NONE if empty
+} session_slot;
+
+
+typedef struct {
+  session* sessions;
+  size_t capacity;
+  uint32_t free_head;      // Unused sessions
+  session_slot* slots;
+  size_t n_slots;          // Power of 2, at least twice the capacity
+  uint32_t wheel[SESSION_WHEEL_SLOTS]; // Heads of the per-tick lists
+  uint32_t idle_ticks;     // Ticks without packets before expiry
+  uint32_t tick;           // Ticks since start, as of the last
+  uint64_t start_ns;       // session_expire()
+  size_t n_live;
+  size_t n_created;        // Statistics: sessions started...
+  size_t n_expired;        // ...reclaimed while idle...
+  size_t n_full;           // ...and refused because all were in use
+} session_table;
+
+
+// Allocate a table for up to 'capacity' sessions, reclaimed after
+// 'idle_sec' seconds without packets (0 = DEFAULT_SESSION_IDLE_SEC)
+// Return value: True if OK, false if allocation failed
+bool session_init(session_table* t, size_t capacity, unsigned idle_sec);
+
+
+// Free a table
+void session_destroy(session_table* t);
+
+
+// Find a client's session, starting one if it has none
+// Args:
+//   seq - The sequence number a new session's window starts at
+//   created - Set to whether the session is new
+// Return value: The session, or NULL if it had none and the table is full
+session* session_find(session_table* t, client_id id,
+  struct sockaddr_in const* addr, sequence_num seq, bool* created);
+
+
+// Advance the wheel to the current time, reclaiming idle sessions; call
+// about once a second or more often
+void session_expire(session_table* t);
+
+
+// Print statistics
+void session_dump_stats(session_table const* t);
+
+
+#endif // SESSION_H
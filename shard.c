@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "shard.h"
+#include "database.h"
+
+
+shard_load* shard_load_map(void) {
+  shard_load* load = mmap(NULL, MAX_SHARDS * sizeof(shard_load),
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+
+  if (load == MAP_FAILED) {
+    perror("shard_load_map: Couldn't map shard statistics");
+    return NULL;
+  }
+
+
+  return load;
+}
+
+
+bool shard_set_init(shard_set* set, database const* db, size_t n_shards,
+  size_t own, shard_load* load) {
+  memset(set, 0, sizeof(shard_set));
+  set->own = own;
+  set->load = load;
+
+  if (n_shards == 0 || n_shards > MAX_SHARDS) {
+    fprintf(stderr, "shard_set_init: Bad shard count %lu!\n", n_shards);
+    return false;
+  }
+
+  // Never more shards than entries, so that every shard owns a nonempty range
+  if (n_shards > db->n_filled) {
+    n_shards = db->n_filled > 0 ? db->n_filled : 1;
+  }
+
+
+  // Equal entry counts per shard; the first shard also owns everything below
+  // the smallest key so that every number has an owner
+  size_t start = 0; // Index of the first entry of the current shard
+
+  for (size_t i = 0; i < n_shards; ++i) {
+    shard* sh = &set->shards[i];
+    size_t end = db->n_filled * (i + 1) / n_shards;
+
+    sh->lo = i == 0 ? 0 : db->entries[start].number;
+    sh->n_filled = end - start;
+
+    // Only our own range is copied, cache-line aligned so no line is shared
+    // with anything else; other workers serve the rest
+    size_t bytes = sh->n_filled * sizeof(client_info);
+    bytes = (bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+
+    if (i == own && bytes > 0) {
+      if (posix_memalign((void**)&sh->entries, CACHE_LINE, bytes) != 0) {
+        sh->entries = NULL;
+        fprintf(stderr, "shard_set_init: Couldn't allocate shard!\n");
+        shard_set_destroy(set);
+        return false;
+      }
+
+      memcpy(sh->entries, &db->entries[start],
+        sh->n_filled * sizeof(client_info));
+    }
+
+    start = end;
+  }
+
+  set->n_shards = n_shards;
+
+
+  return true;
+}
+
+
+void shard_set_destroy(shard_set* set) {
+  for (size_t i = 0; i < MAX_SHARDS; ++i) {
+    free(set->shards[i].entries);
+    set->shards[i].entries = NULL;
+  }
+
+  set->n_shards = 0;
+}
+
+
+size_t shard_owner(shard_set const* set, subscriber_num num) {
+  // Last shard whose lower bound is <= num
+  size_t lo = 0, hi = set->n_shards;
+
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (set->shards[mid].lo <= num) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+
+  return lo;
+}
+
+
+client_info* shard_lookup(shard_set* set, subscriber_num num) {
+  shard* sh = &set->shards[set->own];
+  shard_load* load = &set->load[set->own];
+  size_t lo = 0, hi = sh->n_filled;
+
+
+  // Other workers only read these
+  __atomic_store_n(&load->n_lookups, load->n_lookups + 1, __ATOMIC_RELAXED);
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (sh->entries[mid].number < num) {
+      lo = mid + 1;
+    } else if (sh->entries[mid].number > num) {
+      hi = mid;
+    } else {
+      __atomic_store_n(&load->n_hits, load->n_hits + 1, __ATOMIC_RELAXED);
+      return &sh->entries[mid];
+    }
+  }
+
+
+  return NULL;
+}
+
+
+void shard_dump_stats(shard_set const* set) {
+  size_t total = 0, busiest = 0;
+
+
+  for (size_t i = 0; i < set->n_shards; ++i) {
+    shard const* sh = &set->shards[i];
+    size_t n_lookups = __atomic_load_n(&set->load[i].n_lookups,
+      __ATOMIC_RELAXED);
+
+    fprintf(stderr, "shard %lu%s: lo = %u, entries = %lu, lookups = %lu, "
+      "hits = %lu\n", i, i == set->own ? " (ours)" : "", sh->lo, sh->n_filled,
+      n_lookups, __atomic_load_n(&set->load[i].n_hits, __ATOMIC_RELAXED));
+
+    total += n_lookups;
+    if (n_lookups > busiest) {
+      busiest = n_lookups;
+    }
+  }
+
+
+  if (total > 0) {
+    fprintf(stderr, "shard skew (busiest / mean) = %.2f\n",
+      (double)busiest * set->n_shards / total);
+  }
+}
@@ -0,0 +1,82 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "database.h"
+
+
+// Partitioning of the subscriber key space into contiguous ranges, so that
+// each worker can own a slice of the index small enough to stay in its
+// core's cache instead of every core touching the whole database. Each
+// worker copies only its own shard; requests are steered to the owning
+// worker by key (see reuseport_steer_by_key()).
+
+
+#define MAX_SHARDS 64
+#define CACHE_LINE 64
+
+
+typedef struct {
+  subscriber_num lo;      // Smallest key owned by this shard
+  client_info* entries;   // Shard's own (sorted) copy of its key range; NULL
+                          // unless it's the set's own
+  size_t n_filled;        // Number of entries
+} shard;
+
+
+// Load statistics of a shard, alone on its cache line; kept apart from the
+// shards so forked workers can share them, each counting its own shard
+typedef struct {
+  size_t n_lookups;       // Lookups routed here...
+  size_t n_hits;          // ...and how many of those found an entry
+} __attribute__((aligned(CACHE_LINE))) shard_load;
+
+
+typedef struct {
+  shard shards[MAX_SHARDS];
+  size_t n_shards;
+  size_t own;             // The shard whose entries were copied
+  shard_load* load;       // One per shard (MAX_SHARDS)
+} shard_set;
+
+
+// Map load statistics for MAX_SHARDS shards, shared with processes forked
+// afterwards
+// Return value: The statistics, zeroed, or NULL on failure
+shard_load* shard_load_map(void);
+
+
+// Split a (sorted) database into 'n_shards' ranges of roughly equal entry
+// counts, and copy shard 'own's range into memory of its own; the other
+// shards only get their bounds. The same database always splits the same
+// way, so workers that each load it agree on the ranges.
+// Args:
+//   load - Where to count lookups (see shard_load_map())
+// Return value: True if OK, false if n_shards is out of range or allocation
+// failed
+bool shard_set_init(shard_set* set, database const* db, size_t n_shards,
+  size_t own, shard_load* load);
+
+
+// Free the shards' memory
+void shard_set_destroy(shard_set* set);
+
+
+// Get the index of the shard that owns a subscriber number
+size_t shard_owner(shard_set const* set, subscriber_num num);
+
+
+// Lookup an entry in the set's own shard, updating its statistics
+// PRECONDITION: shard_owner(set, num) == set->own
+client_info* shard_lookup(shard_set* set, subscriber_num num);
+
+
+// Print per-shard load (of every worker sharing 'load'), and the skew
+// (busiest shard's load over the mean)
+void shard_dump_stats(shard_set const* set);
+
+
+#endif // SHARD_H
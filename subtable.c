@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "subtable.h"
+
+
+// Keep at most this fraction of slots in use, so probe sequences stay short
+#define MAX_LOAD_NUM 3
+#define MAX_LOAD_DEN 4
+
+#define SLOT_TAG(num) ((uint64_t)(num) | (1ULL << 32))
+
+// Filter bits per slot; 2 keeps the filter of the default overlay in L1
+#define FILTER_BITS_PER_SLOT 2
+
+
+// Helper; Fibonacci hashing of a subscriber number
+static uint64_t hash_num(subscriber_num num) {
+  return (uint64_t)num * 0x9E3779B97F4A7C15ULL;
+}
+
+
+// Helper; a number's filter bit, from other hash bits than its home slot
+static size_t filter_bit(subtable const* t, subscriber_num num) {
+  return (size_t)(hash_num(num) >> 16)
+    & (t->capacity * FILTER_BITS_PER_SLOT - 1);
+}
+
+
+// Helper; find the slot holding 'num', or claim an empty one for it
+// PRECONDITION: Caller holds num's stripe lock
+// Return value: The slot, or NULL if the table is full
+static subtable_slot* claim_slot(subtable* t, subscriber_num num) {
+  uint64_t tag = SLOT_TAG(num);
+  size_t mask = t->capacity - 1;
+  size_t i = (hash_num(num) >> 32) & mask;
+
+
+  while (1) {
+    uint64_t seen = __atomic_load_n(&t->slots[i].tag, __ATOMIC_ACQUIRE);
+
+    if (seen == tag) {
+      return &t->slots[i];
+    }
+
+    if (seen == 0) {
+      // Check the load limit before taking the slot; the count may
+      // overshoot by the number of concurrent writers, which the slack
+      // below 100% absorbs
+      if ((__atomic_load_n(&t->n_filled, __ATOMIC_RELAXED) + 1) * MAX_LOAD_DEN
+          > t->capacity * MAX_LOAD_NUM) {
+        return NULL;
+      }
+
+      // Set the filter bit before the tag's published (the CAS releases
+      // it), so no reader can find the slot but miss the bit
+      size_t bit = filter_bit(t, num);
+      __atomic_fetch_or(&t->filter[bit / 64], 1ULL << (bit % 64),
+        __ATOMIC_RELAXED);
+
+      // Writers of other keys (other stripes) may race us for this slot
+      if (__atomic_compare_exchange_n(&t->slots[i].tag, &seen, tag, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_fetch_add(&t->n_filled, 1, __ATOMIC_RELAXED);
+        return &t->slots[i];
+      }
+
+      if (seen == tag) {
+        return &t->slots[i];
+      }
+    }
+
+    i = (i + 1) & mask;
+  }
+}
+
+
+// Helper; write a slot's value under its seqlock
+// PRECONDITION: Caller holds the slot's stripe lock
+static void write_slot(subtable_slot* slot, tech_type ttype, bool paid,
+  bool live) {
+  uint32_t version = slot->version;
+
+
+  __atomic_store_n(&slot->version, version + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  __atomic_store_n(&slot->ttype, ttype, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->paid, paid, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->live, live, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&slot->version, version + 2, __ATOMIC_RELEASE);
+}
+
+
+// Helper; shared by upsert and delete
+static bool subtable_write(subtable* t, subscriber_num num, tech_type ttype,
+  bool paid, bool live) {
+  pthread_mutex_t* stripe = &t->stripes[hash_num(num) % SUBTABLE_STRIPES];
+  subtable_slot* slot;
+
+
+  pthread_mutex_lock(stripe);
+
+  if ((slot = claim_slot(t, num)) != NULL) {
+    write_slot(slot, ttype, paid, live);
+  }
+
+  pthread_mutex_unlock(stripe);
+
+
+  return slot != NULL;
+}
+
+
+bool subtable_init(subtable* t, size_t min_capacity) {
+  t->capacity = 16;
+  while (t->capacity * MAX_LOAD_NUM / MAX_LOAD_DEN < min_capacity) {
+    t->capacity *= 2;
+  }
+
+  t->n_filled = 0;
+
+  if ((t->slots = calloc(t->capacity, sizeof(subtable_slot))) == NULL) {
+    fprintf(stderr, "subtable_init: Out of memory!\n");
+    return false;
+  }
+
+  if ((t->filter = calloc((t->capacity * FILTER_BITS_PER_SLOT + 63) / 64,
+        sizeof(uint64_t))) == NULL) {
+    fprintf(stderr, "subtable_init: Out of memory!\n");
+    free(t->slots);
+    t->slots = NULL;
+    return false;
+  }
+
+  for (size_t i = 0; i < SUBTABLE_STRIPES; ++i) {
+    pthread_mutex_init(&t->stripes[i], NULL);
+  }
+
+
+  return true;
+}
+
+
+void subtable_destroy(subtable* t) {
+  if (!t->slots) {
+    return;
+  }
+
+  free(t->slots);
+  free(t->filter);
+  t->slots = NULL;
+  t->filter = NULL;
+  t->capacity = t->n_filled = 0;
+
+  for (size_t i = 0; i < SUBTABLE_STRIPES; ++i) {
+    pthread_mutex_destroy(&t->stripes[i]);
+  }
+}
+
+
+bool subtable_upsert(subtable* t, client_info const* entry) {
+  return subtable_write(t, entry->number, entry->ttype, entry->paid, true);
+}
+
+
+bool subtable_delete(subtable* t, subscriber_num num) {
+  return subtable_write(t, num, 0, false, false);
+}
+
+
+bool subtable_for_each(subtable const* t,
+  bool (*fn)(subtable_state state, client_info const* entry, void* ctx),
+  void* ctx) {
+  for (size_t i = 0; t->slots && i < t->capacity; ++i) {
+    uint64_t tag = __atomic_load_n(&t->slots[i].tag, __ATOMIC_ACQUIRE);
+    client_info entry;
+    subtable_state state;
+
+    if (tag == 0) {
+      continue;
+    }
+
+    // Go through the lookup for its seqlock read
+    if ((state = subtable_lookup(t, (subscriber_num)tag, &entry))
+          != SUBTABLE_ABSENT) {
+      entry.number = (subscriber_num)tag;
+      if (!fn(state, &entry, ctx)) {
+        return false;
+      }
+    }
+  }
+
+
+  return true;
+}
+
+
+subtable_state subtable_lookup(subtable const* t, subscriber_num num,
+  client_info* out) {
+  uint64_t tag = SLOT_TAG(num);
+  size_t mask = t->capacity - 1;
+  size_t i = (hash_num(num) >> 32) & mask;
+  uint64_t seen;
+  size_t bit;
+
+
+  if (!t->slots) {
+    return SUBTABLE_ABSENT;
+  }
+
+  // Most numbers were never written; the filter answers for them without
+  // touching the (much larger) slot array
+  bit = filter_bit(t, num);
+  if (!(__atomic_load_n(&t->filter[bit / 64], __ATOMIC_RELAXED)
+        & (1ULL << (bit % 64)))) {
+    return SUBTABLE_ABSENT;
+  }
+
+  while ((seen = __atomic_load_n(&t->slots[i].tag, __ATOMIC_ACQUIRE)) != tag) {
+    if (seen == 0) {
+      return SUBTABLE_ABSENT;
+    }
+    i = (i + 1) & mask;
+  }
+
+
+  // Seqlock read; a slot whose tag was just claimed has version 0 and
+  // live == 0 until its first write, which reads as a tombstone, so treat
+  // that as absent
+  subtable_slot* slot = &t->slots[i];
+  uint32_t v1, v2;
+  tech_type ttype;
+  uint8_t paid, live;
+
+  do {
+    while ((v1 = __atomic_load_n(&slot->version, __ATOMIC_ACQUIRE)) & 1);
+
+    ttype = __atomic_load_n(&slot->ttype, __ATOMIC_RELAXED);
+    paid = __atomic_load_n(&slot->paid, __ATOMIC_RELAXED);
+    live = __atomic_load_n(&slot->live, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    v2 = __atomic_load_n(&slot->version, __ATOMIC_RELAXED);
+  } while (v1 != v2);
+
+
+  if (v1 == 0) {
+    return SUBTABLE_ABSENT;
+  }
+
+  if (!live) {
+    return SUBTABLE_DELETED;
+  }
+
+  out->number = num;
+  out->ttype = ttype;
+  out->paid = paid;
+
+
+  return SUBTABLE_LIVE;
+}
@@ -0,0 +1,94 @@
+#ifndef SUBTABLE_H
+#define SUBTABLE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "database.h"
+
+
+// Concurrent hash table of subscriber entries, e.g. rows loaded so far by a
+// background loader, or single-row changes applied on top of the immutable
+// index. Open addressing with linear probing over a fixed, power-of-2
+// capacity; there's no resizing, so size it for the expected number of rows.
+//
+// Readers never lock: each slot carries a version that writers make odd
+// while they update it (a per-slot seqlock), and readers retry if they saw
+// an odd or changed version. Writers serialize per key on one of
+// SUBTABLE_STRIPES mutexes, and claim empty slots with a compare-and-swap,
+// so writers of different keys run in parallel. A slot's key never changes
+// once set; deletes leave a tombstone, so a delete can also mask a row that
+// only exists in some other index.
+//
+// A bit filter (one hash, a couple of bits per slot) records every number
+// ever written, so lookups of unchanged numbers, the common case for an
+// overlay, return without probing the slots.
+
+
+#define SUBTABLE_STRIPES 64
+
+
+typedef enum {
+  SUBTABLE_ABSENT,  // Never inserted
+  SUBTABLE_LIVE,    // Present; entry filled in
+  SUBTABLE_DELETED, // Tombstone
+} subtable_state;
+
+
+typedef struct {
+  uint64_t tag;       // 0 if empty, else the number with bit 32 set
+  uint32_t version;   // Odd while a writer is updating the slot
+  tech_type ttype;
+  uint8_t paid;
+  uint8_t live;       // 0 for tombstones
+} subtable_slot;
+
+
+typedef struct {
+  subtable_slot* slots;
+  uint64_t* filter;       // Bits set by writers, never cleared
+  size_t capacity;        // Power of 2
+  size_t n_filled;        // Slots claimed, tombstones included
+  pthread_mutex_t stripes[SUBTABLE_STRIPES]; // Writer locks, by key hash
+} subtable;
+
+
+// Allocate a table with room for at least 'min_capacity' entries
+// Return value: True if OK, false if allocation failed
+bool subtable_init(subtable* t, size_t min_capacity);
+
+
+// Free a table
+// PRECONDITION: No readers or writers are left
+void subtable_destroy(subtable* t);
+
+
+// Insert an entry, or replace the one with the same subscriber number
+// Return value: True if OK, false if the table is full
+bool subtable_upsert(subtable* t, client_info const* entry);
+
+
+// Mark a subscriber deleted, whether or not it was in the table
+// Return value: True if OK, false if the table is full
+bool subtable_delete(subtable* t, subscriber_num num);
+
+
+// Visit every claimed slot (live rows and tombstones); lock-free, so rows
+// changed during the walk may be seen either way. The callback returns
+// false to stop.
+// Return value: False if the callback stopped the walk
+bool subtable_for_each(subtable const* t,
+  bool (*fn)(subtable_state state, client_info const* entry, void* ctx),
+  void* ctx);
+
+
+// Lookup an entry by subscriber number; lock-free
+// Return value: The entry's state; 'out' is filled if it's SUBTABLE_LIVE
+subtable_state subtable_lookup(subtable const* t, subscriber_num num,
+  client_info* out);
+
+
+#endif // SUBTABLE_H
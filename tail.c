@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "tail.h"
+
+
+// Helper; monotonic time in ns
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Helper; parse and hand off the complete lines in the buffer, keeping an
+// incomplete last line for next time
+static size_t tailer_parse(tailer* t, tail_fn fn, void* ctx) {
+  size_t pos = 0; // Start of the current line
+  size_t n = 0; // Rows handed off
+  char* nl;
+
+
+  if (t->realign) {
+    if ((nl = memchr(t->buf, '\n', t->buf_len)) == NULL) {
+      t->buf_len = 0;
+      return 0;
+    }
+
+    pos = nl - t->buf + 1;
+    t->realign = false;
+  }
+
+  while ((nl = memchr(t->buf + pos, '\n', t->buf_len - pos)) != NULL) {
+    size_t len = nl - (t->buf + pos) + 1;
+    client_info entry;
+
+    if (parse_database_line(t->buf + pos, len, &entry) == len
+        && fn(&entry, ctx)) {
+      ++n;
+    } else {
+      fprintf(stderr, "tailer_drain: Skipping row: %.*s", (int)len,
+        t->buf + pos);
+      ++t->n_bad;
+    }
+
+    pos += len;
+  }
+
+  memmove(t->buf, t->buf + pos, t->buf_len - pos);
+  t->buf_len -= pos;
+
+
+  // A "line" that fills the whole buffer is garbage; drop it
+  if (t->buf_len == sizeof(t->buf)) {
+    fprintf(stderr, "tailer_drain: Line too long; skipping it\n");
+    ++t->n_bad;
+    t->buf_len = 0;
+    t->realign = true;
+  }
+
+
+  return n;
+}
+
+
+bool tailer_open(tailer* t, char const* filename) {
+  struct stat st;
+  char last; // Last byte of the file so far
+
+
+  memset(t, 0, sizeof(tailer));
+  t->fd = -1;
+
+
+  // Watch before looking at the size, so nothing appended in between is
+  // missed
+  if ((t->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+    perror("tailer_open: Couldn't create inotify instance");
+    return false;
+  }
+
+  if (inotify_add_watch(t->inotify_fd, filename,
+        IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+    perror("tailer_open: Couldn't watch database file");
+    goto fail;
+  }
+
+  if ((t->fd = open(filename, O_RDONLY | O_CLOEXEC)) == -1
+      || fstat(t->fd, &st) == -1) {
+    perror("tailer_open: Couldn't open database file");
+    goto fail;
+  }
+
+
+  t->offset = st.st_size;
+  t->realign = t->offset > 0
+    && (pread(t->fd, &last, 1, t->offset - 1) != 1 || last != '\n');
+
+
+  return true;
+
+
+fail:
+  tailer_close(t);
+  return false;
+}
+
+
+void tailer_close(tailer* t) {
+  if (t->fd != -1) {
+    close(t->fd);
+  }
+  if (t->inotify_fd != -1) {
+    close(t->inotify_fd);
+  }
+
+  t->fd = t->inotify_fd = -1;
+}
+
+
+size_t tailer_drain(tailer* t, tail_fn fn, void* ctx) {
+  char events[sizeof(struct inotify_event) + NAME_MAX + 1]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n_read;
+  struct stat st;
+  size_t n = 0; // Rows handed off
+  uint64_t start = now_ns();
+
+
+  // Which events came in doesn't matter much; the file size tells us what
+  // to read. Renames and deletes just mean nothing more will come.
+  while ((n_read = read(t->inotify_fd, events, sizeof(events))) > 0) {
+    for (char* p = events; p < events + n_read;
+        p += sizeof(struct inotify_event)
+          + ((struct inotify_event*)p)->len) {
+      if (((struct inotify_event*)p)->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+        fprintf(stderr, "tailer_drain: Database file was moved or deleted; "
+          "no more rows will be picked up\n");
+      }
+    }
+  }
+
+
+  // Truncated or rewritten; there's no telling what was kept, so carry on
+  // from the new end
+  if (fstat(t->fd, &st) == 0 && st.st_size < t->offset) {
+    fprintf(stderr, "tailer_drain: Database file shrank; following from its "
+      "new end\n");
+    t->offset = st.st_size;
+    t->buf_len = 0;
+    t->realign = false;
+  }
+
+
+  while ((n_read = pread(t->fd, t->buf + t->buf_len,
+          sizeof(t->buf) - t->buf_len, t->offset)) > 0) {
+    t->offset += n_read;
+    t->buf_len += n_read;
+    n += tailer_parse(t, fn, ctx);
+  }
+
+  if (n_read == -1) {
+    perror("tailer_drain: Couldn't read database file");
+  }
+
+
+  t->n_rows += n;
+  t->busy_ns += now_ns() - start;
+
+
+  return n;
+}
+
+
+void tailer_dump_stats(tailer const* t) {
+  fprintf(stderr, "tail: %lu rows applied, %lu skipped, %.2f us/row, "
+    "offset %lld\n", t->n_rows, t->n_bad,
+    t->n_rows > 0 ? t->busy_ns / 1e3 / t->n_rows : 0.0,
+    (long long)t->offset);
+}
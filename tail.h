@@ -0,0 +1,61 @@
+#ifndef TAIL_H
+#define TAIL_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "database.h"
+
+
+// Follows a text database that something else keeps appending rows to, e.g.
+// billing adding activations during the day. inotify says when the file was
+// written; only the bytes past what we've already seen are read, and only
+// complete lines are parsed (with parse_database_line()), so a row that's
+// half-written is picked up on the next write.
+
+
+#define TAIL_BUF_SIZE 65536
+
+
+// Callback for each appended row; returns false if the row couldn't be used
+typedef bool (*tail_fn)(client_info const* entry, void* ctx);
+
+
+typedef struct {
+  int inotify_fd;       // Readable when the file changed; -1 if not following
+  int fd;               // The file being followed
+  off_t offset;         // Next byte to read
+  bool realign;         // Skip to the next newline before parsing
+  char buf[TAIL_BUF_SIZE]; // Read buffer
+  size_t buf_len;       // Bytes in buf; an incomplete last line is kept
+  size_t n_rows;        // Statistics: rows handed to the callback...
+  size_t n_bad;         // ...malformed or rejected ones...
+  uint64_t busy_ns;     // ...and time spent reading and applying them
+} tailer;
+
+
+// Start following a file from its current end
+// NOTE: If the file doesn't end in a newline right now, the partial line is
+// skipped; whoever loads the file is expected to have read up to here.
+// Return value: True if OK, false otherwise
+bool tailer_open(tailer* t, char const* filename);
+
+
+// Stop following
+void tailer_close(tailer* t);
+
+
+// Read whatever was appended since the last call, and hand each complete row
+// to 'fn'. Call this when inotify_fd is readable.
+// Return value: The number of rows handed to 'fn'
+size_t tailer_drain(tailer* t, tail_fn fn, void* ctx);
+
+
+// Print statistics
+void tailer_dump_stats(tailer const* t);
+
+
+#endif // TAIL_H
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "tech_index.h"
+#include "roaring.h"
+
+
+void tech_index_init(tech_index* idx) {
+  for (size_t i = 0; i < N_TECH_TYPES; ++i) {
+    roaring_init(&idx->entitled[i]);
+    roaring_init(&idx->paid[i]);
+  }
+}
+
+
+void tech_index_destroy(tech_index* idx) {
+  for (size_t i = 0; i < N_TECH_TYPES; ++i) {
+    roaring_destroy(&idx->entitled[i]);
+    roaring_destroy(&idx->paid[i]);
+  }
+}
+
+
+bool tech_index_add(tech_index* idx, client_info const* entry) {
+  if (!roaring_add(&idx->entitled[entry->ttype], entry->number)) {
+    return false;
+  }
+
+
+  return !entry->paid || roaring_add(&idx->paid[entry->ttype], entry->number);
+}
+
+
+void tech_index_remove(tech_index* idx, client_info const* entry) {
+  roaring_remove(&idx->entitled[entry->ttype], entry->number);
+  roaring_remove(&idx->paid[entry->ttype], entry->number);
+}
+
+
+bool tech_index_build(tech_index* idx, database const* db) {
+  for (size_t i = 0; i < db->n_filled; ++i) {
+    if (!tech_index_add(idx, &db->entries[i])) {
+      fprintf(stderr, "tech_index_build: Out of memory!\n");
+      return false;
+    }
+  }
+
+
+  return true;
+}
+
+
+// Helper; btree_for_each() callback
+static bool add_entry(client_info const* entry, void* ctx) {
+  return tech_index_add((tech_index*)ctx, entry);
+}
+
+
+bool tech_index_build_btree(tech_index* idx, btree const* bt) {
+  if (!btree_for_each(bt, &add_entry, idx)) {
+    fprintf(stderr, "tech_index_build_btree: Out of memory!\n");
+    return false;
+  }
+
+
+  return true;
+}
+
+
+packet_type tech_index_verdict(tech_index const* idx, subscriber_num num,
+  tech_type ttype) {
+  if (!roaring_contains(&idx->entitled[ttype], num)) {
+    return NOT_EXIST;
+  }
+
+
+  return roaring_contains(&idx->paid[ttype], num) ? ACC_OK : NOT_PAID;
+}
+
+
+size_t tech_index_count_entitled(tech_index const* idx, tech_type ttype) {
+  return roaring_cardinality(&idx->entitled[ttype]);
+}
+
+
+size_t tech_index_count_paid(tech_index const* idx, tech_type ttype) {
+  return roaring_cardinality(&idx->paid[ttype]);
+}
+
+
+size_t tech_index_count_common(tech_index const* idx, tech_type t1,
+  tech_type t2) {
+  return roaring_and_cardinality(&idx->entitled[t1], &idx->entitled[t2]);
+}
+
+
+void tech_index_for_each_unpaid(tech_index const* idx, tech_type ttype,
+  roaring_fn fn, void* ctx) {
+  roaring_for_each_andnot(&idx->entitled[ttype], &idx->paid[ttype], fn, ctx);
+}
@@ -0,0 +1,66 @@
+#ifndef TECH_INDEX_H
+#define TECH_INDEX_H
+
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "database.h"
+#include "btree.h"
+#include "packet.h"
+#include "roaring.h"
+
+
+// Per-technology compressed bitmaps of entitled (and paid) subscribers, built
+// at load time. Set-level questions (how many paid subscribers on tech 05,
+// who hasn't paid, overlap of two techs) become bitmap operations instead of
+// scans over the database, and a verdict is just two membership tests.
+
+
+#define N_TECH_TYPES (1 << (8 * sizeof(tech_type)))
+
+
+typedef struct {
+  roaring entitled[N_TECH_TYPES]; // Subscribers with access to the tech...
+  roaring paid[N_TECH_TYPES];     // ...and the ones of those who've paid
+} tech_index;
+
+
+// Initialize an empty index
+void tech_index_init(tech_index* idx);
+
+
+// Free an index
+void tech_index_destroy(tech_index* idx);
+
+
+// Add or remove a single subscriber's entry
+// Return value (add): False if out of memory
+bool tech_index_add(tech_index* idx, client_info const* entry);
+void tech_index_remove(tech_index* idx, client_info const* entry);
+
+
+// Build from every entry of a database or a B+tree file
+// Return value: False if out of memory
+bool tech_index_build(tech_index* idx, database const* db);
+bool tech_index_build_btree(tech_index* idx, btree const* bt);
+
+
+// Verdict for an access request; same rules as a lookup in the database
+packet_type tech_index_verdict(tech_index const* idx, subscriber_num num,
+  tech_type ttype);
+
+
+// Set-level queries
+size_t tech_index_count_entitled(tech_index const* idx, tech_type ttype);
+size_t tech_index_count_paid(tech_index const* idx, tech_type ttype);
+size_t tech_index_count_common(tech_index const* idx, tech_type t1,
+  tech_type t2);
+
+
+// Visit every subscriber entitled to 'ttype' who hasn't paid
+void tech_index_for_each_unpaid(tech_index const* idx, tech_type ttype,
+  roaring_fn fn, void* ctx);
+
+
+#endif // TECH_INDEX_H
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "seqstate.h"
+
+
+// Stress test for seq_window_accept(): N threads race to claim the same
+// sequence numbers of a table of clients, and every number must be
+// accepted exactly once. Each round covers a full window per client; every
+// thread tries all of it, in its own shuffled order, so the threads collide
+// on the same windows all the time. A barrier separates rounds, by which
+// time every number of the round must have been taken.
+
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_ROUNDS 20000
+
+
+typedef struct {
+  seq_slot* table;
+  size_t n_clients;
+  unsigned n_rounds;
+  unsigned* wins;           // Per (client, offset in window): accepts this
+                            // round
+  pthread_barrier_t barrier;
+  size_t n_failed;          // Numbers accepted other than once
+} stress_ctx;
+
+
+typedef struct {
+  stress_ctx* ctx;
+  unsigned idx;
+  size_t n_attempts;
+} stress_thread;
+
+
+// Helper; monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void* stress(void* arg) {
+  stress_thread* self = (stress_thread*)arg;
+  stress_ctx* ctx = self->ctx;
+  unsigned order[SEQ_WINDOW];
+  unsigned seed = self->idx + 1;
+
+
+  for (unsigned i = 0; i < SEQ_WINDOW; ++i) {
+    order[i] = i;
+  }
+
+  for (unsigned round = 0; round < ctx->n_rounds; ++round) {
+    sequence_num base = round * SEQ_WINDOW; // Modulo 256
+
+    // Fisher-Yates, so each thread takes the window in its own order
+    for (unsigned i = SEQ_WINDOW - 1; i > 0; --i) {
+      unsigned j = rand_r(&seed) % (i + 1);
+      unsigned t = order[i];
+
+      order[i] = order[j];
+      order[j] = t;
+    }
+
+    for (size_t c = 0; c < ctx->n_clients; ++c) {
+      for (unsigned i = 0; i < SEQ_WINDOW; ++i) {
+        int code = seq_window_accept(&ctx->table[c].win, base + order[i]);
+
+        ++self->n_attempts;
+        if (code == 0) {
+          __atomic_fetch_add(&ctx->wins[c * SEQ_WINDOW + order[i]], 1,
+            __ATOMIC_RELAXED);
+        } else if (code != DUP_PACK) {
+          __atomic_fetch_add(&ctx->n_failed, 1, __ATOMIC_RELAXED);
+        }
+      }
+    }
+
+    // Every number of the round is in; one thread checks, the rest wait
+    if (pthread_barrier_wait(&ctx->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+      for (size_t i = 0; i < ctx->n_clients * SEQ_WINDOW; ++i) {
+        ctx->n_failed += ctx->wins[i] != 1;
+        ctx->wins[i] = 0;
+      }
+    }
+    pthread_barrier_wait(&ctx->barrier);
+  }
+
+
+  return NULL;
+}
+
+
+int main(int argc, char** argv) {
+  unsigned n_threads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+  stress_ctx ctx;
+  stress_thread* threads;
+  pthread_t* ids;
+  size_t n_attempts = 0;
+  uint64_t start_ns, elapsed_ns;
+
+
+  if (argc > 4 || n_threads == 0) {
+    fprintf(stderr, "Usage: %s [threads] [clients] [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.n_clients = argc > 2 ? atoi(argv[2]) : DEFAULT_CLIENTS;
+  ctx.n_rounds = argc > 3 ? atoi(argv[3]) : DEFAULT_ROUNDS;
+
+  if (ctx.n_clients == 0
+      || posix_memalign((void**)&ctx.table, CACHE_LINE,
+        ctx.n_clients * sizeof(seq_slot)) != 0
+      || (ctx.wins = calloc(ctx.n_clients * SEQ_WINDOW, sizeof(unsigned)))
+        == NULL
+      || (threads = calloc(n_threads, sizeof(stress_thread))) == NULL
+      || (ids = calloc(n_threads, sizeof(pthread_t))) == NULL) {
+    fprintf(stderr, "test_seqwin: Out of memory!\n");
+    return 1;
+  }
+
+  memset(ctx.table, 0, ctx.n_clients * sizeof(seq_slot));
+  pthread_barrier_init(&ctx.barrier, NULL, n_threads);
+
+
+  start_ns = now_ns();
+
+  for (unsigned i = 0; i < n_threads; ++i) {
+    threads[i].ctx = &ctx;
+    threads[i].idx = i;
+    pthread_create(&ids[i], NULL, &stress, &threads[i]);
+  }
+
+  for (unsigned i = 0; i < n_threads; ++i) {
+    pthread_join(ids[i], NULL);
+    n_attempts += threads[i].n_attempts;
+  }
+
+  elapsed_ns = now_ns() - start_ns;
+
+
+  // Every window must have moved on by exactly what was sent, with nothing
+  // left marked
+  for (size_t c = 0; c < ctx.n_clients; ++c) {
+    sequence_num next;
+    uint64_t received;
+
+    seq_window_read(&ctx.table[c].win, &next, &received);
+    if (next != (sequence_num)(ctx.n_rounds * SEQ_WINDOW) || received != 0) {
+      fprintf(stderr, "test_seqwin: Client %lu's window is off: next %u, "
+        "received %#lx\n", c, next, received);
+      ++ctx.n_failed;
+    }
+  }
+
+  printf("test_seqwin: %u threads, %lu clients, %u rounds: %s; "
+    "%.1f Mattempts/s\n", n_threads, ctx.n_clients, ctx.n_rounds,
+    ctx.n_failed ? "FAILED" : "OK", n_attempts * 1e3 / elapsed_ns);
+
+
+  pthread_barrier_destroy(&ctx.barrier);
+  free(ids);
+  free(threads);
+  free(ctx.wins);
+  free(ctx.table);
+
+  return ctx.n_failed != 0;
+}
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+  return (int)syscall(SYS_io_uring_setup, entries, p);
+}
+
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+  unsigned flags) {
+  return (int)syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags,
+    NULL, 0);
+}
+
+
+// Helper; map one of the ring's regions
+static void* map_ring(int fd, size_t len, off_t offset) {
+  void* addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, offset);
+
+  return addr == MAP_FAILED ? NULL : addr;
+}
+
+
+bool uring_init(uring* ring, unsigned entries) {
+  struct io_uring_params params;
+
+
+  memset(ring, 0, sizeof(uring));
+  memset(&params, 0, sizeof(params));
+
+  if ((ring->fd = sys_io_uring_setup(entries, &params)) == -1) {
+    perror("uring_init: io_uring_setup() failed");
+    return false;
+  }
+
+  ring->entries = params.sq_entries;
+
+
+  // Rings and the SQE array
+  ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_len = params.cq_off.cqes
+    + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_len > ring->sq_ring_len) {
+      ring->sq_ring_len = ring->cq_ring_len;
+    }
+    ring->cq_ring_len = 0;
+  }
+
+  ring->sq_ring = map_ring(ring->fd, ring->sq_ring_len, IORING_OFF_SQ_RING);
+  ring->cq_ring = ring->cq_ring_len == 0 ? ring->sq_ring
+    : map_ring(ring->fd, ring->cq_ring_len, IORING_OFF_CQ_RING);
+  ring->sqes = map_ring(ring->fd, ring->sqes_len, IORING_OFF_SQES);
+
+  if (!ring->sq_ring || !ring->cq_ring || !ring->sqes) {
+    perror("uring_init: Couldn't map rings");
+    uring_destroy(ring);
+    return false;
+  }
+
+
+  uint8_t* sq = ring->sq_ring;
+  uint8_t* cq = ring->cq_ring;
+
+  ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+
+  return true;
+}
+
+
+void uring_destroy(uring* ring) {
+  if (ring->sqes) {
+    munmap(ring->sqes, ring->sqes_len);
+  }
+
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_len);
+  }
+
+  if (ring->sq_ring) {
+    munmap(ring->sq_ring, ring->sq_ring_len);
+  }
+
+  if (ring->fd > 0) {
+    close(ring->fd);
+  }
+
+  memset(ring, 0, sizeof(uring));
+  ring->fd = -1;
+}
+
+
+bool uring_submit_read(uring* ring, int fd, void* buf, size_t len,
+  off_t offset, uint64_t user_data) {
+  unsigned tail = *ring->sq_tail;
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+
+  if (tail - head >= ring->entries) {
+    return false;
+  }
+
+
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  int submitted;
+
+  do {
+    submitted = sys_io_uring_enter(ring->fd, 1, 0, 0);
+  } while (submitted == -1 && errno == EINTR);
+
+
+  // Without SQPOLL the kernel only takes entries during io_uring_enter(), so
+  // one it didn't take can be withdrawn; left queued, the next call would
+  // submit it, and its completion would land on a slot since reused
+  if (submitted != 1) {
+    if (__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) != tail) {
+      return true; // Taken after all; its completion will come
+    }
+
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    perror("uring_submit_read: io_uring_enter() failed");
+    return false;
+  }
+
+
+  return true;
+}
+
+
+bool uring_reap(uring* ring, uint64_t* user_data, int* res) {
+  unsigned head = *ring->cq_head;
+
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+
+
+  struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+
+  return true;
+}
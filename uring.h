@@ -0,0 +1,63 @@
+#ifndef URING_H
+#define URING_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+
+// Minimal io_uring wrapper on the raw syscalls (no liburing), just enough to
+// issue reads and reap their completions from a poll()-driven loop. The
+// ring's fd becomes readable whenever completions are waiting.
+
+
+typedef struct {
+  int fd;             // Ring fd; -1 if not set up
+  unsigned entries;
+
+  // Submission queue
+  void* sq_ring;
+  size_t sq_ring_len;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  size_t sqes_len;
+
+  // Completion queue
+  void* cq_ring;
+  size_t cq_ring_len;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+} uring;
+
+
+// Set up a ring with room for 'entries' requests in flight
+// Return value: True if OK, false if io_uring isn't available
+bool uring_init(uring* ring, unsigned entries);
+
+
+// Tear down a ring
+void uring_destroy(uring* ring);
+
+
+// Submit a read of 'len' bytes at 'offset' of 'fd' into 'buf'; 'user_data'
+// comes back with the completion.
+// Return value: True if submitted, false if the queue is full or on error;
+// on false, no completion will come for 'user_data'
+bool uring_submit_read(uring* ring, int fd, void* buf, size_t len,
+  off_t offset, uint64_t user_data);
+
+
+// Pop one completion without blocking
+// Return value: True and the outputs filled if there was a completion
+bool uring_reap(uring* ring, uint64_t* user_data, int* res);
+
+
+#endif // URING_H
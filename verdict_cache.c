@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "verdict_cache.h"
+
+
+#define CACHE_LINE 64
+#define SKETCH_ROWS 4
+#define SKETCH_MAX 15        // Counters saturate here...
+#define SKETCH_AGE_FACTOR 10 // ...and are halved every this many increments
+                             // per cache entry
+
+
+// Verdicts that can be cached; entries store the index
+static const packet_type verdicts[] = { NOT_EXIST, NOT_PAID, ACC_OK };
+
+
+// Helper; 64-bit mix of a subscriber number, seeded per use
+static uint64_t mix(subscriber_num num, uint64_t seed) {
+  uint64_t x = (num + seed) * 0x9E3779B97F4A7C15ULL;
+
+  x ^= x >> 31;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 29;
+
+
+  return x;
+}
+
+
+// Helper; sets are chosen by number alone, so invalidation sees every tech
+static vcache_set* set_of(verdict_cache* c, subscriber_num num) {
+  return &c->sets[mix(num, 0) & (c->n_sets - 1)];
+}
+
+
+// Helper; key for the sketch
+static subscriber_num sketch_key(subscriber_num num, tech_type ttype) {
+  return num ^ ((subscriber_num)ttype << 24) ^ ttype;
+}
+
+
+// Helper; estimated access frequency of a key
+static unsigned sketch_estimate(verdict_cache const* c, subscriber_num key) {
+  unsigned min = SKETCH_MAX;
+
+
+  for (size_t row = 0; row < SKETCH_ROWS; ++row) {
+    size_t i = mix(key, row + 1) & (c->sketch_width - 1);
+    uint8_t count = c->sketch[row * c->sketch_width + i];
+
+    if (count < min) {
+      min = count;
+    }
+  }
+
+
+  return min;
+}
+
+
+// Helper; count an access, aging the whole sketch now and then so that
+// yesterday's hot keys don't stay hot forever
+static void sketch_increment(verdict_cache* c, subscriber_num key) {
+  for (size_t row = 0; row < SKETCH_ROWS; ++row) {
+    size_t i = mix(key, row + 1) & (c->sketch_width - 1);
+    uint8_t* count = &c->sketch[row * c->sketch_width + i];
+
+    if (*count < SKETCH_MAX) {
+      ++*count;
+    }
+  }
+
+
+  if (++c->n_increments >= SKETCH_AGE_FACTOR * c->n_sets * VCACHE_WAYS) {
+    for (size_t i = 0; i < SKETCH_ROWS * c->sketch_width; ++i) {
+      c->sketch[i] >>= 1;
+    }
+
+    c->n_increments = 0;
+  }
+}
+
+
+bool verdict_cache_init(verdict_cache* c, size_t n_entries) {
+  memset(c, 0, sizeof(verdict_cache));
+
+
+  c->n_sets = 1;
+  while (c->n_sets * VCACHE_WAYS < n_entries) {
+    c->n_sets *= 2;
+  }
+
+  c->sketch_width = c->n_sets * VCACHE_WAYS * 4;
+
+
+  if (posix_memalign((void**)&c->sets, CACHE_LINE,
+        c->n_sets * sizeof(vcache_set)) != 0) {
+    c->sets = NULL;
+    fprintf(stderr, "verdict_cache_init: Out of memory!\n");
+    return false;
+  }
+
+  c->hands = calloc(c->n_sets, sizeof(uint8_t));
+  c->sketch = calloc(SKETCH_ROWS * c->sketch_width, sizeof(uint8_t));
+
+  if (!c->hands || !c->sketch) {
+    fprintf(stderr, "verdict_cache_init: Out of memory!\n");
+    verdict_cache_destroy(c);
+    return false;
+  }
+
+  memset(c->sets, 0, c->n_sets * sizeof(vcache_set));
+
+
+  return true;
+}
+
+
+void verdict_cache_destroy(verdict_cache* c) {
+  free(c->sets);
+  free(c->hands);
+  free(c->sketch);
+  memset(c, 0, sizeof(verdict_cache));
+}
+
+
+bool verdict_cache_get(verdict_cache* c, subscriber_num num, tech_type ttype,
+  packet_type* verdict) {
+  vcache_set* set = set_of(c, num);
+
+
+  sketch_increment(c, sketch_key(num, ttype));
+
+  for (size_t i = 0; i < VCACHE_WAYS; ++i) {
+    vcache_entry* e = &set->ways[i];
+
+    if (e->valid && e->number == num && e->ttype == ttype) {
+      e->ref = 1;
+      *verdict = verdicts[e->verdict];
+      ++c->n_hits;
+      return true;
+    }
+  }
+
+
+  ++c->n_misses;
+  return false;
+}
+
+
+void verdict_cache_put(verdict_cache* c, subscriber_num num, tech_type ttype,
+  packet_type verdict) {
+  size_t set_index = set_of(c, num) - c->sets;
+  vcache_set* set = &c->sets[set_index];
+  vcache_entry* victim = NULL;
+  uint8_t code;
+
+
+  for (code = 0; code < sizeof(verdicts) / sizeof(verdicts[0]); ++code) {
+    if (verdicts[code] == verdict) {
+      break;
+    }
+  }
+
+  if (code == sizeof(verdicts) / sizeof(verdicts[0])) {
+    return; // Not a final verdict (e.g. TRY_LATER)
+  }
+
+
+  // A free way needs no admission check
+  for (size_t i = 0; i < VCACHE_WAYS && !victim; ++i) {
+    if (!set->ways[i].valid) {
+      victim = &set->ways[i];
+    }
+  }
+
+
+  // Otherwise CLOCK picks the victim, and the sketch decides whether the new
+  // key is worth more than it
+  if (!victim) {
+    uint8_t hand = c->hands[set_index];
+
+    while (set->ways[hand].ref) {
+      set->ways[hand].ref = 0;
+      hand = (hand + 1) % VCACHE_WAYS;
+    }
+
+    victim = &set->ways[hand];
+    c->hands[set_index] = (hand + 1) % VCACHE_WAYS;
+
+    if (sketch_estimate(c, sketch_key(num, ttype))
+        < sketch_estimate(c, sketch_key(victim->number, victim->ttype))) {
+      ++c->n_rejected;
+      return;
+    }
+  }
+
+
+  victim->number = num;
+  victim->ttype = ttype;
+  victim->verdict = code;
+  victim->valid = 1;
+  victim->ref = 0;
+  ++c->n_admitted;
+}
+
+
+void verdict_cache_invalidate(verdict_cache* c, subscriber_num num) {
+  vcache_set* set = set_of(c, num);
+
+
+  for (size_t i = 0; i < VCACHE_WAYS; ++i) {
+    if (set->ways[i].number == num) {
+      set->ways[i].valid = 0;
+    }
+  }
+}
+
+
+void verdict_cache_dump_stats(verdict_cache const* c) {
+  size_t total = c->n_hits + c->n_misses;
+
+
+  fprintf(stderr, "verdict cache: %lu entries, hits = %lu, misses = %lu, "
+    "hit rate = %.1f%%, admitted = %lu, rejected = %lu\n",
+    c->n_sets * VCACHE_WAYS, c->n_hits, c->n_misses,
+    total ? 100.0 * c->n_hits / total : 0.0, c->n_admitted, c->n_rejected);
+}
@@ -0,0 +1,80 @@
+#ifndef VERDICT_CACHE_H
+#define VERDICT_CACHE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "database.h"
+#include "packet.h"
+
+
+// Small front cache of final verdicts (ACC_OK/NOT_PAID/NOT_EXIST) per
+// (subscriber, tech), for skewed traffic where a few subscribers make most of
+// the requests. It's set-associative, one 64-byte line per set, with CLOCK
+// replacement inside a set. A new key only replaces a victim if a count-min
+// sketch says it's been asked for at least as often (TinyLFU admission), so
+// one-off lookups can't flush the hot set. Not thread-safe.
+
+
+#define VCACHE_WAYS 8
+
+
+typedef struct {
+  subscriber_num number;
+  tech_type ttype;
+  uint8_t verdict;  // Index into the verdict table in verdict_cache.c
+  uint8_t valid;
+  uint8_t ref;      // CLOCK reference bit
+} vcache_entry;
+
+
+typedef struct {
+  vcache_entry ways[VCACHE_WAYS];
+} vcache_set;
+
+
+typedef struct {
+  vcache_set* sets;
+  uint8_t* hands;       // CLOCK hand per set
+  size_t n_sets;        // Power of 2
+  uint8_t* sketch;      // Count-min sketch; 4 rows of sketch_width counters
+  size_t sketch_width;  // Power of 2
+  size_t n_increments;  // Since the sketch was last aged
+  size_t n_hits;        // Statistics
+  size_t n_misses;
+  size_t n_admitted;
+  size_t n_rejected;
+} verdict_cache;
+
+
+// Allocate a cache of (at least) 'n_entries' entries
+// Return value: True if OK, false if allocation failed
+bool verdict_cache_init(verdict_cache* c, size_t n_entries);
+
+
+// Free a cache
+void verdict_cache_destroy(verdict_cache* c);
+
+
+// Lookup a cached verdict
+// Return value: True and 'verdict' filled on a hit, false on a miss
+bool verdict_cache_get(verdict_cache* c, subscriber_num num, tech_type ttype,
+  packet_type* verdict);
+
+
+// Offer a verdict after a miss; it's only kept if admission allows
+void verdict_cache_put(verdict_cache* c, subscriber_num num, tech_type ttype,
+  packet_type verdict);
+
+
+// Drop every cached verdict for a subscriber (all techs)
+void verdict_cache_invalidate(verdict_cache* c, subscriber_num num);
+
+
+// Print hit rate and admission statistics
+void verdict_cache_dump_stats(verdict_cache const* c);
+
+
+#endif // VERDICT_CACHE_H
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "watch.h"
+
+
+// Helper; monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Helper; home slot of a number
+static size_t slot_of(watch_table const* w, subscriber_num num) {
+  uint64_t x = num * 0x9E3779B97F4A7C15ULL;
+
+
+  return (x ^ (x >> 32)) & (w->n_slots - 1);
+}
+
+
+// Helper; whether a slot belongs to a client
+static bool same_client(watch_entry const* e, client_id id,
+  struct sockaddr_in const* addr) {
+  return e->id == id && e->addr.sin_addr.s_addr == addr->sin_addr.s_addr
+    && e->addr.sin_port == addr->sin_port;
+}
+
+
+// Helper; drop expired slots by reinserting the live ones into a clean
+// array; runs only ever grow otherwise
+static void compact(watch_table* w, uint64_t now) {
+  watch_entry* old = w->slots;
+  size_t n_old = w->n_slots;
+
+
+  if ((w->slots = calloc(n_old, sizeof(watch_entry))) == NULL) {
+    w->slots = old;
+    return;
+  }
+
+  w->n_used = 0;
+
+  for (size_t i = 0; i < n_old; ++i) {
+    size_t j;
+
+    if (!old[i].used || old[i].expires_ns <= now) {
+      continue;
+    }
+
+    for (j = slot_of(w, old[i].number); w->slots[j].used;
+        j = (j + 1) & (w->n_slots - 1));
+    w->slots[j] = old[i];
+    ++w->n_used;
+  }
+
+  free(old);
+}
+
+
+bool watch_init(watch_table* w, size_t capacity, int fd) {
+  memset(w, 0, sizeof(watch_table));
+
+
+  // At most half full, so probe runs stay short
+  w->n_slots = 1;
+  while (w->n_slots < 2 * capacity) {
+    w->n_slots *= 2;
+  }
+
+  if ((w->slots = calloc(w->n_slots, sizeof(watch_entry))) == NULL) {
+    fprintf(stderr, "watch_init: Out of memory!\n");
+    return false;
+  }
+
+  w->fd = fd;
+
+
+  return true;
+}
+
+
+void watch_destroy(watch_table* w) {
+  free(w->slots);
+  memset(w, 0, sizeof(watch_table));
+}
+
+
+bool watch_add(watch_table* w, subscriber_num num, client_id id,
+  struct sockaddr_in const* addr) {
+  uint64_t now = now_ns();
+  watch_entry* free_slot = NULL; // First reusable slot in the run
+  size_t i;
+
+
+  if (w->n_used * 4 >= w->n_slots * 3) {
+    compact(w, now);
+  }
+
+
+  // Renew an existing lease, or remember where a new one could go
+  for (i = slot_of(w, num); w->slots[i].used; i = (i + 1) & (w->n_slots - 1)) {
+    watch_entry* e = &w->slots[i];
+
+    if (e->number == num && same_client(e, id, addr)) {
+      e->expires_ns = now + SUBSCRIBE_LEASE_SEC * 1000000000ULL;
+      ++w->n_subscribed;
+      return true;
+    }
+
+    if (!free_slot && e->expires_ns <= now) {
+      free_slot = e;
+    }
+  }
+
+  if (!free_slot) {
+    if (w->n_used * 4 >= w->n_slots * 3) {
+      ++w->n_full;
+      return false;
+    }
+
+    free_slot = &w->slots[i];
+    ++w->n_used;
+  }
+
+
+  free_slot->number = num;
+  free_slot->id = id;
+  free_slot->used = true;
+  free_slot->addr = *addr;
+  free_slot->expires_ns = now + SUBSCRIBE_LEASE_SEC * 1000000000ULL;
+  ++w->n_subscribed;
+
+
+  return true;
+}
+
+
+void watch_invalidate(watch_table* w, subscriber_num num) {
+  uint64_t now = now_ns();
+
+
+  for (size_t i = slot_of(w, num); w->slots[i].used;
+      i = (i + 1) & (w->n_slots - 1)) {
+    watch_entry const* e = &w->slots[i];
+
+    if (e->number != num || e->expires_ns <= now) {
+      continue;
+    }
+
+    if (w->n_pending == WATCH_PENDING) {
+      watch_flush(w);
+    }
+
+    w->pending[w->n_pending].addr = e->addr;
+    w->pending[w->n_pending].id = e->id;
+    w->pending[w->n_pending].number = num;
+    ++w->n_pending;
+  }
+}
+
+
+// Helper; for use with qsort(); groups invalidations by client
+static int compare_pending(void const* a, void const* b) {
+  watch_pending const* x = (watch_pending const*)a;
+  watch_pending const* y = (watch_pending const*)b;
+  uint64_t kx = ((uint64_t)x->addr.sin_addr.s_addr << 16) | x->addr.sin_port;
+  uint64_t ky = ((uint64_t)y->addr.sin_addr.s_addr << 16) | y->addr.sin_port;
+
+
+  if (kx != ky) {
+    return (kx > ky) - (kx < ky);
+  }
+
+  if (x->id != y->id) {
+    return (x->id > y->id) - (x->id < y->id);
+  }
+
+  return (x->number > y->number) - (x->number < y->number);
+}
+
+
+// Helper; send one INVALIDATE packet
+static void send_invalidate(watch_table* w, watch_pending const* to,
+  subscriber_num const* nums, size_t n_nums) {
+  uint8_t buf[BUFSIZ];
+  packet_info pi;
+
+
+  pi.type = INVALIDATE;
+  pi.id = to->id;
+  pi.cont.data_info.seq_num = 0; // Not sequenced
+  pi.cont.data_info.len = n_nums * sizeof(subscriber_num);
+  pi.cont.data_info.payload = nums;
+
+  size_t len = flatten(&pi, buf, sizeof(buf));
+
+  if (sendto(w->fd, buf, len, 0, (struct sockaddr const*)&to->addr,
+        sizeof(struct sockaddr_in)) == -1) {
+    perror("watch_flush: Unable to send invalidation");
+    return;
+  }
+
+  w->n_invalidated += n_nums;
+  ++w->n_packets;
+}
+
+
+void watch_flush(watch_table* w) {
+  subscriber_num nums[SUBSCRIBE_MAX_NUMS]; // Network order
+  size_t n_nums = 0;
+
+
+  if (w->n_pending == 0) {
+    return;
+  }
+
+  qsort(w->pending, w->n_pending, sizeof(watch_pending), &compare_pending);
+
+
+  // One packet per client, unless it has more than fit in one
+  for (size_t i = 0; i < w->n_pending; ++i) {
+    watch_pending const* p = &w->pending[i];
+
+    // Numbers changed more than once go out once
+    if (i == 0 || compare_pending(p, p - 1) != 0) {
+      nums[n_nums++] = htonl(p->number);
+    }
+
+    if (n_nums == SUBSCRIBE_MAX_NUMS || i + 1 == w->n_pending
+        || p[1].id != p->id
+        || p[1].addr.sin_addr.s_addr != p->addr.sin_addr.s_addr
+        || p[1].addr.sin_port != p->addr.sin_port) {
+      if (n_nums > 0) {
+        send_invalidate(w, p, nums, n_nums);
+      }
+      n_nums = 0;
+    }
+  }
+
+  w->n_pending = 0;
+}
+
+
+void watch_dump_stats(watch_table const* w) {
+  fprintf(stderr, "watch: %lu of %lu slots used, %lu subscriptions taken, "
+    "%lu refused (full), %lu invalidations pushed in %lu packets\n",
+    w->n_used, w->n_slots, w->n_subscribed, w->n_full, w->n_invalidated,
+    w->n_packets);
+}
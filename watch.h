@@ -0,0 +1,90 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/ip.h>
+
+#include "database.h"
+#include "packet.h"
+
+
+// Subscriptions of clients to subscriber numbers, for pushing INVALIDATE
+// packets when a row's verdict may have changed. Each subscription is a
+// lease of SUBSCRIBE_LEASE_SEC, renewed by subscribing again; clients that
+// go away simply stop renewing. Invalidations are best effort (one UDP
+// packet, not ACKed), so a client may trust a cached verdict only as long as
+// its lease runs.
+//
+// The table is open-addressed on the subscriber number alone, so all of a
+// number's watchers sit in one probe run. Expired slots are reused in place
+// and never emptied, which keeps runs intact without tombstones. Invalidated
+// numbers are queued and sent in batches, one packet per client for up to
+// SUBSCRIBE_MAX_NUMS numbers, by watch_flush(). Not thread-safe.
+
+
+#define WATCH_PENDING 4096 // Invalidations queued before a forced flush
+
+
+typedef struct {
+  subscriber_num number;
+  client_id id;
+  bool used;               // Never cleared once set
+  struct sockaddr_in addr; // Where the client listens
+  uint64_t expires_ns;     // CLOCK_MONOTONIC
+} watch_entry;
+
+
+// An invalidation waiting to be sent
+typedef struct {
+  struct sockaddr_in addr;
+  client_id id;
+  subscriber_num number;
+} watch_pending;
+
+
+typedef struct {
+  watch_entry* slots;
+  size_t n_slots;          // Power of 2
+  size_t n_used;           // Slots ever used
+  watch_pending pending[WATCH_PENDING];
+  size_t n_pending;
+  int fd;                  // Socket invalidations are sent from
+  size_t n_subscribed;     // Statistics: subscriptions taken or renewed...
+  size_t n_full;           // ...refused because the table was full...
+  size_t n_invalidated;    // ...invalidations sent...
+  size_t n_packets;        // ...in this many packets
+} watch_table;
+
+
+// Allocate a table for (at least) 'capacity' subscriptions, sending from
+// socket 'fd'
+// Return value: True if OK, false if allocation failed
+bool watch_init(watch_table* w, size_t capacity, int fd);
+
+
+// Free a table
+void watch_destroy(watch_table* w);
+
+
+// Subscribe a client to a number, or renew its lease
+// Return value: True if OK, false if the table is full
+bool watch_add(watch_table* w, subscriber_num num, client_id id,
+  struct sockaddr_in const* addr);
+
+
+// Queue invalidations of a number for every client holding a lease on it
+void watch_invalidate(watch_table* w, subscriber_num num);
+
+
+// Send the queued invalidations
+void watch_flush(watch_table* w);
+
+
+// Print statistics
+void watch_dump_stats(watch_table const* w);
+
+
+#endif // WATCH_H